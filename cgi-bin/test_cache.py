@@ -0,0 +1,11 @@
+#!/usr/bin/env python3
+"""Test script for fastcgi_cache - every run answers differently"""
+import os
+import time
+
+query = dict(p.split('=', 1) for p in os.environ.get('QUERY_STRING', '').split('&') if '=' in p)
+
+print("Content-Type: text/plain")
+print(f"Cache-Control: max-age={query.get('ttl', '60')}, stale-while-revalidate={query.get('swr', '0')}")
+print()
+print(f"generated: {time.time():.6f}")
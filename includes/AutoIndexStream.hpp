@@ -0,0 +1,55 @@
+#pragma once
+
+#include "ResponseStream.hpp"
+
+#include <string>
+#include <vector>
+
+// Directory listing emitted batch by batch as the kernel hands back entries
+// (getdents64 on Linux, readdir elsewhere). Supports offset/limit pagination
+// and a compact JSON rendering for tooling.
+class AutoIndexStream : public ResponseStream
+{
+public:
+    enum Format
+    {
+        FORMAT_HTML,
+        FORMAT_JSON
+    };
+
+    AutoIndexStream(const std::string &uri, const std::string &dirPath,
+                    Format format, size_t offset, size_t limit);
+    ~AutoIndexStream();
+
+    bool open();
+    Status pull(std::string &out);
+
+    static const char *contentType(Format format);
+
+private:
+    enum Phase
+    {
+        PHASE_HEAD,
+        PHASE_ENTRIES,
+        PHASE_DONE
+    };
+
+    bool readBatch(std::string &out);
+    void appendEntry(std::string &out, const char *name, unsigned char type);
+    void appendHead(std::string &out) const;
+    void appendFooter(std::string &out) const;
+
+    std::string uri;
+    std::string dirPath;
+    Format format;
+    size_t offset;
+    size_t limit;
+
+    Phase phase;
+    int dir_fd;
+    void *dir; // DIR* on non-Linux builds
+    std::vector<char> batch;
+    size_t seen;    // entries walked past (including skipped by offset)
+    size_t emitted; // entries written to the client
+    bool has_more;
+};
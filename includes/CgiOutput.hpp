@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Turns what a script writes (CGI header block, blank line, body) into an
+// HTTP response. Shared by FastCGI and plain CGI.
+namespace cgi_output {
+
+// End of the header block, npos while it is incomplete; body_start is set
+// past the blank line
+std::string::size_type findHeaderEnd(const std::string &data, size_t &body_start);
+
+// Status line and headers. body_length is npos while the body still
+// streams: it is then chunked on HTTP/1.1 and chunked is set.
+std::string buildHead(const std::string &version, const std::string &header_block,
+                      size_t body_length, bool &chunked);
+
+// Whole response from complete output
+std::string buildResponse(const std::string &version, const std::string &output);
+
+std::string buildError(const std::string &version, int code, const std::string &reason,
+                       const std::string &body);
+
+} // namespace cgi_output
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Config.hpp"
+#include "EventLoop.hpp"
+#include "HttpRequest.hpp"
+#include "ResponseStream.hpp"
+
+#include <string>
+#include <vector>
+
+// One classic CGI run: the location's cgi_path is forked with the script as
+// its argument and a CGI/1.1 environment. Both pipes are non-blocking and
+// watched by the worker's loop, so the request body is written to the
+// script's stdin as it arrives and its output is forwarded as it is
+// produced, the same way as a FastCGI reply. Exited children are collected
+// by the worker's CgiReaper.
+class CgiProcess : public ResponseStream, public IoHandler
+{
+public:
+    // Everything needed from request is copied here: the request object
+    // does not outlive createResponse.
+    CgiProcess(const HttpRequest &request,
+               const ServerConfig &server_config,
+               const LocationConfig &location_config,
+               const std::string &script_path);
+    ~CgiProcess();
+
+    // ResponseStream
+    void attach(const StreamContext &ctx, int client_fd);
+    Status pull(std::string &out);
+    bool feedBody(const char *data, size_t len, bool last);
+
+    // Pipe readiness
+    void handleIo(int fd, unsigned int events);
+
+private:
+    CgiProcess(const CgiProcess &);
+    CgiProcess &operator=(const CgiProcess &);
+
+    std::vector<std::string> buildEnv(const HttpRequest &request) const;
+    bool spawn();
+    void writeInput();
+    void readOutput();
+    void closeInput();
+    void closeOutput();
+    void updateInterest();
+    void finish(const std::string &response);
+    void wake();
+
+    const ServerConfig &server;
+    const LocationConfig &location;
+    std::string script;
+    std::string version;
+    std::vector<std::string> env;
+
+    StreamContext context;
+    int client_fd;
+    pid_t pid;        // -1 until spawned
+    int in_fd;        // script's stdin, -1 once closed
+    int out_fd;       // script's stdout, -1 once at EOF
+    unsigned int in_watch;  // events registered for in_fd
+    unsigned int out_watch; // for out_fd
+
+    std::string input;  // body bytes not written yet
+    size_t input_offset;
+    bool input_last;    // the final piece is in input
+    bool client_paused; // feedBody asked the client to stop
+
+    std::string header_buf; // stdout until the CGI header block ends
+    std::string head;       // HTTP status line and headers, sent first
+    std::string pending;    // body bytes not pulled yet
+    bool head_ready;
+    bool head_sent;
+    bool want_chunked;
+    bool paused; // stdout reads stopped until pending drains
+    bool done;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "EventLoop.hpp"
+
+#include <map>
+#include <sys/types.h>
+#include <vector>
+
+// Reaps the CGI children of one worker without blocking its loop. Each
+// child gets a pidfd watched by the loop; where pidfd_open is missing the
+// children are polled with waitpid from reap(). A pid is only signalled
+// while it is known unreaped, so a recycled pid is never hit.
+class CgiReaper : public IoHandler
+{
+public:
+    explicit CgiReaper(EventLoop &loop);
+    ~CgiReaper();
+
+    void watch(pid_t pid);
+    // SIGKILL, unless the child already exited
+    void kill(pid_t pid);
+    // Polls children without a pidfd; called from the server loop
+    void reap();
+
+    void handleIo(int fd, unsigned int events);
+
+private:
+    CgiReaper(const CgiReaper &);
+    CgiReaper &operator=(const CgiReaper &);
+
+    static bool collect(pid_t pid);
+
+    EventLoop &loop;
+    std::map<int, pid_t> pidfds;
+    std::vector<pid_t> polled;
+};
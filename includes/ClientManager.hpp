@@ -2,7 +2,14 @@
 
 #pragma once
 
+#include "CgiReaper.hpp"
 #include "Config.hpp"
+#include "EventLoop.hpp"
+#include "FastCgiPool.hpp"
+#include "HttpRequest.hpp"
+#include "ProxyPool.hpp"
+#include "ResponseStream.hpp"
+#include "VirtualHosts.hpp"
 #include "ext_libs.hpp"
 #include "macros.hpp"
 #include <map>
@@ -13,51 +20,72 @@ struct Client {
         : socket_fd(-1)
         , last_activity(0)
         , address()
+        , port(0)
+        , server(NULL)
         , is_active(false)
         , recv_buffer()
+        , send_buffer()
+        , send_offset(0)
+        , stream(NULL)
+        , body_remaining(0)
+        , read_paused(false)
+        , write_parked(false)
     {
     }
 
     int socket_fd;
     time_t last_activity;
     struct sockaddr_in address;
+    int port;                   // local port it connected to
+    const ServerConfig *server; // port's default server until Host is read
     bool is_active;
     // Incremental request buffer for this client
     std::string recv_buffer;
+    // Outgoing bytes not yet accepted by the socket
+    std::string send_buffer;
+    size_t send_offset;
+    // Streamed body pulled once send_buffer drains (owned)
+    ResponseStream *stream;
+    // Request body bytes still to be fed to stream as they arrive
+    size_t body_remaining;
+    bool read_paused;  // stream asked us to stop reading the body
+    bool write_parked; // stream has nothing to send yet
 };
 
-class ClientManager
+class ClientManager : public IoHandler, public StreamWaker
 {
 private:
-    const ServerConfig& config;
+    const VirtualHosts& vhosts;
+    EventLoop& loop;
     std::map<int, Client> clients;
+    FastCgiPool fastcgi_pool; // upstream sockets shared by this worker's clients
+    CgiReaper cgi_reaper;     // CGI children started for them
+    ProxyPool proxy_pool;     // kept-alive proxy_pass sockets
     enum ReadResult
     {
         READ_OK,
         READ_CLOSED,
         READ_ERROR
     };
-    
+
 public:
-    ClientManager(const ServerConfig & config);
+    ClientManager(const VirtualHosts & vhosts, EventLoop & loop);
     ~ClientManager();
-    
-    bool addClient(int socket_fd, const struct sockaddr_in& addr);
+
+    bool addClient(int socket_fd, const struct sockaddr_in& addr, int port);
     void removeClient(int socket_fd);
-    
+
     void updateActivity(int socket_fd);
     void checkTimeouts();
-    
-    // poll based processing
-    void processClientRequestPoll(const std::vector<int>& readable_fds);
-
-    // iteration access for building pollfd list
-    std::map<int, Client>::const_iterator clientsBegin() const { return clients.begin(); }
-    std::map<int, Client>::const_iterator clientsEnd() const { return clients.end(); }
-    
+
+    // readiness dispatched by the event loop for client sockets
+    void handleIo(int socket_fd, unsigned int events);
+    // an upstream-backed stream has data for this client
+    void wake(int socket_fd);
+
     int getClientCount() const;
     bool isFull() const;
-    
+
 private:
     std::string readFullRequest(int socket_fd);
 
@@ -69,4 +97,14 @@ private:
     //  - body bytes >= parsed Content-Length
     // chunked transfer-encoding is not handled here.
 
+    // Picks the server block from the Host header once the head is in
+    const ServerConfig &resolveServer(Client &cli);
+
+    // Response side; both return false once the client has been removed
+    bool handleReadable(int socket_fd);
+    bool flushClient(int socket_fd);
+    bool startResponse(int socket_fd, Client &cli, const HttpRequest &request);
+    void feedBody(Client &cli, const std::string &data);
+    void updateInterest(int socket_fd, const Client &cli);
+
 };
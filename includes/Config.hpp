@@ -1,6 +1,47 @@
 #pragma once
 
 #include "ext_libs.hpp"
+#include "ErrorPages.hpp"
+#include "LocationRouter.hpp"
+#include "MimeTypes.hpp"
+
+enum UpstreamBalance
+{
+    BALANCE_ROUND_ROBIN, // smooth weighted round-robin
+    BALANCE_LEAST_CONN,  // fewest outstanding requests per weight
+    BALANCE_EWMA         // lowest smoothed response latency, scaled by load
+};
+
+struct UpstreamServer
+{
+    std::string address;    // same forms as fastcgi_pass
+    unsigned int weight;
+    unsigned int max_fails; // failures within fail_timeout before the server is skipped, 0 = never
+    int fail_timeout;       // seconds; also how long a failed server is skipped
+};
+
+// upstream <name> { ... } at the top level; fastcgi_pass <name> selects it
+struct UpstreamConfig
+{
+    std::string name;
+    std::vector<UpstreamServer> servers;
+    UpstreamBalance balance;
+    int health_interval;        // seconds between active probes, 0 = passive only
+    int health_timeout;         // seconds a probe may take to connect
+    unsigned int health_fails;  // consecutive failed probes to take a server out
+    unsigned int health_passes; // consecutive good probes to bring it back
+};
+
+// fastcgi_spawn at the top level: FastCGI workers the master process runs
+// and supervises itself, accepting on a socket it binds
+struct FastCgiSpawnConfig
+{
+    std::string address;           // same forms as fastcgi_pass
+    std::vector<std::string> argv; // program, then its arguments
+    unsigned int min_spare;        // workers kept free beyond the load, and the floor when idle
+    unsigned int max_children;
+    unsigned int php_max_requests; // workers are recycled after that many, 0 = never
+};
 
 struct LocationConfig
 {
@@ -9,10 +50,35 @@ struct LocationConfig
     std::vector<std::string> allowed_methods;
     bool has_methods;
     bool autoindex;
+    bool internal; // only reachable through a script's X-Accel-Redirect
+    std::string autoindex_format; // "html" (default) or "json"
     std::string upload_dir;
     std::vector<std::string> cgi_extensions;
     std::string cgi_path;
-    std::string fastcgi_pass; // host:port or unix socket path
+    std::string fastcgi_pass; // host:port, unix:/path or an upstream name
+    size_t fastcgi_keepalive; // idle upstream sockets kept per endpoint, 0 = close after each request
+    int fastcgi_keepalive_timeout; // seconds an idle socket waits for reuse
+    int fastcgi_keepalive_lifetime; // seconds before a socket is retired
+    size_t fastcgi_spool_threshold; // request body bytes queued upstream before spooling to disk, 0 = off
+    int fastcgi_connect_timeout; // seconds to establish the upstream connection
+    int fastcgi_send_timeout;    // seconds a write to the backend may stall
+    int fastcgi_read_timeout;    // seconds between two reads from the backend
+    unsigned int fastcgi_next_upstream_tries; // servers tried per idempotent request, 1 = no retry
+    std::string fastcgi_cache; // fastcgi_cache_zone serving this location, empty = off
+    int fastcgi_cache_valid;   // seconds to cache a reply that states no freshness, 0 = don't
+    std::vector<std::string> fastcgi_cache_key_headers; // request headers added to the cache key
+    bool fastcgi_cache_lock;        // identical misses wait for the first one instead of going upstream
+    int fastcgi_cache_lock_timeout; // seconds a waiter waits before going upstream itself
+    std::string fastcgi_static_params; // FCGI_PARAMS pairs equal for every request, encoded at config load
+    std::string fastcgi_mirror;          // backend receiving copies of requests (as fastcgi_pass), empty = off
+    unsigned int fastcgi_mirror_percent; // share of requests copied
+    std::string proxy_pass;  // resolved ip:port of an http:// proxy_pass, empty = off
+    std::string proxy_host;  // host[:port] as written, sent as Host
+    std::string proxy_uri;   // replaces the location prefix when non-empty
+    size_t proxy_keepalive;  // idle upstream sockets kept per target, 0 = close after each request
+    int proxy_keepalive_timeout; // seconds an idle socket waits for reuse
+    int proxy_connect_timeout;   // seconds to establish the upstream connection
+    int proxy_read_timeout;      // seconds the upstream may stay silent
     // whether methods were explicitly set in this location
     bool has_return;
     int return_code;
@@ -22,20 +88,34 @@ struct LocationConfig
 struct ServerConfig
 {
     int port;
-    std::string server_name;
+    bool default_server; // "listen <port> default_server"
+    std::string server_name; // the first of server_names, used in logs and CGI
+    std::vector<std::string> server_names; // matched against Host, wildcards allowed
     std::string root;
     std::vector<std::string> index_files;
     std::map<int, std::string> error_pages;
     size_t client_max_body_size;
     int client_timeout;
+    int shutdown_timeout; // seconds in-flight clients get once the worker stops
     std::vector<std::string> allowed_methods;
     std::vector<LocationConfig> locations;
+    LocationRouter router; // compiled from locations once the block is parsed
+    MimeTypes mime_types;  // compiled-in defaults + types blocks
+    ErrorPages error_cache; // error_pages preloaded and pre-serialized
+    std::map<std::string, UpstreamConfig> upstreams; // every upstream block in the file
+    std::map<std::string, FastCgiSpawnConfig> fastcgi_spawns; // by address
+    std::map<std::string, size_t> cache_zones; // fastcgi_cache_zone name -> arena bytes
+    int worker_processes; // global: workers sharing every listener
 };
 
 class Config
 {
 private:
     std::vector<ServerConfig> servers;
+    std::map<std::string, UpstreamConfig> upstreams;
+    std::map<std::string, FastCgiSpawnConfig> fastcgi_spawns;
+    std::map<std::string, size_t> cache_zones;
+    std::string config_dir; // base for relative include paths
     
 public:
     Config(const std::string& config_path);
@@ -47,6 +127,10 @@ private:
     void parseConfigFile(const std::string& path);
     ServerConfig parseServerBlock(std::ifstream& file, std::string& line, const ServerConfig& defaults);
     LocationConfig parseLocationBlock(std::ifstream& file, const std::string& location_path);
+    void parseTypesBlock(std::ifstream& file, const std::string& header, MimeTypes& types);
+    void includeTypesFile(const std::string& path, MimeTypes& types);
+    void parseUpstreamBlock(std::ifstream& file, const std::string& header);
+    void parseSpawnDirective(const std::vector<std::string>& tokens);
     std::vector<std::string> split(const std::string& str, char delimiter);
     void trim(std::string& str);
 };
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "MimeTypes.hpp"
+
+#include <ctime>
+#include <map>
+#include <string>
+
+// Error responses serialized once and served from memory. Entries hold the
+// whole response except the leading HTTP version, which is the only part
+// that depends on the request.
+class ErrorPages
+{
+public:
+    ErrorPages();
+
+    // Reads every configured error_page file. Targets are URIs resolved
+    // against root (falling back to the literal path).
+    void load(const std::map<int, std::string> &pages, const std::string &root,
+              const MimeTypes &types);
+
+    // Custom page for code, or the built-in one when none is configured or
+    // the file is unreadable. Custom files are re-read when their mtime moves.
+    const std::string &find(int code) const;
+
+    size_t loaded() const;
+
+private:
+    struct Page
+    {
+        std::string path;
+        std::string type;
+        time_t mtime;
+        time_t checked;
+        bool ok;
+        std::string response;
+    };
+
+    static bool readPage(int code, Page &page);
+    static std::string serialize(int code, const std::string &type, const std::string &body);
+
+    mutable std::map<int, Page> custom;
+    mutable std::map<int, std::string> builtin;
+};
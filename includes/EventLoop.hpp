@@ -0,0 +1,62 @@
+#pragma once
+
+#include "ext_libs.hpp"
+
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+// Readiness flags shared by every fd owner (listener, clients, upstreams...)
+enum IoEventFlags
+{
+    IO_READ = 1,
+    IO_WRITE = 2,
+    IO_ERROR = 4,
+    IO_HUP = 8
+};
+
+class IoHandler
+{
+public:
+    virtual ~IoHandler() {}
+    virtual void handleIo(int fd, unsigned int events) = 0;
+};
+
+// Thin wrapper around epoll (Linux) / poll (macOS) that dispatches readiness
+// to whichever IoHandler registered the fd.
+class EventLoop
+{
+public:
+    EventLoop();
+    ~EventLoop();
+
+    bool init();
+    bool add(int fd, unsigned int events, IoHandler *handler);
+    bool modify(int fd, unsigned int events);
+    void remove(int fd);
+    bool isWatched(int fd) const;
+
+    // Waits up to timeout_ms and dispatches ready fds.
+    // Returns the number of ready fds, or -1 with errno set.
+    int dispatch(int timeout_ms);
+
+private:
+    EventLoop(const EventLoop&);
+    EventLoop& operator=(const EventLoop&);
+
+    struct Watch
+    {
+        unsigned int events;
+        IoHandler *handler;
+    };
+
+    void notify(int fd, unsigned int events);
+
+    std::map<int, Watch> watches;
+    std::vector<struct pollfd> poll_fds; // rebuilt each dispatch on macOS
+
+#ifdef __linux__
+    int epoll_fd;
+#endif
+};
@@ -2,8 +2,20 @@
 
 #include "ext_libs.hpp"
 #include "Config.hpp"
+#include "FastCgiEndpoint.hpp"
+#include "FastCgiWorkerPool.hpp"
+#include "ProcessManager.hpp"
 
-class FastCgiBackend
+// Gets the local FastCGI backends going without holding up the servers.
+// Endpoints with a fastcgi_spawn get a FastCgiWorkerPool the master keeps
+// supervising; any other local endpoint that does not answer is started
+// once through scripts/start_fcgi_backend.sh. Those helpers run in
+// parallel, and until its backend accepts connections (or
+// kStartupWindow passes) an endpoint is flagged as starting in memory
+// shared with the servers, which skip it meanwhile. A binary started by
+// an upgrade adopts the spawn sockets of the previous master through
+// WEBSERV_FASTCGI_LISTENERS instead of binding them again.
+class FastCgiBackend : public ChildSupervisor
 {
 public:
 	FastCgiBackend(void);
@@ -11,16 +23,34 @@ public:
 
 	void	ensureBackendsRunning(const std::vector<ServerConfig> &servers, char **env);
 
+	// ChildSupervisor
+	bool	childExited(pid_t pid, int status);
+	void	tick(void);
+	void	handOver(bool in_child);
+
+	// Non-zero while the master is still bringing endpoint up; NULL for
+	// endpoints it did not start. Shared by every process forked after
+	// ensureBackendsRunning.
+	static volatile int	*startingFlag(const std::string &endpoint);
+
 private:
-	typedef std::pair<std::string, int>	Endpoint;
-	typedef std::set<Endpoint>			EndpointSet;
+	typedef std::set<FastCgiEndpoint>	EndpointSet;
+
+	struct Startup
+	{
+		FastCgiEndpoint	endpoint;
+		volatile int	*starting;
+		time_t			deadline;
+	};
 
-	EndpointSet	_endpoints;
+	EndpointSet							_endpoints;
+	std::vector<FastCgiWorkerPool *>	_pools;
+	std::vector<Startup>				_startups;	// backends not up yet
+	std::map<pid_t, std::string>		_helpers;	// helper scripts still running
 
 	void	collectEndpoints(const std::vector<ServerConfig> &servers);
-	bool	isPortOpen(const std::string &host, int port) const;
-	void	startBackend(const std::string &host, int port, char **env);
-	bool	waitForBackend(const std::string &host, int port) const;
+	bool	isReachable(const FastCgiEndpoint &endpoint, int timeout_ms) const;
+	pid_t	startBackend(const FastCgiEndpoint &endpoint, char **env);
 
 	FastCgiBackend(const FastCgiBackend &src);
 	FastCgiBackend &operator=(const FastCgiBackend &rhs);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <string>
+
+// One fastcgi_cache_zone: a fixed-size arena mapped shared before the server
+// processes fork, so a reply cached by one process is served by all of them.
+// Entries hold the script's raw output (CGI headers and body) and are written
+// into a ring, a new entry evicting only the oldest ones it lands on. The
+// index is direct mapped on the key hash, so a colliding key evicts too. Nothing is unmapped:
+// zones live as long as the processes.
+class FastCgiCache
+{
+public:
+    enum State
+    {
+        MISS,
+        FRESH,
+        STALE_REVALIDATE, // within stale-while-revalidate: serve it, refresh in the background
+        STALE_IF_ERROR    // only good if the backend fails
+    };
+
+    struct Entry
+    {
+        State state;
+        std::string output;
+        bool refresh; // STALE_REVALIDATE and this caller owns the refresh
+    };
+
+    // How long a reply may be served, from its Cache-Control / Expires
+    struct Policy
+    {
+        time_t ttl;
+        time_t stale_while_revalidate;
+        time_t stale_if_error;
+    };
+
+    // Maps every zone; call once, before forking the servers
+    static void createZones(const std::map<std::string, size_t> &zones);
+    // NULL for an unknown name
+    static FastCgiCache *zone(const std::string &name);
+
+    // Decides from a script's CGI header block whether its reply may be
+    // cached. default_ttl applies when the script states no lifetime.
+    static bool policyFor(const std::string &header_block, time_t default_ttl, time_t now, Policy &policy);
+
+    // A stale hit past its freshness hands the refresh to one caller at a
+    // time, for refresh_for seconds
+    Entry lookup(const std::string &key, time_t now, time_t refresh_for);
+    void store(const std::string &key, const std::string &output, const Policy &policy, time_t now);
+    // Larger replies are not cached
+    size_t maxEntry() const;
+
+private:
+    struct Arena;
+    struct Slot;
+    struct Record;
+
+    FastCgiCache(void *base, size_t size);
+    FastCgiCache(const FastCgiCache &);
+    FastCgiCache &operator=(const FastCgiCache &);
+
+    void lock();
+    void unlock();
+    void reset();
+    void evictOldest();
+    Slot *slotFor(unsigned long hash);
+
+    Arena *arena;
+    Slot *slots;
+    char *data;
+};
@@ -2,40 +2,153 @@
 
 #include "HttpRequest.hpp"
 #include "Config.hpp"
+#include "FastCgiCache.hpp"
+#include "FastCgiConnection.hpp"
+#include "FastCgiMirror.hpp"
+#include "FastCgiUpstream.hpp"
+#include "FileStream.hpp"
+#include "ResponseStream.hpp"
 
 #include <string>
 #include <map>
+#include <vector>
 
-class FastCgiClient
+// One FastCGI request. When attached it picks a server from the location's
+// upstream group, borrows a connection to it from the worker's FastCgiPool
+// and streams both ways: the request body to STDIN as it is received
+// (spooled to a temp file past fastcgi_spool_threshold), the reply to the
+// client as it arrives. fastcgi_cache and fastcgi_cache_lock are handled
+// here; file hand-offs are FastCgiOffload's, mirror copies FastCgiMirror's.
+class FastCgiClient : public ResponseStream
 {
 public:
+    // Everything needed from request is copied here: the request object
+    // does not outlive createResponse.
     FastCgiClient(const HttpRequest &request,
                   const ServerConfig &server_config,
                   const LocationConfig &location_config,
                   const std::string &script_path);
+    ~FastCgiClient();
 
-    std::string execute();
+    // ResponseStream
+    void attach(const StreamContext &ctx, int client_fd);
+    Status pull(std::string &out);
+    bool awaitingUpstream() const;
+    bool feedBody(const char *data, size_t len, bool last);
+    // The reply is complete or abandoned: a detached refresh may be deleted
+    bool finished() const { return done; }
+    // Sends waiters past fastcgi_cache_lock_timeout upstream themselves
+    void expireWaiters(time_t now);
+
+    enum Detached
+    {
+        DETACHED_REFRESH, // updates origin's cache entry
+        DETACHED_MIRROR   // origin's request, sent to the location's mirror
+    };
+
+    // Background copy of origin, with no client behind it
+    FastCgiClient(const FastCgiClient *origin, Detached kind);
+    const LocationConfig &locationConfig() const { return location; }
+    bool streamsBody() const { return body_streamed; }
+    void setMirror(FastCgiMirror *link) { mirror = link; }
+    // Body bytes queued for the backend and not written yet
+    size_t stdinBacklog() const;
+    // Body for a mirror copy: straight to the backend, never spooled or paused
+    void forwardBody(const char *data, size_t len, bool last);
+    // Gives up the upstream request; the reply is abandoned
+    void cancel();
+
+    // Reply events from the upstream connection
+    void onStdout(const char *data, size_t len);
+    void onEnd();
+    void onFailure(UpstreamFailure reason);
+    void onStdinDrained();
 
 private:
     // Parsing and setup
-    bool parseEndpoint();
-    std::map<std::string, std::string> buildParams() const;
-
-    // Low level protocol helpers
-    bool sendBeginRequest(int fd) const;
-    bool sendParams(int fd, const std::map<std::string, std::string> &params) const;
-    bool sendStdin(int fd, const std::string &body) const;
-    std::string readResponse(int fd) const;
+    std::string buildParams(const HttpRequest &request) const;
+    void startUpstream(bool fresh_only);
+    void finish(const std::string &response);
+    void wake();
+    void releasePeer(FastCgiUpstream::Outcome outcome);
+    bool mayRetry() const;
+    void failUpstream(UpstreamFailure reason);
+    void sendStdin(const char *data, size_t len, bool last);
+    bool spool(const char *data, size_t len);
+    void unspool();
+    void failSpool();
+    bool serveCached();
+    bool serveStale();
+    void capture(const char *data, size_t len);
+    void releaseWaiters(const std::string *output);
+    void offload(const std::string &header_block);
 
     // Utility
+    std::string buildCacheKey(const HttpRequest &request) const;
+    std::string cachedResponse(const std::string &output, const char *status) const;
     std::string buildError(int code, const std::string &reason, const std::string &body) const;
-    bool writeAll(int fd, const void *buf, size_t len) const;
+    std::string buildResponse(const std::string &responseData) const;
+    std::string buildHead(const std::string &headerBlock, size_t body_length, bool &chunked) const;
 
 private:
-    const HttpRequest &req;
+    FastCgiClient(const FastCgiClient &);
+    FastCgiClient &operator=(const FastCgiClient &);
+
     const ServerConfig &server;
     const LocationConfig &location;
+    const std::string &pass; // fastcgi_pass, or mirror for a mirror copy
     std::string script;
-    std::string host;
-    int port;
+    std::string version;
+    FastCgiUpstream *group;       // set on attach
+    FastCgiUpstream::Peer *peer;  // server of the attempt in flight
+    struct timeval sent_at;       // for the group's latency average
+    std::vector<const FastCgiUpstream::Peer *> tried; // servers that failed this request
+    UpstreamFailure last_failure;
+    bool idempotent;              // may be replayed on the next server
+
+    std::string params; // encoded FCGI_PARAMS payload, kept for a retry
+    std::string body;   // received with the headers
+    bool body_streamed; // the rest arrives through feedBody
+    size_t stdin_sent;  // streamed bytes handed to the connection
+
+    int spool_fd;       // -1 until the backend falls behind
+    off_t spool_read;
+    off_t spool_write;
+    bool spool_last;    // the final piece is in the spool
+    bool draining;      // waiting for onStdinDrained
+    bool client_paused; // feedBody asked the client to stop
+
+    FastCgiCache *cache;    // location's zone while the request may be cached
+    std::string cache_key;  // empty when it may not
+    FastCgiCache::Policy cache_policy;
+    std::string cached;     // raw output kept for the cache
+    bool capturing;         // the reply is cacheable and still fits
+    std::string stale;      // stale-if-error stand-in
+    bool detached;          // a background refresh: nothing pulls the reply
+
+    bool leading;                         // registered with the pool for cache_key
+    FastCgiClient *leader;                // the identical request this one waits for
+    std::vector<FastCgiClient *> waiters; // requests waiting for this one
+    time_t wait_until;
+
+    StreamContext context;
+    int client_fd;
+    FastCgiConnection *conn; // while the request is in flight
+    bool reused;
+    bool retried;
+    bool got_output;
+
+    std::string header_buf; // STDOUT until the CGI header block ends
+    std::string head;       // HTTP status line and headers, sent first
+    std::string pending;    // body bytes not pulled yet
+    bool head_ready;
+    bool head_sent;
+    bool want_chunked;
+    bool paused;  // upstream reads stopped until pending drains
+    bool done;
+    bool failed;  // upstream broke after the head: abort the client
+    FileStream *file; // X-Accel-Redirect / X-Sendfile target, sent after head
+    bool discard;     // the script's body is not wanted
+
+    FastCgiMirror *mirror; // to the copy of this request, or for a copy to its original
 };
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "EventLoop.hpp"
+#include "FastCgiEndpoint.hpp"
+#include "FastCgiProtocol.hpp"
+
+#include <ctime>
+#include <map>
+#include <string>
+
+class FastCgiClient;
+
+enum UpstreamFailure
+{
+    UPSTREAM_CONNECT, // connect() refused or timed out
+    UPSTREAM_SEND,    // request could not be written
+    UPSTREAM_RECV,    // read error on the socket
+    UPSTREAM_CLOSED,  // backend closed before FCGI_END_REQUEST
+    UPSTREAM_TIMEOUT  // connect, send or read timer expired
+};
+
+// What a backend reported through FCGI_GET_VALUES; shared by every
+// connection to the same endpoint.
+struct FastCgiCaps
+{
+    bool queried; // GET_VALUES sent on some connection
+    bool known;   // reply (or FCGI_UNKNOWN_TYPE) received
+    bool mpxs;    // FCGI_MPXS_CONNS
+    size_t max_conns; // 0 when not advertised
+    size_t max_reqs;
+
+    FastCgiCaps() : queried(false), known(false), mpxs(false), max_conns(0), max_reqs(0) {}
+};
+
+// One server process's counters for a fastcgi_spawn endpoint, in memory
+// the master reads to size and recycle its workers
+struct FastCgiLoad
+{
+    long inflight; // requests begun and not yet ended
+    long served;   // requests ended, never reset
+};
+
+// A non-blocking socket to one FastCGI backend, owned by FastCgiPool. Each
+// request gets its own request ID, so a backend that multiplexes can carry
+// several at once; with FCGI_KEEP_CONN the socket outlives its requests.
+// Its requests are counted in load for a fastcgi_spawn endpoint (NULL for
+// others).
+class FastCgiConnection : public IoHandler
+{
+public:
+    FastCgiConnection(EventLoop &loop, const std::string &endpoint, FastCgiCaps &caps, volatile FastCgiLoad *load);
+    ~FastCgiConnection();
+
+    bool connectTo(const FastCgiEndpoint &target);
+
+    // Asks the backend for FCGI_MAX_CONNS, FCGI_MAX_REQS and FCGI_MPXS_CONNS
+    void queryValues();
+
+    // Queues BEGIN_REQUEST, PARAMS and STDIN under a fresh request ID and
+    // routes the reply records back to request. STDIN stays open unless
+    // body_complete; the rest then follows through sendStdin.
+    void begin(FastCgiClient *request, const std::string &params, const std::string &body,
+               bool body_complete, bool keep_conn);
+    void sendStdin(FastCgiClient *request, const char *data, size_t len, bool last);
+    // Calls request->onStdinDrained() once every queued byte has been sent
+    void notifyWhenDrained(FastCgiClient *request);
+    // The request was destroyed before its reply ended
+    void abandon(FastCgiClient *request);
+    // Backpressure from a slow client: stop reading until resumed
+    void pauseReading(bool pause);
+
+    void handleIo(int fd, unsigned int events);
+    // Fails every request when the connect, a stalled write, or the wait for
+    // the next reply bytes has taken too long (seconds). The reply wait
+    // starts once a request's STDIN is complete: until then the backend is
+    // waiting on the client.
+    void expire(time_t now, int connect_timeout, int send_timeout, int read_timeout);
+
+    bool isIdle() const { return state != DEAD && requests.empty(); }
+    bool isDead() const { return state == DEAD; }
+    size_t inFlight() const { return requests.size(); }
+    size_t pendingOutput() const { return outbuf.size() - out_offset; }
+    const std::string &endpoint() const { return key; }
+    time_t createdAt() const { return created; }
+    time_t idleSince() const { return idle_since; }
+    void shutdown();
+
+private:
+    enum State
+    {
+        CONNECTING,
+        READY,
+        DEAD
+    };
+
+    // A request ID stays taken until END_REQUEST, even once aborted
+    struct Slot
+    {
+        FastCgiClient *request; // NULL once abandoned
+        bool drain_wait;        // notifyWhenDrained pending
+        time_t stdin_done;      // last STDIN record queued, 0 before
+    };
+
+    FastCgiConnection(const FastCgiConnection &);
+    FastCgiConnection &operator=(const FastCgiConnection &);
+
+    unsigned short allocateId() const;
+    Slot *findSlot(FastCgiClient *request, unsigned short &id);
+    void notifyDrained();
+    void write(const fcgi::Gather &records);
+    void flush();
+    void receive();
+    void handleRecord(unsigned char type, unsigned short id, const char *data, size_t len);
+    void handleManagement(unsigned char type, const char *data, size_t len);
+    void fail(UpstreamFailure reason);
+    void updateInterest();
+    void recount();
+
+    EventLoop &loop;
+    std::string key;
+    FastCgiCaps &caps;
+    int fd;
+    State state;
+    std::map<unsigned short, Slot> requests;
+    bool keep;
+    bool paused;
+    std::string outbuf;
+    size_t out_offset;
+    std::string inbuf;
+    time_t created;
+    time_t idle_since;
+    time_t send_stalled; // first EAGAIN of the pending write, 0 when none
+    time_t last_io;      // last progress either way while requests are out
+    volatile FastCgiLoad *load;
+    long counted;        // our share of load->inflight
+};
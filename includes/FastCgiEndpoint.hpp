@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <sys/socket.h>
+
+// Where a fastcgi_pass points: "host:port", "host" (port 9000) or
+// "unix:/path/to.sock".
+struct FastCgiEndpoint
+{
+    std::string host;
+    int port;
+    std::string unix_path; // non-empty for AF_UNIX endpoints
+
+    FastCgiEndpoint() : host(), port(0), unix_path() {}
+
+    bool isUnix() const { return !unix_path.empty(); }
+    bool isLocal() const;
+    std::string describe() const;
+
+    static bool parse(const std::string &spec, FastCgiEndpoint &out);
+
+    // New stream socket connecting to the endpoint (FD_CLOEXEC). When
+    // non_blocking, a connect still in progress is not an error. Returns -1
+    // with errno set on failure.
+    int connectSocket(bool non_blocking) const;
+    // Bound and listening (FD_CLOEXEC, blocking) for workers to accept on;
+    // a stale unix socket file is replaced. -1 with errno set on failure.
+    int listenSocket(int backlog) const;
+
+    bool operator<(const FastCgiEndpoint &rhs) const;
+
+private:
+    bool address(struct sockaddr_storage &storage, socklen_t &len) const;
+};
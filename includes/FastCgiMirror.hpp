@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+
+class FastCgiClient;
+class FastCgiPool;
+
+// Links a request to its sampled copy on the location's fastcgi_mirror.
+// The copy runs detached in the worker's FastCgiPool, its reply dropped.
+// The original hands it the streamed body as it arrives; a copy whose
+// backend falls behind, or whose original goes away before the body is
+// all in, is dropped instead of holding anything up. The link is deleted
+// once both sides are gone.
+class FastCgiMirror
+{
+public:
+    // NULL unless origin is sampled for its location's mirror
+    static FastCgiMirror *start(const FastCgiClient *origin, FastCgiPool &pool);
+
+    // Streamed body of the original request
+    void feedBody(const char *data, size_t len, bool last);
+    // Called by either side as it is destroyed
+    void detach(const FastCgiClient *side);
+
+private:
+    FastCgiMirror(const FastCgiClient *origin, FastCgiClient *copy);
+    FastCgiMirror(const FastCgiMirror &);
+    FastCgiMirror &operator=(const FastCgiMirror &);
+
+    void drop();
+
+    const FastCgiClient *origin;
+    FastCgiClient *copy;
+    bool awaiting_body; // the copy's streamed body is not all in yet
+};
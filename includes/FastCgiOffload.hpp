@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Config.hpp"
+#include "FileStream.hpp"
+
+#include <string>
+
+// A script answering with a file instead of a body: X-Accel-Redirect names
+// a URI served by a plain-file location, X-Sendfile a path under the server
+// root or a location's path. The file is read from disk as the client
+// drains and the script's own body is dropped.
+class FastCgiOffload
+{
+public:
+    FastCgiOffload(const ServerConfig &server_config, const std::string &http_version);
+
+    // Whether a CGI header block hands a file over
+    static bool requested(const std::string &header_block);
+
+    // The file named by header_block, with head set to its response head;
+    // NULL with head set to a complete 403 or 404 response otherwise
+    FileStream *open(const std::string &header_block, std::string &head) const;
+
+private:
+    std::string accelPath(const std::string &uri) const;
+    std::string sendfilePath(const std::string &path) const;
+
+    const ServerConfig &server;
+    std::string version;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "Config.hpp"
+#include "EventLoop.hpp"
+#include "FastCgiConnection.hpp"
+#include "FastCgiUpstream.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Per-worker upstream connections, grouped by backend address. Idle
+// sockets are handed out again instead of reconnecting for every request,
+// and backends advertising FCGI_MPXS_CONNS share one socket between many
+// requests. fastcgi_keepalive bounds how many stay idle and for how long.
+// The pool also owns the upstream groups fastcgi_pass names resolve to,
+// background requests started by the cache and the requests others with
+// the same cache key wait for.
+class FastCgiPool
+{
+public:
+    struct Lease
+    {
+        FastCgiConnection *conn; // NULL when none could be had
+        bool reused; // conn was already open
+        bool busy;   // backend limits (FCGI_MAX_CONNS/REQS) reached
+    };
+
+    explicit FastCgiPool(EventLoop &loop);
+    ~FastCgiPool();
+
+    // Creates the groups used by server's locations, so health checks start
+    // before the first request
+    void configure(const ServerConfig &server);
+    // The group behind a fastcgi_pass (or mirror) value; NULL when it names
+    // neither an upstream block nor a valid address
+    FastCgiUpstream *upstream(const ServerConfig &server, const std::string &pass);
+
+    // A connection with room for one more request to the location's backend:
+    // an open one when allowed, else a new one that is still connecting.
+    Lease acquire(const LocationConfig &location, const FastCgiEndpoint &target, bool fresh_only);
+
+    // Fails sockets whose timers expired, drops dead ones, retires idle ones
+    // past their limits and runs due health checks. Called from the server
+    // loop, never while a connection is dispatching.
+    void reap();
+
+    // Takes over a request no client waits for (a cache refresh, a mirror
+    // copy) and deletes it once it has finished
+    void runDetached(FastCgiClient *request);
+    // Whether the next request of location is copied to its mirror: spreads
+    // fastcgi_mirror_percent evenly, none while too many copies are in flight
+    bool sampleMirror(const LocationConfig &location);
+
+    // fastcgi_cache_lock: registers request as the one fetching key, or
+    // returns the request already doing so
+    FastCgiClient *lead(const std::string &key, FastCgiClient *request);
+    void unlead(const std::string &key, const FastCgiClient *request);
+
+    size_t size() const;
+
+private:
+    struct Endpoint
+    {
+        std::vector<FastCgiConnection *> conns;
+        FastCgiCaps caps;
+        size_t max_idle;
+        time_t idle_timeout;
+        time_t lifetime;
+        int connect_timeout;
+        int send_timeout;
+        int read_timeout;
+        volatile FastCgiLoad *load; // our slot in the fastcgi_spawn pool
+    };
+
+    FastCgiPool(const FastCgiPool &);
+    FastCgiPool &operator=(const FastCgiPool &);
+
+    bool expired(const FastCgiConnection &conn, const Endpoint &ep, time_t now) const;
+
+    EventLoop &loop;
+    std::map<std::string, Endpoint> endpoints; // by FastCgiEndpoint::describe()
+    std::map<std::string, FastCgiUpstream *> upstreams; // by fastcgi_pass value
+    std::vector<FastCgiClient *> detached;
+    std::map<std::string, FastCgiClient *> leaders; // by cache key
+    std::map<const LocationConfig *, unsigned long> mirror_seen; // requests counted per location
+};
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+// FastCGI record framing shared by the request and connection code.
+namespace fcgi {
+
+const unsigned char VERSION_1 = 1;
+
+const unsigned char BEGIN_REQUEST = 1;
+const unsigned char ABORT_REQUEST = 2;
+const unsigned char END_REQUEST = 3;
+const unsigned char PARAMS = 4;
+const unsigned char STDIN = 5;
+const unsigned char STDOUT = 6;
+const unsigned char STDERR = 7;
+const unsigned char GET_VALUES = 9;
+const unsigned char GET_VALUES_RESULT = 10;
+const unsigned char UNKNOWN_TYPE = 11;
+
+const unsigned short MANAGEMENT_ID = 0; // GET_VALUES and friends
+
+const unsigned short RESPONDER = 1;
+const unsigned char KEEP_CONN = 1;
+
+const size_t HEADER_LEN = 8;
+const size_t MAX_CONTENT = 65535;
+
+struct Record
+{
+    unsigned char type;
+    unsigned short request_id;
+    size_t content_offset; // into the parsed buffer
+    size_t content_length;
+};
+
+inline void appendRecord(std::string &out, unsigned char type, unsigned short id,
+                         const char *data, size_t len)
+{
+    unsigned char header[HEADER_LEN];
+
+    header[0] = VERSION_1;
+    header[1] = type;
+    header[2] = static_cast<unsigned char>((id >> 8) & 0xFF);
+    header[3] = static_cast<unsigned char>(id & 0xFF);
+    header[4] = static_cast<unsigned char>((len >> 8) & 0xFF);
+    header[5] = static_cast<unsigned char>(len & 0xFF);
+    header[6] = 0; // padding
+    header[7] = 0;
+    out.append(reinterpret_cast<const char *>(header), sizeof(header));
+    if (len > 0)
+        out.append(data, len);
+}
+
+// Records needed to carry len bytes of stream data
+inline size_t recordsFor(size_t len)
+{
+    return (len + MAX_CONTENT - 1) / MAX_CONTENT;
+}
+
+// Records for a single gathered write. Headers live here; payloads are only
+// pointed to and must stay valid until the write. Storage is sized up
+// front (BEGIN_REQUEST counts as two records) so it never moves under
+// the iovecs.
+class Gather
+{
+public:
+    explicit Gather(size_t max_records)
+        : storage(max_records * HEADER_LEN)
+        , used(0)
+        , iov()
+    {
+        iov.reserve(max_records * 2);
+    }
+
+    void record(unsigned char type, unsigned short id, const char *data, size_t len)
+    {
+        unsigned char *header = &storage[used];
+
+        header[0] = VERSION_1;
+        header[1] = type;
+        header[2] = static_cast<unsigned char>((id >> 8) & 0xFF);
+        header[3] = static_cast<unsigned char>(id & 0xFF);
+        header[4] = static_cast<unsigned char>((len >> 8) & 0xFF);
+        header[5] = static_cast<unsigned char>(len & 0xFF);
+        header[6] = 0;
+        header[7] = 0;
+        used += HEADER_LEN;
+        push(header, HEADER_LEN);
+        if (len > 0)
+            push(data, len);
+    }
+
+    void beginRequest(unsigned short id, unsigned char flags)
+    {
+        unsigned char *body = &storage[used + HEADER_LEN];
+
+        std::memset(body, 0, HEADER_LEN);
+        body[0] = static_cast<unsigned char>((RESPONDER >> 8) & 0xFF);
+        body[1] = static_cast<unsigned char>(RESPONDER & 0xFF);
+        body[2] = flags;
+        record(BEGIN_REQUEST, id, reinterpret_cast<const char *>(body), HEADER_LEN);
+        used += HEADER_LEN;
+    }
+
+    // Splits data into records of at most MAX_CONTENT bytes; stream() also
+    // appends the empty record that closes the stream
+    void streamData(unsigned char type, unsigned short id, const char *data, size_t len)
+    {
+        for (size_t offset = 0; offset < len; offset += MAX_CONTENT)
+            record(type, id, data + offset, len - offset < MAX_CONTENT ? len - offset : MAX_CONTENT);
+    }
+
+    void stream(unsigned char type, unsigned short id, const std::string &data)
+    {
+        streamData(type, id, data.data(), data.size());
+        record(type, id, NULL, 0);
+    }
+
+    const struct iovec *vectors() const { return iov.empty() ? NULL : &iov[0]; }
+    size_t count() const { return iov.size(); }
+
+    // Copies out whatever a short write left, skipping the first skip bytes
+    void appendRest(std::string &out, size_t skip) const
+    {
+        for (size_t i = 0; i < iov.size(); ++i)
+        {
+            const size_t len = iov[i].iov_len;
+            if (skip >= len)
+            {
+                skip -= len;
+                continue;
+            }
+            out.append(static_cast<const char *>(iov[i].iov_base) + skip, len - skip);
+            skip = 0;
+        }
+    }
+
+private:
+    Gather(const Gather &);
+    Gather &operator=(const Gather &);
+
+    void push(const void *data, size_t len)
+    {
+        struct iovec v;
+        v.iov_base = const_cast<void *>(data);
+        v.iov_len = len;
+        iov.push_back(v);
+    }
+
+    std::vector<unsigned char> storage;
+    size_t used;
+    std::vector<struct iovec> iov;
+};
+
+inline void appendLength(std::string &out, size_t len)
+{
+    if (len < 128)
+    {
+        out += static_cast<char>(len);
+        return;
+    }
+    out += static_cast<char>((len >> 24) | 0x80);
+    out += static_cast<char>((len >> 16) & 0xFF);
+    out += static_cast<char>((len >> 8) & 0xFF);
+    out += static_cast<char>(len & 0xFF);
+}
+
+inline void encodeNameValue(const std::string &name, const std::string &value, std::string &out)
+{
+    appendLength(out, name.size());
+    appendLength(out, value.size());
+    out += name;
+    out += value;
+}
+
+inline bool readLength(const unsigned char *p, size_t end, size_t &pos, size_t &len)
+{
+    if (pos >= end)
+        return false;
+    if (!(p[pos] & 0x80))
+    {
+        len = p[pos++];
+        return true;
+    }
+    if (end - pos < 4)
+        return false;
+    len = (static_cast<size_t>(p[pos] & 0x7F) << 24) | (static_cast<size_t>(p[pos + 1]) << 16)
+        | (static_cast<size_t>(p[pos + 2]) << 8) | p[pos + 3];
+    pos += 4;
+    return true;
+}
+
+// Decodes a PARAMS / GET_VALUES_RESULT body. Stops at the first malformed pair.
+inline void decodeNameValues(const char *data, size_t len, std::map<std::string, std::string> &out)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    size_t pos = 0;
+    size_t nlen;
+    size_t vlen;
+
+    while (readLength(p, len, pos, nlen) && readLength(p, len, pos, vlen))
+    {
+        if (len - pos < nlen + vlen)
+            return;
+        out[std::string(data + pos, nlen)] = std::string(data + pos + nlen, vlen);
+        pos += nlen + vlen;
+    }
+}
+
+// Reads the record starting at pos. Returns false until the whole record,
+// padding included, is buffered; pos then moves past it.
+inline bool nextRecord(const std::string &buf, size_t &pos, Record &rec)
+{
+    if (buf.size() - pos < HEADER_LEN)
+        return false;
+
+    const unsigned char *h = reinterpret_cast<const unsigned char *>(buf.data() + pos);
+    const size_t content = static_cast<size_t>((h[4] << 8) | h[5]);
+    const size_t total = HEADER_LEN + content + h[6];
+    if (buf.size() - pos < total)
+        return false;
+
+    rec.type = h[1];
+    rec.request_id = static_cast<unsigned short>((h[2] << 8) | h[3]);
+    rec.content_offset = pos + HEADER_LEN;
+    rec.content_length = content;
+    pos += total;
+    return true;
+}
+
+} // namespace fcgi
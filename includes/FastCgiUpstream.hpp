@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Config.hpp"
+#include "EventLoop.hpp"
+#include "FastCgiEndpoint.hpp"
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+// The servers behind one fastcgi_pass target, as seen by this worker. A
+// plain address is a group of one. Picks a server per request according to
+// the group's balance method and, with health_check, probes every server in
+// the background. Each server has a circuit breaker: max_fails failures
+// within fail_timeout open it for fail_timeout, after which one trial
+// request decides whether it closes again. A plain address fails fast for
+// a second at a time.
+class FastCgiUpstream : public IoHandler
+{
+public:
+    enum Outcome
+    {
+        OUTCOME_SUCCESS,
+        OUTCOME_FAILURE, // connect, I/O, timeout or protocol error
+        OUTCOME_NEUTRAL  // says nothing about the server (client left, pool busy)
+    };
+
+    enum Breaker
+    {
+        BREAKER_CLOSED,
+        BREAKER_OPEN,     // failing fast until open_until
+        BREAKER_HALF_OPEN // one trial request at a time
+    };
+
+    struct Peer
+    {
+        FastCgiEndpoint endpoint;
+        unsigned int weight;
+        unsigned int max_fails;
+        time_t fail_timeout;
+
+        int current_weight;  // smooth weighted round-robin state
+        size_t outstanding;  // requests selected and not released
+        double ewma_ms;      // smoothed time to first response byte
+        bool measured;       // ewma_ms holds at least one sample
+        unsigned int fails;  // failures in the current window
+        time_t fail_start;
+        Breaker breaker;
+        time_t open_until;
+        bool trial_inflight; // the half-open trial is out
+
+        volatile int *starting; // the master is still starting it, NULL if not ours
+        bool healthy;        // last verdict of the active checks
+        unsigned int probe_passes; // consecutive results towards flipping healthy
+        unsigned int probe_fails;
+        int probe_fd;        // connect in progress, -1 when none
+        time_t probe_started;
+        time_t next_probe;
+    };
+
+    FastCgiUpstream(EventLoop &loop, const UpstreamConfig &config);
+    FastCgiUpstream(EventLoop &loop, const std::string &name, const FastCgiEndpoint &endpoint);
+    ~FastCgiUpstream();
+
+    const std::string &name() const { return group_name; }
+
+    // The server for the next request, counted as outstanding until
+    // release(). Servers in exclude (already tried) are skipped. NULL when
+    // no server may take a request.
+    Peer *select(time_t now, const std::vector<const Peer *> &exclude);
+    // Time from sending the request to its first response byte
+    void observe(Peer *peer, double elapsed_ms);
+    void release(Peer *peer, Outcome outcome, time_t now);
+
+    // Starts due probes and expires stuck ones; called from the pool's reap
+    void checkHealth(time_t now);
+    void handleIo(int fd, unsigned int events);
+
+private:
+    FastCgiUpstream(const FastCgiUpstream &);
+    FastCgiUpstream &operator=(const FastCgiUpstream &);
+
+    void addPeer(const FastCgiEndpoint &endpoint, const UpstreamServer &server);
+    std::string label(const Peer &peer) const;
+    bool usable(Peer &peer, time_t now);
+    void openBreaker(Peer &peer, time_t now);
+    Peer *pickRoundRobin(const std::vector<Peer *> &candidates);
+    Peer *pickLeastConn(const std::vector<Peer *> &candidates);
+    Peer *pickEwma(const std::vector<Peer *> &candidates);
+    void startProbe(Peer &peer, time_t now);
+    void finishProbe(Peer &peer, bool ok, time_t now);
+
+    EventLoop &loop;
+    std::string group_name;
+    UpstreamBalance balance;
+    int health_interval;
+    int health_timeout;
+    unsigned int health_fails;
+    unsigned int health_passes;
+    std::vector<Peer> peers; // never resized after construction: Peer * stay valid
+    size_t rotation;         // tie-break start for least_conn / ewma
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "ext_libs.hpp"
+#include "Config.hpp"
+#include "FastCgiConnection.hpp"
+#include "FastCgiEndpoint.hpp"
+
+// The workers of one fastcgi_spawn, run by the master process. The master
+// binds the endpoint and every worker inherits the socket as its stdin
+// (FCGI_LISTENSOCK_FILENO), so connections queue in the backlog even while
+// workers start. Each worker serves one request at a time; every server
+// process counts its requests in flight to the endpoint in its own slot of
+// shared memory, and the pool keeps that many workers plus min_spare,
+// within max_children. A kept-alive idle socket holds a worker too, so
+// fastcgi_keepalive should stay below min_spare. The slot of a server that
+// dies is cleared when the master reaps it. Crashed workers are replaced,
+// with a backoff when they die right after starting. Workers reaching
+// php_max_requests are told to stop and replaced; as the master cannot see
+// which worker took a request, the requests the servers report served are
+// credited evenly to the live workers.
+class FastCgiWorkerPool
+{
+public:
+	FastCgiWorkerPool(const FastCgiSpawnConfig &config, char **env);
+	~FastCgiWorkerPool(void);
+
+	// Binds the endpoint, or takes over inherited_fd when one is given,
+	// and starts min_spare workers
+	bool	start(int inherited_fd);
+	// True when pid was one of this pool's workers
+	bool	reap(pid_t pid, int status);
+	// Spawns or retires workers to follow the load
+	void	tick(time_t now);
+	// SIGTERM to every worker, then waits for them
+	void	stop(void);
+
+	const std::string	&address(void) const;
+	// The listening socket, made inheritable across exec in_child; in the
+	// parent its socket file is then left in place by stop()
+	int		handOver(bool in_child);
+
+	// The calling process's counters for a spawned endpoint, in memory
+	// shared by every process forked after start(); NULL for endpoints
+	// nobody spawns
+	static volatile FastCgiLoad	*loadCounter(const std::string &endpoint);
+	// Forgets the requests of a server process that exited
+	void	releaseLoad(pid_t pid);
+
+private:
+	struct LoadSlot
+	{
+		pid_t		pid;	// 0 == free
+		FastCgiLoad	load;
+	};
+
+	struct Worker
+	{
+		pid_t	pid;
+		time_t	started;
+		long	served;	// its share of the requests served
+		bool	retiring;
+	};
+
+	FastCgiSpawnConfig		_config;
+	FastCgiEndpoint			_endpoint;
+	char					**_env;
+	int						_listenFd;
+	bool					_shared;	// another master serves the socket too
+	volatile LoadSlot		*_load;	// one per server process
+	std::vector<Worker>		_workers;
+	time_t					_holdUntil;	// no spawning before, after a crash loop
+	time_t					_backoff;
+	time_t					_lastBusy;
+	time_t					_lastRetire;
+	long					_served;	// requests served, as credited so far
+
+	static std::map<std::string, volatile LoadSlot *>	&loadSlots(void);
+
+	bool	spawn(time_t now);
+	long	totalLoad(void) const;
+	void	recycle(void);
+	size_t	liveWorkers(void) const;
+
+	FastCgiWorkerPool(const FastCgiWorkerPool &src);
+	FastCgiWorkerPool &operator=(const FastCgiWorkerPool &rhs);
+};
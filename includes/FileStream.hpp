@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ResponseStream.hpp"
+
+#include <string>
+#include <sys/types.h>
+
+// A regular file sent as a response body one block per pull, so it is never
+// held in memory whole. Serves the files FastCGI scripts hand over with
+// X-Accel-Redirect or X-Sendfile.
+class FileStream : public ResponseStream
+{
+public:
+    FileStream();
+    ~FileStream();
+
+    // False unless path is a readable regular file
+    bool open(const std::string &path);
+    off_t size() const { return length; }
+
+    Status pull(std::string &out);
+
+private:
+    FileStream(const FileStream &);
+    FileStream &operator=(const FileStream &);
+
+    int fd;
+    off_t length;
+    off_t left; // bytes not pulled yet
+};
@@ -15,6 +15,7 @@ private:
     
     // Body (for POST requests)
    std::string                         body;
+   bool                                bodyStreamed;   // rest of the body is fed to the response stream
     
     // Query parameters (from URL)
    std::map<std::string, std::string>  queryParams;
@@ -42,6 +43,9 @@ private:
    const std::string                         &getHeader(const std::string& key) const;
    const std::string                         &getRoot() const;
    const std::string                         &getBody() const;
+   const std::string                         &getQueryParam(const std::string& key) const;
+   bool                                      isBodyStreamed() const;
+   void                                      setBodyStreamed(bool streamed);
  private:
    void  parseQuery();
 };
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "ext_libs.hpp"
 #include "HttpRequest.hpp"
 #include "Config.hpp" 
+#include "ResponseStream.hpp"
 
 class HttpResponse
 {
@@ -12,8 +13,13 @@ private:
     std::map<std::string, std::string> headers;
     std::string body;
     std::string fullResponse;
+    ResponseStream *stream; // body produced after fullResponse (head) is sent
+    const ServerConfig *server; // config of the request being answered
+    const LocationRoute *route; // location matched once per request (may be NULL)
 
 public:
+    HttpResponse();
+    ~HttpResponse();
 
     // Setters
     void setStatusCode(int code);
@@ -30,7 +36,15 @@ public:
     const std::string& getBody() const;
     const std::map<std::string, std::string>& getHeaders() const;
     
-    static std::string createResponse(const HttpRequest &request, const ServerConfig& config);
+    // Returns the bytes to send first. When the handler streams its body,
+    // ownership of that stream is handed to the caller through `stream`.
+    static std::string createResponse(const HttpRequest &request, const ServerConfig& config,
+            ResponseStream *&stream);
+
+    // True when the request's body can be forwarded while it is still being
+    // received (POST to a FastCGI or CGI script, any proxied request)
+    // instead of buffered first
+    static bool streamsRequestBody(const HttpRequest &request, const ServerConfig& config);
 
     // Helper method to get reason phrase from status code
     static std::string getReasonPhraseFromCode(int statusCode);
@@ -40,6 +54,9 @@ public:
     
     // Optimization helpers to reduce code duplication
 private:
+    HttpResponse(const HttpResponse&);
+    HttpResponse& operator=(const HttpResponse&);
+
     std::string normalizeUri(const std::string& uri) const;
     std::string getContentType(const std::string& path) const;
     std::string buildResponse(const HttpRequest &request, int statusCode, 
@@ -47,7 +64,10 @@ private:
     void createOkResponse(const HttpRequest &request);
     std::string createErrorResponse(const HttpRequest &request, int errorCode) const;
     const std::string createGetResponse(const HttpRequest &request, const ServerConfig& config);
-    const std::string createPostResponse(const HttpRequest &request,  const ServerConfig& config) const;
-    const std::string createDeleteResponse(const HttpRequest &request,  const ServerConfig& config) const;
-    const std::string createUnknowResponse(const HttpRequest &request,  const ServerConfig& config) const;
+    std::string createAutoIndexResponse(const HttpRequest &request, const LocationConfig &location,
+            const std::string &uri, const std::string &dirPath);
+    const std::string createPostResponse(const HttpRequest &request,  const ServerConfig& config);
+    const std::string createDeleteResponse(const HttpRequest &request,  const ServerConfig& config);
+    std::string createProxyResponse(const HttpRequest &request, const ServerConfig& config);
+    std::string createMethodNotAllowed(const HttpRequest &request, const std::string &allowHeader) const;
 };
\ No newline at end of file
@@ -18,9 +18,9 @@ inline std::string stripQuery(const std::string &uri)
     return out;
 }
 
-inline bool isFastCgiRequest(const LocationConfig *loc, const std::string &path)
+inline bool hasCgiExtension(const LocationConfig *loc, const std::string &path)
 {
-    if (!loc || loc->fastcgi_pass.empty() || path.empty())
+    if (path.empty())
         return false;
 
     const std::string::size_type dot = path.rfind('.');
@@ -36,6 +36,17 @@ inline bool isFastCgiRequest(const LocationConfig *loc, const std::string &path)
     return false;
 }
 
+inline bool isFastCgiRequest(const LocationConfig *loc, const std::string &path)
+{
+    return loc && !loc->fastcgi_pass.empty() && hasCgiExtension(loc, path);
+}
+
+// Without fastcgi_pass, cgi_path runs the script itself
+inline bool isCgiRequest(const LocationConfig *loc, const std::string &path)
+{
+    return loc && loc->fastcgi_pass.empty() && !loc->cgi_path.empty() && hasCgiExtension(loc, path);
+}
+
 inline std::string buildAllowHeader(const std::vector<std::string> &methods)
 {
     std::ostringstream allow;
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct LocationConfig;
+
+enum MethodBits
+{
+    METHOD_GET = 1,
+    METHOD_POST = 2,
+    METHOD_DELETE = 4,
+    METHOD_HEAD = 8,
+    METHOD_PUT = 16,
+    METHOD_OTHER = 32
+};
+
+enum RouteHandler
+{
+    ROUTE_STATIC,
+    ROUTE_FASTCGI,
+    ROUTE_CGI,
+    ROUTE_PROXY,
+    ROUTE_RETURN
+};
+
+// Response for a location "return", serialized at config load. Everything
+// after the HTTP version is stored in pieces split at each $request_uri.
+struct ReturnPlan
+{
+    std::vector<std::string> head;
+    std::vector<std::string> body; // only used when the body embeds $request_uri
+    size_t body_static_len;
+
+    ReturnPlan() : head(), body(), body_static_len(0) {}
+
+    void build(int code, const std::string &target);
+    std::string render(const std::string &version, const std::string &request_uri) const;
+};
+
+// Everything a request handler needs about a location, derived once at
+// config load instead of per request.
+struct LocationRoute
+{
+    size_t location_index; // into ServerConfig::locations
+    size_t prefix_len;
+    std::string read_dir;  // base for GET (path, then upload_dir)
+    std::string write_dir; // base for POST/DELETE (upload_dir, then path)
+    unsigned int methods;
+    std::string allow_header; // "Allow: ...\r\n" for 405 replies
+    RouteHandler handler;
+    bool internal; // answered only for X-Accel-Redirect, 404 otherwise
+    ReturnPlan return_plan; // set when handler == ROUTE_RETURN
+};
+
+// Longest-prefix location matcher compiled into a radix tree, so lookups cost
+// O(uri length) regardless of how many locations a server declares.
+class LocationRouter
+{
+public:
+    LocationRouter();
+
+    void compile(const std::vector<LocationConfig> &locations, const std::string &root,
+                 const std::vector<std::string> &server_methods);
+
+    // Longest location that is a string prefix of uri, or NULL
+    const LocationRoute *match(const std::string &uri) const;
+
+    // Every compiled location, in config order
+    const std::vector<LocationRoute> &allRoutes() const { return routes; }
+
+    // Methods allowed when no location matches (server-level "methods",
+    // else GET and DELETE)
+    unsigned int defaultMethods() const { return default_methods; }
+    const std::string &defaultAllowHeader() const { return default_allow; }
+
+    static unsigned int methodBit(const std::string &method);
+    static unsigned int methodMask(const std::vector<std::string> &methods);
+
+private:
+    struct Node
+    {
+        std::string label;
+        int route; // index into routes, -1 when no location ends here
+        std::vector<std::pair<unsigned char, size_t> > children; // sorted by first byte
+    };
+
+    void insert(const std::string &key, int route);
+    int findChild(const Node &node, unsigned char c) const;
+    void addChild(size_t parent, unsigned char c, size_t child);
+
+    std::vector<Node> nodes; // nodes[0] is the root
+    std::vector<LocationRoute> routes;
+    unsigned int default_methods;
+    std::string default_allow;
+};
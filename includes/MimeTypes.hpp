@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Extension -> Content-Type table. Keys are stored lowercase in an
+// open-addressing hash table; lookups hash the extension in place so serving a
+// file never allocates.
+class MimeTypes
+{
+public:
+    MimeTypes(); // starts with the compiled-in web defaults
+
+    void set(const std::string &extension, const std::string &type);
+
+    // Type for the extension of path (after the last '.' of the last segment)
+    const std::string &lookup(const std::string &path) const;
+    size_t size() const { return count; }
+
+    static const std::string &defaultType();
+
+private:
+    struct Slot
+    {
+        std::string ext; // lowercase, without the dot; empty == free
+        size_t type;     // index into types
+    };
+
+    static unsigned long hash(const char *s, size_t len);
+    static bool sameExt(const std::string &key, const char *s, size_t len);
+    void grow();
+    size_t internType(const std::string &type);
+
+    std::vector<Slot> slots; // size is always a power of two
+    std::vector<std::string> types;
+    size_t count;
+};
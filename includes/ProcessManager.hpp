@@ -6,10 +6,33 @@
 struct ServerProcess
 {
 	pid_t		pid;
-	int			port;
 	std::string	name;
+	int			generation;	// bumped by every reload
+	bool		retiring;	// told to drain and exit
 };
 
+// Children the master runs besides the servers (FastCGI workers)
+class ChildSupervisor
+{
+public:
+	virtual ~ChildSupervisor(void) {}
+
+	// True when pid was one of its children
+	virtual bool	childExited(pid_t pid, int status) = 0;
+	// Called between waits, several times a second
+	virtual void	tick(void) = 0;
+	// Around a binary upgrade. in_child: about to exec the new binary,
+	// which is left the sockets to adopt. Otherwise: the sockets are
+	// shared from now on and must outlive this master.
+	virtual void	handOver(bool in_child) = 0;
+};
+
+// The master owns the listening sockets, one per port, so they outlive
+// the workers using them: on SIGHUP a new generation of workers is started
+// on the same sockets while the previous one drains, and on SIGUSR2 the
+// sockets are handed to a freshly executed binary through
+// WEBSERV_LISTENERS (the supervisor hands over its own). SIGTERM and SIGQUIT stop everything gracefully,
+// SIGINT at once.
 class ProcessManager
 {
 public:
@@ -17,19 +40,48 @@ public:
 	~ProcessManager(void);
 
 	void	installSignalHandlers(void);
-	pid_t	spawnServerProcess(const ServerConfig &config);
-	void	addProcess(pid_t pid, int port, const std::string &name);
-	void	terminateAll(void);
+	// Remembers the running binary for upgradeBinary(): argv[0] is no
+	// path when webserv was found through PATH
+	void	resolveExecutable(const char *argv0);
+	// Takes over the sockets of the master that executed this one
+	void	adoptListeners(void);
+	pid_t	spawnWorker(const std::vector<ServerConfig> &configs, int index);
+	void	addProcess(pid_t pid, const std::string &name);
+	void	terminateAll(int sig);
+	// Returns once every server is gone, or on a reload or upgrade request
 	void	monitorChildren(void);
 	bool	hasChildren(void) const;
+	void	setSupervisor(ChildSupervisor *supervisor);
+
+	// Reload: servers added from here on form the new generation, and
+	// retireOldServers() drains the others and closes unused listeners.
+	// abandonGeneration() drains the new one instead and goes back to
+	// the previous one, for a reload that could not start every server.
+	void	beginGeneration(void);
+	void	retireOldServers(void);
+	void	abandonGeneration(void);
+	// Starts the binary again with argv and the listeners inherited
+	void	upgradeBinary(char *const argv[]);
 
 	static volatile std::sig_atomic_t	g_stopRequested;
+	static volatile std::sig_atomic_t	g_drainRequested;
+	static volatile std::sig_atomic_t	g_reloadRequested;
+	static volatile std::sig_atomic_t	g_upgradeRequested;
 
 private:
 	std::vector<ServerProcess>	_children;
+	ChildSupervisor				*_supervisor;
+	std::map<int, int>			_listeners;	// port -> listening socket
+	std::set<int>				_generationPorts;	// listened to by the newest workers
+	std::set<int>				_previousPorts;	// by the generation before
+	int							_generation;
+	pid_t						_upgradePid;	// new binary, while it runs
+	std::string					_executable;
 
 	void	printBanner(const ServerConfig &config) const;
 	void	handleChildExit(pid_t pid, int status);
+	int		listenerFor(int port);
+	void	closeUnusedListeners(void);
 
 	ProcessManager(const ProcessManager &src);
 	ProcessManager &operator=(const ProcessManager &rhs);
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Config.hpp"
+#include "EventLoop.hpp"
+#include "HttpRequest.hpp"
+#include "ResponseStream.hpp"
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+// One request forwarded to a proxy_pass upstream over HTTP/1.1. The socket
+// comes from the worker's ProxyPool when an idle one is kept, else it is
+// connected without blocking. The request body is written as it arrives
+// and the reply is relayed as it is read: hop-by-hop headers are dropped
+// both ways, a chunked reply is decoded and chunked again for the client.
+// A socket whose reply was read to its end goes back to the pool.
+class ProxyClient : public ResponseStream, public IoHandler
+{
+public:
+    // Everything needed from request is copied here: the request object
+    // does not outlive createResponse.
+    ProxyClient(const HttpRequest &request, const LocationConfig &location_config);
+    ~ProxyClient();
+
+    // ResponseStream
+    void attach(const StreamContext &ctx, int client_fd);
+    Status pull(std::string &out);
+    bool feedBody(const char *data, size_t len, bool last);
+    bool awaitingUpstream() const;
+
+    // Upstream socket readiness
+    void handleIo(int fd, unsigned int events);
+    // proxy_connect_timeout / proxy_read_timeout; called by the pool
+    void expire(time_t now);
+
+private:
+    enum Framing
+    {
+        BODY_NONE,    // HEAD, 1xx, 204, 304
+        BODY_LENGTH,  // Content-Length
+        BODY_CHUNKED, // Transfer-Encoding: chunked
+        BODY_CLOSE    // ends when the upstream closes
+    };
+
+    ProxyClient(const ProxyClient &);
+    ProxyClient &operator=(const ProxyClient &);
+
+    std::string buildRequestHead(const HttpRequest &request);
+    void connectUpstream(bool allow_reuse);
+    void writeUpstream();
+    void readUpstream();
+    bool parseHead();
+    void decodeBody(const char *data, size_t len);
+    bool decodeChunked();
+    void complete();
+    void fail(int code, const std::string &reason, const std::string &detail);
+    bool retry();
+    void closeUpstream();
+    void updateInterest();
+    void finish(const std::string &response);
+    void wake();
+
+    const LocationConfig &location;
+    std::string method;
+    std::string version;
+    std::string request_head; // up to the blank line, X-Forwarded-For added on attach
+    std::string forwarded_for; // client's own X-Forwarded-For, if any
+    std::string body;          // received with the headers
+    bool body_streamed;        // the rest arrives through feedBody
+
+    StreamContext context;
+    int client_fd;
+    int fd;            // upstream socket, -1 when none
+    unsigned int watch;
+    bool connecting;
+    bool reused;       // fd came from the pool
+    bool retried;
+    bool idempotent;   // may be sent again on a new socket
+    time_t deadline;   // 0 while no timer runs
+
+    std::string output; // bytes for the upstream not written yet
+    size_t output_offset;
+    bool output_last;   // the whole request is in output
+    bool client_paused; // feedBody asked the client to stop
+
+    std::string raw;    // reply bytes not parsed yet
+    bool got_reply;     // any reply byte was read
+    Framing framing;
+    size_t remaining;   // of a Content-Length body or the current chunk
+    int chunk_state;
+    bool keepalive;     // the upstream allows reusing the socket
+
+    std::string head;    // HTTP status line and headers, sent first
+    std::string pending; // body bytes not pulled yet
+    bool head_ready;
+    bool head_sent;
+    bool want_chunked;
+    bool paused; // upstream reads stopped until pending drains
+    bool done;
+    bool failed; // upstream broke after the head: abort the client
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "EventLoop.hpp"
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+class ProxyClient;
+
+// Per-worker keep-alive sockets to proxy_pass upstreams, keyed by the
+// resolved "ip:port". An idle socket stays watched for reading: anything
+// arriving on it, the upstream's FIN included, means it can no longer
+// carry a request and it is dropped. The pool also runs the timers of the
+// worker's proxied requests from reap().
+class ProxyPool : public IoHandler
+{
+public:
+    explicit ProxyPool(EventLoop &loop);
+    ~ProxyPool();
+
+    // An idle socket to target, most recently used first; -1 when none
+    int take(const std::string &target);
+    // Keeps fd for reuse while target has fewer than max_idle idle sockets,
+    // else closes it
+    void give(const std::string &target, int fd, size_t max_idle, int idle_timeout);
+
+    void track(ProxyClient *client);
+    void untrack(ProxyClient *client);
+
+    // Closes idle sockets past their timeout and expires request timers.
+    // Called from the server loop.
+    void reap();
+
+    void handleIo(int fd, unsigned int events);
+
+private:
+    struct Idle
+    {
+        int fd;
+        time_t expires;
+    };
+
+    ProxyPool(const ProxyPool &);
+    ProxyPool &operator=(const ProxyPool &);
+
+    void drop(const std::string &target, size_t index);
+
+    EventLoop &loop;
+    std::map<std::string, std::vector<Idle> > idle;
+    std::map<int, std::string> targets; // idle fd -> key in idle
+    std::vector<ProxyClient *> clients;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+class EventLoop;
+class FastCgiPool;
+class CgiReaper;
+class ProxyPool;
+
+// Implemented by the connection owner so a stream waiting on another fd can
+// ask to be pulled again once it has something to hand over.
+class StreamWaker
+{
+public:
+    virtual ~StreamWaker() {}
+    virtual void wake(int client_fd) = 0;
+};
+
+// Per-worker services lent to a stream when a connection attaches it
+struct StreamContext
+{
+    EventLoop *loop;
+    StreamWaker *waker;
+    FastCgiPool *fastcgi;
+    CgiReaper *cgi;
+    ProxyPool *proxy;
+
+    StreamContext() : loop(NULL), waker(NULL), fastcgi(NULL), cgi(NULL), proxy(NULL) {}
+};
+
+// A response body produced incrementally. The client connection pulls from it
+// whenever its socket is writable and its send buffer has drained, so large or
+// slow bodies never have to be materialized in one piece.
+class ResponseStream
+{
+public:
+    enum Status
+    {
+        STREAM_DATA,  // bytes were appended (possibly none), pull again
+        STREAM_END,   // body complete
+        STREAM_AGAIN, // nothing yet; the stream wakes its connection later
+        STREAM_ERROR  // abort the connection
+    };
+
+    ResponseStream() : chunked(false) {}
+    virtual ~ResponseStream() {}
+
+    virtual Status pull(std::string &out) = 0;
+
+    // Called once a connection owns the stream. Streams fed by another fd
+    // (upstreams) register it with the loop here.
+    virtual void attach(const StreamContext &ctx, int client_fd)
+    {
+        (void)ctx;
+        (void)client_fd;
+    }
+
+    // Request body bytes received after the stream was created (see
+    // HttpResponse::streamsRequestBody); last marks the final piece. Data is
+    // always taken; false asks the connection to stop reading until woken.
+    virtual bool feedBody(const char *data, size_t len, bool last)
+    {
+        (void)data;
+        (void)len;
+        (void)last;
+        return true;
+    }
+
+    // True while the stream waits on its upstream rather than on the client:
+    // the upstream's own timers own that wait, not the client timeout.
+    virtual bool awaitingUpstream() const { return false; }
+
+    // When true the connection frames every pulled piece as an HTTP/1.1 chunk
+    bool isChunked() const { return chunked; }
+    void setChunked(bool value) { chunked = value; }
+
+private:
+    ResponseStream(const ResponseStream&);
+    ResponseStream& operator=(const ResponseStream&);
+
+    bool chunked;
+};
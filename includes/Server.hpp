@@ -3,47 +3,59 @@
 
 #include "ClientManager.hpp"
 #include "Config.hpp"
+#include "EventLoop.hpp"
+#include "VirtualHosts.hpp"
 
+#include <ctime>
+#include <map>
 #include <netinet/in.h>
-#include <poll.h>
 #include <sys/socket.h>
-#ifdef __linux__
-#include <sys/epoll.h>
-#endif
-#include <vector>
 
-class Server {
+// One worker process, serving every server block of the config. The
+// listening sockets are bound by the master, which keeps them across
+// reloads, and are only adopted here; each request is handed to the block
+// its port and Host header select. Stop signals are read
+// by the event loop (a signalfd on Linux): SIGTERM or SIGQUIT make the
+// worker stop accepting and exit once its last client is done, or when
+// shutdown_timeout runs out; SIGINT exits right away.
+class Server : public IoHandler {
 public:
-    explicit Server(const ServerConfig &config);
+    // listeners: port -> socket, for the ports of servers
+    Server(const std::vector<ServerConfig> &servers, const std::map<int, int> &listeners);
     ~Server();
 
+    // Non-blocking socket listening on 127.0.0.1:port, -1 on failure
+    static int openListener(int port);
+    // Called in the freshly forked worker
+    static void installSignalHandlers();
+
     bool init();
     void run();
     void stop();
 
-    int getPort() const;
-    int getServerFd() const;
     bool isRunning() const;
     bool isInitialized() const;
 
+    // listener and signal readiness
+    void handleIo(int fd, unsigned int events);
+
 private:
     Server(const Server&);
     Server& operator=(const Server&);
 
-    bool handleNewConnection();
-    void buildPollFds();
-    void processReadyFds();
+    bool handleNewConnection(int listen_fd, int port);
+    void handleSignal(int sig);
+    void stopAccepting();
     void cleanup();
 
-    const ServerConfig config;
+    const std::vector<ServerConfig> servers;
+    VirtualHosts vhosts; // over servers
+    EventLoop loop; // epoll on Linux, poll on macOS
     ClientManager clients;
-    sockaddr_in address;
-    int server_fd;
+    std::map<int, int> listeners; // socket -> port; emptied to drain
+    int signal_fd;            // -1 where signalfd is not available
+    int shutdown_timeout;     // the longest of the servers'
+    time_t shutdown_deadline; // while draining
     bool is_running;
     bool is_init;
-    std::vector<struct pollfd> poll_fds; // rebuilt each loop for clarity
-
-#ifdef __linux__
-    int epoll_fd; // epoll instance on Linux
-#endif
 };
\ No newline at end of file
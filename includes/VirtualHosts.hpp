@@ -0,0 +1,56 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+struct ServerConfig;
+
+// (port, Host) -> server block. Names are kept lowercase in an
+// open-addressing hash table shared by every port, so picking the server
+// for a request costs a few probes however many sites a worker hosts.
+// Lookup order: exact name, longest "*.example.com", longest
+// "www.example.*", then the port's default server (the first block on it,
+// unless one says "listen <port> default_server").
+class VirtualHosts
+{
+public:
+    // Throws std::runtime_error for two default servers on one port or a
+    // malformed wildcard. servers must outlive the table.
+    explicit VirtualHosts(const std::vector<ServerConfig> &servers);
+
+    // host is the raw Host header value, possibly empty or with a port
+    const ServerConfig &resolve(int port, const std::string &host) const;
+    const ServerConfig &defaultServer(int port) const;
+
+    const std::vector<ServerConfig> &servers() const { return *all; }
+    // Names already claimed on their port by an earlier block, and ignored
+    const std::vector<std::string> &conflicts() const { return ignored; }
+    std::vector<int> ports() const;
+
+private:
+    struct Slot
+    {
+        Slot() : port(0), name(), server(0) {}
+
+        int port;         // 0 == free
+        std::string name; // exact; ".example.com" or "www.example." for wildcards
+        size_t server;    // index into *all
+    };
+
+    VirtualHosts(const VirtualHosts &);
+    VirtualHosts &operator=(const VirtualHosts &);
+
+    static unsigned long hash(int port, const char *s, size_t len);
+    static bool sameName(const std::string &key, const char *s, size_t len);
+    void addName(int port, const std::string &server_name, size_t server);
+    void insert(int port, const std::string &name, size_t server);
+    void grow();
+    const Slot *find(int port, const char *s, size_t len) const;
+
+    const std::vector<ServerConfig> *all;
+    std::vector<Slot> slots; // size is always a power of two
+    size_t count;
+    std::map<int, size_t> defaults; // port -> default server
+    std::vector<std::string> ignored;
+};
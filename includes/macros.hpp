@@ -2,6 +2,7 @@
 
 #define MAX_CLIENTS 20
 #define CLIENT_TIMEOUT 5 // in sec
+#define SHUTDOWN_TIMEOUT 30 // in sec, draining on SIGTERM/SIGQUIT
 
 // HTTP Status Code Enums
 enum HttpStatusCode {
@@ -3,7 +3,7 @@ set -euo pipefail
 
 SERVER_BIN="./webserv"
 # Leave empty to use embedded defaults; set to a valid file to override
-CONFIG_FILE=""
+CONFIG_FILE="config/integration_test.conf"
 TEST_SRC="tests/integration_tests.cpp"
 TEST_BIN="tests/integration_tests"
 
@@ -30,7 +30,8 @@ c++ -std=c++11 -Wall -Wextra -Werror "$TEST_SRC" -o "$TEST_BIN"
 
 echo -e "${YELLOW}[RUN] Executing tests...${NC}"
 set +e
-"$TEST_BIN"
+# The last test drains the server with SIGQUIT
+WEBSERV_PID=$PARENT_PID "$TEST_BIN"
 TEST_STATUS=$?
 set -e
 
@@ -42,6 +43,13 @@ fi
 
 echo -e "${YELLOW}[RUN] Stopping server...${NC}"
 kill -TERM "$PARENT_PID" 2>/dev/null || true
+# Give it a few seconds, then make sure no worker outlives the run
+for _ in $(seq 1 30); do
+  grep -qs '^State:[[:space:]]*[^Z]' "/proc/$PARENT_PID/status" || break
+  sleep 0.1
+done
+pkill -KILL -P "$PARENT_PID" 2>/dev/null || true
+kill -KILL "$PARENT_PID" 2>/dev/null || true
 wait "$PARENT_PID" 2>/dev/null || true
 
 echo -e "${YELLOW}[CLEANUP] Done.${NC}"
@@ -1,11 +1,13 @@
 #!/usr/bin/env bash
 set -euo pipefail
 
+# Second argument: a TCP port on 127.0.0.1, or unix:/path/to.sock
 PORT="${2:-9000}"
 CMD="${1:-start}"
-LOG="/tmp/fcgi_backend_${PORT}.log"
-PIDFILE="/tmp/fcgi_backend_${PORT}.pid"
-WRAPPER="/tmp/fcgi_backend_${PORT}.py"
+NAME="$(printf '%s' "$PORT" | tr -c 'A-Za-z0-9' '_')"
+LOG="/tmp/fcgi_backend_${NAME}.log"
+PIDFILE="/tmp/fcgi_backend_${NAME}.pid"
+WRAPPER="/tmp/fcgi_backend_${NAME}.py"
 
 function check_python() {
     command -v python3 >/dev/null || { echo "python3 not found" >&2; exit 1; }
@@ -80,8 +82,14 @@ def app(env, start_response):
 
 
 if __name__ == '__main__':
-    port = int(sys.argv[1]) if len(sys.argv) > 1 else 9000
-    WSGIServer(app, bindAddress=('127.0.0.1', port)).run()
+    arg = sys.argv[1] if len(sys.argv) > 1 else '9000'
+    if arg.startswith('unix:'):
+        bind = arg[len('unix:'):]
+        if os.path.exists(bind):
+            os.unlink(bind)  # stale socket from a previous run
+    else:
+        bind = ('127.0.0.1', int(arg))
+    WSGIServer(app, bindAddress=bind).run()
 PY
 chmod +x "$WRAPPER"
 }
@@ -97,7 +105,7 @@ case "$CMD" in
     write_wrapper
     nohup python3 "$WRAPPER" "$PORT" > "$LOG" 2>&1 &
     echo $! > "$PIDFILE"
-    echo "Started FastCGI backend on port $PORT (pid $(cat "$PIDFILE")), log: $LOG"
+    echo "Started FastCGI backend on $PORT (pid $(cat "$PIDFILE")), log: $LOG"
     ;;
   stop)
     if [ -f "$PIDFILE" ]; then
@@ -119,7 +127,7 @@ case "$CMD" in
     fi
     ;;
   *)
-    echo "Usage: $0 {start|stop|status} [port]" >&2
+    echo "Usage: $0 {start|stop|status} [port|unix:/path]" >&2
     exit 1
     ;;
 esac
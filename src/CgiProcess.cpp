@@ -0,0 +1,446 @@
+#include "CgiProcess.hpp"
+#include "CgiOutput.hpp"
+#include "CgiReaper.hpp"
+
+#include <cctype>
+#include <csignal>
+#include <cstdlib>
+#include <sstream>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+// Output buffered for a slow client before the script's stdout stops being read
+const size_t kHighWater = 256u * 1024u;
+// A script must finish its CGI header block within this many bytes
+const size_t kMaxHeaderBlock = 64u * 1024u;
+// Request body waiting for the script before the client is paused
+const size_t kStdinWindow = 256u * 1024u;
+const size_t kReadSize = 64u * 1024u;
+
+std::string toString(size_t value)
+{
+    std::ostringstream oss;
+    oss << value;
+    return oss.str();
+}
+
+// "Accept-Language" -> "HTTP_ACCEPT_LANGUAGE"
+std::string metaVariable(const std::string &header)
+{
+    std::string name = "HTTP_";
+    for (size_t i = 0; i < header.size(); ++i)
+    {
+        const unsigned char c = static_cast<unsigned char>(header[i]);
+        name += (c == '-') ? '_' : static_cast<char>(std::toupper(c));
+    }
+    return name;
+}
+
+std::string lower(std::string s)
+{
+    for (size_t i = 0; i < s.size(); ++i)
+        s[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(s[i])));
+    return s;
+}
+
+// Client sockets and the epoll fd are not CLOEXEC: the script gets none of them
+void closeInherited()
+{
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, 3, ~0U, 0) == 0)
+        return;
+#endif
+    const long max = sysconf(_SC_OPEN_MAX);
+    for (long fd = 3; fd < max; ++fd)
+        close(static_cast<int>(fd));
+}
+
+// The worker blocks its stop signals for its signalfd and ignores a few
+// others; both would survive the exec
+void resetSignals()
+{
+    sigset_t none;
+
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    std::signal(SIGPIPE, SIG_DFL);
+    std::signal(SIGHUP, SIG_DFL);
+    std::signal(SIGUSR2, SIG_DFL);
+}
+
+void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+} // namespace
+
+CgiProcess::CgiProcess(const HttpRequest &request,
+                       const ServerConfig &server_config,
+                       const LocationConfig &location_config,
+                       const std::string &script_path)
+    : server(server_config)
+    , location(location_config)
+    , script(script_path)
+    , version(request.getHttpVersion())
+    , env()
+    , context()
+    , client_fd(-1)
+    , pid(-1)
+    , in_fd(-1)
+    , out_fd(-1)
+    , in_watch(0)
+    , out_watch(0)
+    , input(request.getBody())
+    , input_offset(0)
+    , input_last(!request.isBodyStreamed())
+    , client_paused(false)
+    , header_buf()
+    , head()
+    , pending()
+    , head_ready(false)
+    , head_sent(false)
+    , want_chunked(false)
+    , paused(false)
+    , done(false)
+{
+    env = buildEnv(request);
+}
+
+CgiProcess::~CgiProcess()
+{
+    // Still producing output nobody will read
+    if (pid > 0 && out_fd >= 0 && context.cgi)
+        context.cgi->kill(pid);
+    closeInput();
+    closeOutput();
+}
+
+std::vector<std::string> CgiProcess::buildEnv(const HttpRequest &req) const
+{
+    std::vector<std::string> vars;
+
+    vars.push_back("GATEWAY_INTERFACE=CGI/1.1");
+    vars.push_back("SERVER_SOFTWARE=webserv");
+    vars.push_back("SERVER_NAME=" + server.server_name);
+    vars.push_back("SERVER_PORT=" + toString(server.port));
+    vars.push_back("SERVER_PROTOCOL=" + req.getHttpVersion());
+    vars.push_back("DOCUMENT_ROOT=" + server.root);
+    // php-cgi refuses to run without it
+    vars.push_back("REDIRECT_STATUS=200");
+    vars.push_back("REQUEST_METHOD=" + req.getMethod());
+
+    const std::string &uri = req.getUri();
+    const std::string::size_type qpos = uri.find('?');
+    const std::string path = uri.substr(0, qpos);
+    vars.push_back("QUERY_STRING=" + (qpos == std::string::npos ? std::string() : uri.substr(qpos + 1)));
+    vars.push_back("SCRIPT_NAME=" + path);
+    vars.push_back("PATH_INFO=" + path);
+    vars.push_back("SCRIPT_FILENAME=" + script);
+
+    const std::map<std::string, std::string> &hdrs = req.getHeaders();
+    std::string content_length = toString(req.getBody().size());
+    for (std::map<std::string, std::string>::const_iterator it = hdrs.begin(); it != hdrs.end(); ++it)
+    {
+        const std::string name = lower(it->first);
+        if (name == "content-type")
+            vars.push_back("CONTENT_TYPE=" + it->second);
+        else if (name == "content-length")
+            content_length = it->second;
+        else
+            vars.push_back(metaVariable(it->first) + "=" + it->second);
+    }
+    vars.push_back("CONTENT_LENGTH=" + content_length);
+
+    if (const char *search = std::getenv("PATH"))
+        vars.push_back(std::string("PATH=") + search);
+    return vars;
+}
+
+void CgiProcess::attach(const StreamContext &ctx, int client)
+{
+    context = ctx;
+    client_fd = client;
+    if (!spawn())
+        return finish(cgi_output::buildError(version, 500, "Internal Server Error", "<html><body><h1>500 Internal Server Error</h1><p>Cannot start CGI</p></body></html>"));
+    writeInput();
+}
+
+bool CgiProcess::spawn()
+{
+    int in[2];
+    int out[2];
+
+    if (pipe(in) < 0)
+        return false;
+    if (pipe(out) < 0)
+    {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+    pid = fork();
+    if (pid < 0)
+    {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        closeInherited();
+        resetSignals();
+
+        // Scripts expect to run from their own directory
+        std::string name = script;
+        const std::string::size_type slash = script.rfind('/');
+        if (slash != std::string::npos)
+        {
+            name = script.substr(slash + 1);
+            if (chdir(slash ? script.substr(0, slash).c_str() : "/") < 0)
+                _exit(127);
+        }
+
+        std::vector<char *> argv;
+        argv.push_back(const_cast<char *>(location.cgi_path.c_str()));
+        argv.push_back(const_cast<char *>(name.c_str()));
+        argv.push_back(NULL);
+        std::vector<char *> envp;
+        for (size_t i = 0; i < env.size(); ++i)
+            envp.push_back(const_cast<char *>(env[i].c_str()));
+        envp.push_back(NULL);
+        execve(argv[0], &argv[0], &envp[0]);
+        std::cerr << "CGI: cannot run " << argv[0] << ": " << std::strerror(errno) << std::endl;
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    in_fd = in[1];
+    out_fd = out[0];
+    setNonBlocking(in_fd);
+    setNonBlocking(out_fd);
+    context.cgi->watch(pid);
+    std::vector<std::string>().swap(env);
+    return true;
+}
+
+bool CgiProcess::feedBody(const char *data, size_t len, bool last)
+{
+    if (in_fd < 0)
+        return true; // the script stopped reading: drop the rest
+
+    input.append(data, len);
+    input_last = last;
+    writeInput();
+    if (last || in_fd < 0 || input.size() - input_offset < kStdinWindow)
+        return true;
+    // Hold the client until the script catches up
+    client_paused = true;
+    return false;
+}
+
+void CgiProcess::writeInput()
+{
+    while (in_fd >= 0 && input_offset < input.size())
+    {
+        const ssize_t n = write(in_fd, input.data() + input_offset, input.size() - input_offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0)
+        {
+            // EPIPE: the script exited or closed its stdin
+            closeInput();
+            break;
+        }
+        input_offset += static_cast<size_t>(n);
+    }
+    if (input_offset == input.size())
+    {
+        input.clear();
+        input_offset = 0;
+        if (input_last)
+            closeInput();
+    }
+    if (client_paused && (in_fd < 0 || input.size() - input_offset < kStdinWindow))
+    {
+        client_paused = false;
+        wake();
+    }
+    updateInterest();
+}
+
+void CgiProcess::readOutput()
+{
+    char buf[kReadSize];
+
+    while (out_fd >= 0 && !paused)
+    {
+        const ssize_t n = read(out_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+        {
+            closeOutput();
+            if (!head_ready)
+                return finish(cgi_output::buildResponse(version, header_buf));
+            done = true;
+            wake();
+            return;
+        }
+        if (head_ready)
+        {
+            pending.append(buf, static_cast<size_t>(n));
+            if (pending.size() >= kHighWater)
+            {
+                paused = true;
+                updateInterest();
+            }
+            wake();
+            continue;
+        }
+
+        header_buf.append(buf, static_cast<size_t>(n));
+        size_t body_start;
+        const std::string::size_type end = cgi_output::findHeaderEnd(header_buf, body_start);
+        if (end == std::string::npos)
+        {
+            if (header_buf.size() > kMaxHeaderBlock)
+                return finish(cgi_output::buildError(version, 502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>CGI header block too large</p></body></html>"));
+            continue;
+        }
+        head = cgi_output::buildHead(version, header_buf.substr(0, end), std::string::npos, want_chunked);
+        pending = header_buf.substr(body_start);
+        std::string().swap(header_buf);
+        head_ready = true;
+        wake();
+    }
+}
+
+void CgiProcess::handleIo(int fd, unsigned int events)
+{
+    if (fd == in_fd)
+    {
+        if (events & IO_ERROR)
+            closeInput();
+        writeInput();
+        return;
+    }
+    if (fd == out_fd)
+        readOutput();
+}
+
+void CgiProcess::closeInput()
+{
+    if (in_fd < 0)
+        return;
+    if (in_watch)
+        context.loop->remove(in_fd);
+    in_watch = 0;
+    close(in_fd);
+    in_fd = -1;
+    std::string().swap(input);
+    input_offset = 0;
+}
+
+void CgiProcess::closeOutput()
+{
+    if (out_fd < 0)
+        return;
+    if (out_watch)
+        context.loop->remove(out_fd);
+    out_watch = 0;
+    close(out_fd);
+    out_fd = -1;
+}
+
+// A paused or idle pipe leaves the loop: a hung-up one would otherwise
+// keep reporting readiness
+void CgiProcess::updateInterest()
+{
+    const unsigned int want_in = (in_fd >= 0 && input_offset < input.size()) ? IO_WRITE : 0;
+    const unsigned int want_out = (out_fd >= 0 && !paused) ? IO_READ : 0;
+
+    if (want_in != in_watch)
+    {
+        if (!want_in)
+            context.loop->remove(in_fd);
+        else if (!context.loop->add(in_fd, want_in, this))
+            return closeInput();
+        in_watch = want_in;
+    }
+    if (want_out != out_watch)
+    {
+        if (!want_out)
+            context.loop->remove(out_fd);
+        else if (!context.loop->add(out_fd, want_out, this))
+        {
+            closeOutput();
+            return finish(cgi_output::buildError(version, 500, "Internal Server Error", "<html><body><h1>500 Internal Server Error</h1><p>Cannot watch CGI output</p></body></html>"));
+        }
+        out_watch = want_out;
+    }
+}
+
+// Whole response known up front; the script's output is no longer wanted
+void CgiProcess::finish(const std::string &response)
+{
+    if (pid > 0 && out_fd >= 0)
+        context.cgi->kill(pid);
+    closeInput();
+    closeOutput();
+    head = response;
+    pending.clear();
+    want_chunked = false;
+    head_ready = true;
+    done = true;
+    wake();
+}
+
+void CgiProcess::wake()
+{
+    if (context.waker)
+        context.waker->wake(client_fd);
+}
+
+ResponseStream::Status CgiProcess::pull(std::string &out)
+{
+    if (!head_ready)
+        return STREAM_AGAIN;
+
+    if (!head_sent)
+    {
+        // The head goes out alone when chunking, so it is never framed
+        head_sent = true;
+        out.swap(head);
+        std::string().swap(head);
+        if (want_chunked)
+            return STREAM_DATA;
+        out += pending;
+        pending.clear();
+        return done ? STREAM_END : STREAM_DATA;
+    }
+
+    setChunked(want_chunked);
+    out.swap(pending);
+    pending.clear();
+    if (paused)
+    {
+        paused = false;
+        updateInterest();
+    }
+    if (done)
+        return STREAM_END;
+    return out.empty() ? STREAM_AGAIN : STREAM_DATA;
+}
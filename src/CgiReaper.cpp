@@ -0,0 +1,109 @@
+#include "CgiReaper.hpp"
+
+#include <algorithm>
+#include <signal.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+int openPidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+} // namespace
+
+CgiReaper::CgiReaper(EventLoop &event_loop)
+    : loop(event_loop)
+    , pidfds()
+    , polled()
+{
+}
+
+CgiReaper::~CgiReaper()
+{
+    // The worker is going away: nobody will read what they produce
+    for (std::map<int, pid_t>::iterator it = pidfds.begin(); it != pidfds.end(); ++it)
+    {
+        ::kill(it->second, SIGKILL);
+        waitpid(it->second, NULL, 0);
+        loop.remove(it->first);
+        close(it->first);
+    }
+    for (size_t i = 0; i < polled.size(); ++i)
+    {
+        ::kill(polled[i], SIGKILL);
+        waitpid(polled[i], NULL, 0);
+    }
+}
+
+void CgiReaper::watch(pid_t pid)
+{
+    const int fd = openPidfd(pid);
+    if (fd >= 0)
+    {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (loop.add(fd, IO_READ, this))
+        {
+            pidfds[fd] = pid;
+            return;
+        }
+        close(fd);
+    }
+    polled.push_back(pid);
+}
+
+void CgiReaper::kill(pid_t pid)
+{
+    for (std::map<int, pid_t>::const_iterator it = pidfds.begin(); it != pidfds.end(); ++it)
+    {
+        if (it->second == pid)
+        {
+            ::kill(pid, SIGKILL);
+            return;
+        }
+    }
+    if (std::find(polled.begin(), polled.end(), pid) != polled.end())
+        ::kill(pid, SIGKILL);
+}
+
+// True once pid is reaped (or was never ours)
+bool CgiReaper::collect(pid_t pid)
+{
+    int status = 0;
+    const pid_t rc = waitpid(pid, &status, WNOHANG);
+
+    if (rc == 0)
+        return false;
+    if (rc == pid && WIFSIGNALED(status) && WTERMSIG(status) != SIGKILL)
+        std::cerr << "CGI PID " << pid << " killed by signal " << WTERMSIG(status) << std::endl;
+    return true;
+}
+
+void CgiReaper::reap()
+{
+    for (size_t i = polled.size(); i > 0; --i)
+    {
+        if (collect(polled[i - 1]))
+            polled.erase(polled.begin() + (i - 1));
+    }
+}
+
+void CgiReaper::handleIo(int fd, unsigned int events)
+{
+    (void)events;
+    std::map<int, pid_t>::iterator it = pidfds.find(fd);
+    if (it == pidfds.end() || !collect(it->second))
+        return;
+    pidfds.erase(it);
+    loop.remove(fd);
+    close(fd);
+}
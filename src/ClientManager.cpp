@@ -5,6 +5,7 @@
 
 #include <ctime>
 #include <sstream>
+#include <strings.h>
 
 namespace {
 
@@ -16,24 +17,75 @@ std::string formatEndpoint(const sockaddr_in &addr)
 }
 
 const std::size_t kReadChunk = 4096u;
+// Upper bound of bytes queued per writable event so one large stream cannot
+// starve the other connections sharing the loop.
+const std::size_t kWriteBudget = 256u * 1024u;
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+// Value of the Host header in a complete request head, "" when absent
+std::string hostHeader(const std::string &head)
+{
+    const std::string::size_type end = head.find("\r\n\r\n");
+    std::string::size_type line = head.find("\r\n");
+
+    while (line != std::string::npos && line < end)
+    {
+        line += 2;
+        if (end - line >= 5 && strncasecmp(head.c_str() + line, "host:", 5) == 0)
+        {
+            std::string::size_type start = line + 5;
+            std::string::size_type stop = head.find("\r\n", start);
+            while (start < stop && (head[start] == ' ' || head[start] == '\t'))
+                ++start;
+            while (stop > start && (head[stop - 1] == ' ' || head[stop - 1] == '\t'))
+                --stop;
+            return head.substr(start, stop - start);
+        }
+        line = head.find("\r\n", line);
+    }
+    return std::string();
+}
+
+void appendChunk(std::string &out, const std::string &data)
+{
+    char size[32];
+
+    std::snprintf(size, sizeof(size), "%lx\r\n", static_cast<unsigned long>(data.size()));
+    out += size;
+    out += data;
+    out += "\r\n";
+}
 
 } // namespace
 
-ClientManager::ClientManager(const ServerConfig & config) : config(config)
+ClientManager::ClientManager(const VirtualHosts & vhosts, EventLoop & loop)
+    : vhosts(vhosts)
+    , loop(loop)
+    , fastcgi_pool(loop)
+    , cgi_reaper(loop)
+    , proxy_pool(loop)
 {
-    
+    for (size_t i = 0; i < vhosts.servers().size(); ++i)
+        fastcgi_pool.configure(vhosts.servers()[i]);
 }
 
 ClientManager::~ClientManager() {
     for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        loop.remove(it->first);
         close(it->first); 
+        delete it->second.stream;
     }
     clients.clear();
     std::cout << "ClientManager destroyed" << std::endl;
 }
 
 
-bool ClientManager::addClient(int socket_fd, const struct sockaddr_in& addr) {
+bool ClientManager::addClient(int socket_fd, const struct sockaddr_in& addr, int port) {
     if (isFull()) {
         std::cerr << "ClientManager: Maximum clients reached (" << MAX_CLIENTS << ")" << std::endl;
         return false;
@@ -42,10 +94,17 @@ bool ClientManager::addClient(int socket_fd, const struct sockaddr_in& addr) {
     Client new_client;
     new_client.socket_fd = socket_fd;
     new_client.address = addr;
+    new_client.port = port;
+    new_client.server = &vhosts.defaultServer(port);
     new_client.last_activity = std::time(NULL);
     new_client.is_active = true;
     new_client.recv_buffer.clear();
-    
+
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK);
+    if (!loop.add(socket_fd, IO_READ, this)) {
+        std::cerr << "ClientManager: cannot watch fd=" << socket_fd << std::endl;
+        return false;
+    }
     clients[socket_fd] = new_client;
     
     std::cout << "Client added: fd=" << socket_fd
@@ -63,8 +122,10 @@ void ClientManager::removeClient(int socket_fd) {
                   << " endpoint=" << formatEndpoint(it->second.address)
                   << " remaining=" << getClientCount() - 1 << std::endl;
         
+        loop.remove(it->first);
         close(it->first);
         it->second.recv_buffer.clear();
+        delete it->second.stream;
         clients.erase(it);
     }
 }
@@ -114,6 +175,9 @@ ClientManager::ReadResult ClientManager::readPartial(int socket_fd, std::string
         return ClientManager::READ_CLOSED; // connection closed by peer
     }
 
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return ClientManager::READ_OK; // spurious wakeup, nothing buffered yet
+
     std::cerr << "Read error on socket fd=" << socket_fd << std::endl;
     return ClientManager::READ_ERROR;
 }
@@ -162,56 +226,229 @@ bool ClientManager::requestComplete(const std::string &buffer)
     return (buffer.size() - body_start >= need);
 }
 
-// poll variant: readable_fds are those with POLLIN ready
-void ClientManager::processClientRequestPoll(const std::vector<int>& readable_fds)
+void ClientManager::handleIo(int socket_fd, unsigned int events)
 {
-    HttpRequest request;
-    std::string response;
+    if (clients.find(socket_fd) == clients.end())
+        return;
 
-    for (size_t i = 0; i < readable_fds.size(); ++i) {
-        int socket_fd = readable_fds[i];
-        std::map<int, Client>::iterator it = clients.find(socket_fd);
-        if (it == clients.end())
-            continue;
+    if (events & (IO_ERROR | IO_HUP))
+    {
+        removeClient(socket_fd);
+        return;
+    }
+    if ((events & IO_READ) && !handleReadable(socket_fd))
+        return;
+    if (events & IO_WRITE)
+        flushClient(socket_fd);
+}
 
-        Client &cli = it->second; 
+bool ClientManager::handleReadable(int socket_fd)
+{
+    Client &cli = clients[socket_fd];
+    const size_t buffered = cli.recv_buffer.size();
 
-        // Read a small chunk and handle failures explicitly
+    // Read a small chunk and handle failures explicitly
     ClientManager::ReadResult status = readPartial(socket_fd, cli.recv_buffer, kReadChunk);
     if (status != ClientManager::READ_OK)
+    {
+        removeClient(socket_fd);
+        return false;
+    }
+
+    // Update activity since we successfully received data
+    updateActivity(socket_fd);
+
+    // Body of a request whose response is already under way
+    if (cli.body_remaining > 0)
+    {
+        std::string data;
+        data.swap(cli.recv_buffer);
+        feedBody(cli, data);
+        updateInterest(socket_fd, cli);
+        return true;
+    }
+    if (cli.stream || !cli.send_buffer.empty())
+    {
+        cli.recv_buffer.clear(); // nothing more is read once a response started
+        return true;
+    }
+
+    // Only proceed when full request is available
+    if (!requestComplete(cli.recv_buffer))
+    {
+        const size_t hdr_end = cli.recv_buffer.find("\r\n\r\n");
+        if (hdr_end == std::string::npos || hdr_end + 4 <= buffered)
+            return true; // wait for more data
+
+        // Headers just completed: bodies bound for a streaming handler start now
+        const size_t need = parseContentLength(cli.recv_buffer);
+        const ServerConfig &server = resolveServer(cli);
+        HttpRequest request;
+        if (!request.parseRequest(cli.recv_buffer, server.root)
+            || !HttpResponse::streamsRequestBody(request, server))
+            return true;
+        request.setBodyStreamed(true);
+        cli.body_remaining = need - (cli.recv_buffer.size() - hdr_end - 4);
+        return startResponse(socket_fd, cli, request);
+    }
+
+    // Parse and respond
+    HttpRequest request;
+    if (!request.parseRequest(cli.recv_buffer, resolveServer(cli).root))
+    {
+        cli.recv_buffer.clear();
+        cli.send_buffer = "HTTP/1.0 400 Bad Request\r\n\r\n";
+        cli.send_offset = 0;
+        loop.modify(socket_fd, IO_WRITE);
+        return flushClient(socket_fd);
+    }
+    return startResponse(socket_fd, cli, request);
+}
+
+const ServerConfig &ClientManager::resolveServer(Client &cli)
+{
+    cli.server = &vhosts.resolve(cli.port, hostHeader(cli.recv_buffer));
+    return *cli.server;
+}
+
+bool ClientManager::startResponse(int socket_fd, Client &cli, const HttpRequest &request)
+{
+    ResponseStream *stream = NULL;
+
+    cli.send_buffer = HttpResponse::createResponse(request, *cli.server, stream);
+    cli.send_offset = 0;
+    cli.stream = stream;
+    cli.recv_buffer.clear();
+    // Without a stream to take it, the rest of the body is never read
+    if (!stream)
+        cli.body_remaining = 0;
+
+    updateInterest(socket_fd, cli);
+    if (stream)
+    {
+        StreamContext ctx;
+        ctx.loop = &loop;
+        ctx.waker = this;
+        ctx.fastcgi = &fastcgi_pool;
+        ctx.cgi = &cgi_reaper;
+        ctx.proxy = &proxy_pool;
+        stream->attach(ctx, socket_fd);
+    }
+    return flushClient(socket_fd);
+}
+
+void ClientManager::feedBody(Client &cli, const std::string &data)
+{
+    if (data.empty() || !cli.stream)
+        return;
+    // Bytes past Content-Length belong to no request: we close after this one
+    const size_t len = (data.size() < cli.body_remaining) ? data.size() : cli.body_remaining;
+    cli.body_remaining -= len;
+    if (!cli.stream->feedBody(data.data(), len, cli.body_remaining == 0))
+        cli.read_paused = true;
+}
+
+// Reads while a streamed body is still arriving and the stream accepts it;
+// writes unless the stream has parked the socket.
+void ClientManager::updateInterest(int socket_fd, const Client &cli)
+{
+    unsigned int events = 0;
+
+    if (cli.body_remaining > 0 && !cli.read_paused)
+        events |= IO_READ;
+    if (!cli.write_parked)
+        events |= IO_WRITE;
+    loop.modify(socket_fd, events);
+}
+
+// Sends queued bytes, refilling from the client's stream as the socket drains.
+// Since we send "Connection: close" in all responses, the client is removed
+// once everything has been written.
+bool ClientManager::flushClient(int socket_fd)
+{
+    std::map<int, Client>::iterator it = clients.find(socket_fd);
+    if (it == clients.end())
+        return false;
+
+    Client &cli = it->second;
+    size_t budget = kWriteBudget;
+
+    while (true)
+    {
+        if (cli.send_offset < cli.send_buffer.size())
         {
-            removeClient(socket_fd);
+            const ssize_t n = send(socket_fd, cli.send_buffer.data() + cli.send_offset,
+                cli.send_buffer.size() - cli.send_offset, kSendFlags);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    return true; // wait for the next writable event
+                std::cerr << "Send failed for socket " << socket_fd << std::endl;
+                removeClient(socket_fd);
+                return false;
+            }
+            cli.send_offset += static_cast<size_t>(n);
+            updateActivity(socket_fd);
             continue;
         }
 
-        // Update activity since we successfully received data
-        updateActivity(socket_fd);
-
-        // Only proceed when full request is available
-        if (!requestComplete(cli.recv_buffer))
+        cli.send_buffer.clear();
+        cli.send_offset = 0;
+        if (!cli.stream)
         {
-            continue; // wait for more data
+            removeClient(socket_fd);
+            return false;
         }
+        if (budget == 0)
+            return true; // level-triggered: we'll be called again
 
-        // Parse and respond
-        if (request.parseRequest(cli.recv_buffer, this->config.root))
-            response = HttpResponse::createResponse(request, this->config);
-        else
-            response = "HTTP/1.0 400 Bad Request\r\n\r\n";
-
-        if (send(socket_fd, response.c_str(), response.length(), 0) < 0)
+        std::string piece;
+        const ResponseStream::Status st = cli.stream->pull(piece);
+        if (st == ResponseStream::STREAM_ERROR)
         {
-            std::cerr << "Send failed for socket " << socket_fd << std::endl;
             removeClient(socket_fd);
-            continue;
+            return false;
+        }
+        // every pull costs at least one read chunk, even when it yields nothing
+        const size_t cost = (piece.size() > kReadChunk) ? piece.size() : kReadChunk;
+        budget = (cost >= budget) ? 0 : budget - cost;
+        if (!piece.empty())
+        {
+            if (cli.stream->isChunked())
+                appendChunk(cli.send_buffer, piece);
+            else
+                cli.send_buffer.swap(piece);
+        }
+        if (st == ResponseStream::STREAM_AGAIN && cli.send_buffer.empty())
+        {
+            // Park writes until the stream calls wake()
+            cli.write_parked = true;
+            updateInterest(socket_fd, cli);
+            return true;
+        }
+        if (st == ResponseStream::STREAM_END)
+        {
+            if (cli.stream->isChunked())
+                cli.send_buffer += "0\r\n\r\n";
+            delete cli.stream;
+            cli.stream = NULL;
         }
-        
-        // Since we send "Connection: close" in all responses, close the connection
-        removeClient(socket_fd);
     }
 }
 
 
+void ClientManager::wake(int socket_fd)
+{
+    std::map<int, Client>::iterator it = clients.find(socket_fd);
+    if (it == clients.end())
+        return;
+    updateActivity(socket_fd);
+    it->second.read_paused = false;
+    it->second.write_parked = false;
+    updateInterest(socket_fd, it->second);
+}
+
+
 void ClientManager::updateActivity(int socket_fd) {
     std::map<int, Client>::iterator it = clients.find(socket_fd);
     if (it != clients.end()) {
@@ -225,7 +462,12 @@ void ClientManager::checkTimeouts()
     const time_t current_time = std::time(NULL);
     std::map<int, Client>::iterator it = clients.begin();
     while (it != clients.end()) {
-        if (current_time - it->second.last_activity >= config.client_timeout) {
+        const Client &cli = it->second;
+        // Idle by design while a script or proxied server prepares its reply
+        if (cli.stream && cli.send_offset >= cli.send_buffer.size()
+            && (cli.body_remaining == 0 || cli.read_paused) && cli.stream->awaitingUpstream())
+            it->second.last_activity = current_time;
+        if (current_time - it->second.last_activity >= it->second.server->client_timeout) {
             std::cout << "Client timeout: fd=" << it->first << std::endl;
             int socket_fd = it->first;
             ++it;
@@ -234,5 +476,8 @@ void ClientManager::checkTimeouts()
             ++it;
         }
     }
+    fastcgi_pool.reap();
+    cgi_reaper.reap();
+    proxy_pool.reap();
 }
 
@@ -0,0 +1,198 @@
+#include "EventLoop.hpp"
+
+namespace {
+
+#ifdef __linux__
+uint32_t toEpoll(unsigned int events)
+{
+    uint32_t ev = 0;
+
+    if (events & IO_READ)
+        ev |= EPOLLIN;
+    if (events & IO_WRITE)
+        ev |= EPOLLOUT;
+    return ev;
+}
+
+unsigned int fromEpoll(uint32_t ev)
+{
+    unsigned int events = 0;
+
+    if (ev & EPOLLIN)
+        events |= IO_READ;
+    if (ev & EPOLLOUT)
+        events |= IO_WRITE;
+    if (ev & EPOLLERR)
+        events |= IO_ERROR;
+    if (ev & EPOLLHUP)
+        events |= IO_HUP;
+    return events;
+}
+#else
+short toPoll(unsigned int events)
+{
+    short ev = 0;
+
+    if (events & IO_READ)
+        ev |= POLLIN;
+    if (events & IO_WRITE)
+        ev |= POLLOUT;
+    return ev;
+}
+
+unsigned int fromPoll(short ev)
+{
+    unsigned int events = 0;
+
+    if (ev & POLLIN)
+        events |= IO_READ;
+    if (ev & POLLOUT)
+        events |= IO_WRITE;
+    if (ev & (POLLERR | POLLNVAL))
+        events |= IO_ERROR;
+    if (ev & POLLHUP)
+        events |= IO_HUP;
+    return events;
+}
+#endif
+
+} // namespace
+
+EventLoop::EventLoop()
+    : watches()
+    , poll_fds()
+{
+#ifdef __linux__
+    epoll_fd = -1;
+#endif
+}
+
+EventLoop::~EventLoop()
+{
+#ifdef __linux__
+    if (epoll_fd != -1)
+        close(epoll_fd);
+#endif
+}
+
+bool EventLoop::init()
+{
+#ifdef __linux__
+    if (epoll_fd != -1)
+        return true;
+    epoll_fd = epoll_create(1);
+    if (epoll_fd < 0)
+    {
+        std::cerr << "epoll_create failed" << std::endl;
+        return false;
+    }
+    fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+#endif
+    return true;
+}
+
+bool EventLoop::add(int fd, unsigned int events, IoHandler *handler)
+{
+    if (fd < 0 || !handler)
+        return false;
+#ifdef __linux__
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = toEpoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return false;
+#endif
+    Watch w;
+    w.events = events;
+    w.handler = handler;
+    watches[fd] = w;
+    return true;
+}
+
+bool EventLoop::modify(int fd, unsigned int events)
+{
+    std::map<int, Watch>::iterator it = watches.find(fd);
+
+    if (it == watches.end())
+        return false;
+    if (it->second.events == events)
+        return true;
+#ifdef __linux__
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = toEpoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        return false;
+#endif
+    it->second.events = events;
+    return true;
+}
+
+void EventLoop::remove(int fd)
+{
+    std::map<int, Watch>::iterator it = watches.find(fd);
+
+    if (it == watches.end())
+        return;
+#ifdef __linux__
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    watches.erase(it);
+}
+
+bool EventLoop::isWatched(int fd) const
+{
+    return watches.find(fd) != watches.end();
+}
+
+// Handlers may add/remove fds while we dispatch, so always look the
+// owner up again instead of caching it with the ready list.
+void EventLoop::notify(int fd, unsigned int events)
+{
+    std::map<int, Watch>::iterator it = watches.find(fd);
+
+    if (it == watches.end())
+        return;
+    it->second.handler->handleIo(fd, events);
+}
+
+int EventLoop::dispatch(int timeout_ms)
+{
+#ifdef __linux__
+    const int MAX_EVENTS = 1024;
+    struct epoll_event events[MAX_EVENTS];
+
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (n <= 0)
+        return n;
+    for (int i = 0; i < n; ++i)
+        notify(events[i].data.fd, fromEpoll(events[i].events));
+    return n;
+#else
+    poll_fds.clear();
+    for (std::map<int, Watch>::const_iterator it = watches.begin(); it != watches.end(); ++it)
+    {
+        struct pollfd pfd;
+        pfd.fd = it->first;
+        pfd.events = toPoll(it->second.events);
+        pfd.revents = 0;
+        poll_fds.push_back(pfd);
+    }
+    if (poll_fds.empty())
+    {
+        usleep(10000); // 10ms
+        return 0;
+    }
+    int n = poll(&poll_fds[0], poll_fds.size(), timeout_ms);
+    if (n <= 0)
+        return n;
+    for (size_t i = 0; i < poll_fds.size(); ++i)
+    {
+        if (poll_fds[i].revents)
+            notify(poll_fds[i].fd, fromPoll(poll_fds[i].revents));
+    }
+    return n;
+#endif
+}
@@ -1,48 +1,159 @@
 #include "FastCgiBackend.hpp"
 
-FastCgiBackend::FastCgiBackend(void) : _endpoints()
+#include <poll.h>
+#include <sys/mman.h>
+
+namespace
+{
+	// How long a started backend may take to accept connections; its
+	// locations answer 503 meanwhile
+	const time_t	kStartupWindow = 30;
+
+	std::map<std::string, volatile int *>	&flags(void)
+	{
+		static std::map<std::string, volatile int *>	registry;
+		return (registry);
+	}
+
+	// fastcgi_spawn address -> listening socket left by the previous master
+	std::map<std::string, int>	inheritedSockets(void)
+	{
+		const char					*inherited = std::getenv("WEBSERV_FASTCGI_LISTENERS");
+		std::map<std::string, int>	sockets;
+		std::stringstream			ss;
+		std::string					entry;
+		std::string::size_type		eq;
+		int							fd;
+
+		if (!inherited)
+			return (sockets);
+		// "fd=address;fd=address;..."
+		ss.str(inherited);
+		while (std::getline(ss, entry, ';'))
+		{
+			eq = entry.find('=');
+			if (eq == std::string::npos)
+				continue;
+			std::istringstream	item(entry.substr(0, eq));
+			if (!(item >> fd) || fd < 3)
+				continue;
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			sockets[entry.substr(eq + 1)] = fd;
+		}
+		unsetenv("WEBSERV_FASTCGI_LISTENERS");
+		return (sockets);
+	}
+}
+
+FastCgiBackend::FastCgiBackend(void) : _endpoints(), _pools(), _startups(), _helpers()
 {
 }
 
 FastCgiBackend::~FastCgiBackend(void)
 {
+	for (size_t i = 0; i < _pools.size(); ++i)
+		delete _pools[i];
 }
 
-bool	FastCgiBackend::isPortOpen(const std::string &host, int port) const
+volatile int	*FastCgiBackend::startingFlag(const std::string &endpoint)
 {
-	int					fd;
-	struct sockaddr_in	addr;
-	struct timeval		tv;
-	int					res;
+	std::map<std::string, volatile int *>::const_iterator	it;
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0)
-		return (false);
-	std::memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(static_cast<unsigned short>(port));
-	if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+	it = flags().find(endpoint);
+	return (it == flags().end() ? NULL : it->second);
+}
+
+bool	FastCgiBackend::childExited(pid_t pid, int status)
+{
+	std::map<pid_t, std::string>::iterator	it;
+
+	for (size_t i = 0; i < _pools.size(); ++i)
+	{
+		if (_pools[i]->reap(pid, status))
+			return (true);
+	}
+	it = _helpers.find(pid);
+	if (it == _helpers.end())
 	{
-		close(fd);
+		// A server process: a crash leaves its connections counted
+		for (size_t i = 0; i < _pools.size(); ++i)
+			_pools[i]->releaseLoad(pid);
 		return (false);
 	}
-	tv.tv_sec = 0;
-	tv.tv_usec = 200000;
-	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-	res = connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		std::cout << "Started FastCGI helper for " << it->second << std::endl;
+	else
+		std::cerr << "FastCGI helper failed for " << it->second << std::endl;
+	_helpers.erase(it);
+	return (true);
+}
+
+void	FastCgiBackend::tick(void)
+{
+	const time_t	now = std::time(NULL);
+
+	for (size_t i = 0; i < _pools.size(); ++i)
+		_pools[i]->tick(now);
+	for (size_t i = _startups.size(); i > 0; --i)
+	{
+		Startup	&startup = _startups[i - 1];
+
+		if (isReachable(startup.endpoint, 0))
+			std::cout << "FastCGI backend started on " << startup.endpoint.describe() << std::endl;
+		else if (now >= startup.deadline)
+			std::cerr << "Warning: FastCGI backend not reachable on "
+				<< startup.endpoint.describe() << std::endl;
+		else
+			continue;
+		// From now on requests reach it, or fail, like any backend's
+		*startup.starting = 0;
+		_startups.erase(_startups.begin() + (i - 1));
+	}
+}
+
+void	FastCgiBackend::handOver(bool in_child)
+{
+	std::ostringstream	inherited;
+	int					fd;
+
+	for (size_t i = 0; i < _pools.size(); ++i)
+	{
+		fd = _pools[i]->handOver(in_child);
+		if (fd >= 0)
+			inherited << fd << "=" << _pools[i]->address() << ";";
+	}
+	if (in_child)
+		setenv("WEBSERV_FASTCGI_LISTENERS", inherited.str().c_str(), 1);
+}
+
+bool	FastCgiBackend::isReachable(const FastCgiEndpoint &endpoint, int timeout_ms) const
+{
+	int				fd;
+	struct pollfd	pfd;
+	int				err;
+	socklen_t		len;
+
+	// Non-blocking connect bounded by timeout_ms, same budget for TCP and AF_UNIX
+	fd = endpoint.connectSocket(true);
+	if (fd < 0)
+		return (false);
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	err = 1;
+	len = sizeof(err);
+	if (poll(&pfd, 1, timeout_ms) == 1)
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
 	close(fd);
-	return (res == 0);
+	return (err == 0);
 }
 
 void	FastCgiBackend::collectEndpoints(const std::vector<ServerConfig> &servers)
 {
-	size_t					i;
-	size_t					j;
-	std::string::size_type	colon;
-	std::string				host;
-	std::string				portStr;
-	int						port;
+	size_t			i;
+	size_t			j;
+	size_t			k;
+	FastCgiEndpoint	endpoint;
 
 	_endpoints.clear();
 	for (i = 0; i < servers.size(); ++i)
@@ -53,42 +164,45 @@ void	FastCgiBackend::collectEndpoints(const std::vector<ServerConfig> &servers)
 			const LocationConfig &loc = s.locations[j];
 			if (loc.fastcgi_pass.empty())
 				continue;
-			colon = loc.fastcgi_pass.find(':');
-			if (colon == std::string::npos)
+			// An upstream name stands for every server in its block
+			std::vector<std::string> addresses;
+			std::map<std::string, UpstreamConfig>::const_iterator up = s.upstreams.find(loc.fastcgi_pass);
+			if (up == s.upstreams.end())
+				addresses.push_back(loc.fastcgi_pass);
+			else
 			{
-				// No port specified; assume default FastCGI port 9000 when a hostname is given
-				host = loc.fastcgi_pass;
-				port = 9000;
+				for (k = 0; k < up->second.servers.size(); ++k)
+					addresses.push_back(up->second.servers[k].address);
 			}
-			else
+			for (k = 0; k < addresses.size(); ++k)
 			{
-				host = loc.fastcgi_pass.substr(0, colon);
-				portStr = loc.fastcgi_pass.substr(colon + 1);
-				std::istringstream	iss(portStr);
-				iss >> port;
-				if (!iss || port <= 0)
+				// A bare hostname means the default FastCGI port 9000
+				if (!FastCgiEndpoint::parse(addresses[k], endpoint))
+					continue;
+				// Only attempt local hosts and unix sockets
+				if (!endpoint.isLocal())
 					continue;
+				_endpoints.insert(endpoint);
 			}
-			// Only attempt local hosts
-			if (host != "127.0.0.1" && host != "localhost" && host != "0.0.0.0")
-				continue;
-			_endpoints.insert(std::make_pair(host, port));
 		}
 	}
 }
 
-void	FastCgiBackend::startBackend(const std::string &host, int port, char **env)
+pid_t	FastCgiBackend::startBackend(const FastCgiEndpoint &endpoint, char **env)
 {
 	const char		*script = "./scripts/start_fcgi_backend.sh";
-	std::ostringstream	oss;
 	pid_t			cpid;
 	int				devnull;
-	int				status;
+	std::ostringstream	oss;
 
-	oss << port;
-	std::string	portArg = oss.str();
-	std::cout << "FastCGI backend not reachable on " << host << ":"
-		<< port << ", attempting to start..." << std::endl;
+	// The helper takes a port, or unix:/path for a socket file
+	if (endpoint.isUnix())
+		oss << endpoint.describe();
+	else
+		oss << endpoint.port;
+	std::string	bindArg = oss.str();
+	std::cout << "FastCGI backend not reachable on " << endpoint.describe()
+		<< ", attempting to start..." << std::endl;
 	cpid = fork();
 	if (cpid == 0)
 	{
@@ -100,58 +214,73 @@ void	FastCgiBackend::startBackend(const std::string &host, int port, char **env)
 			if (devnull > STDERR_FILENO)
 				close(devnull);
 		}
-		const char *argv_exec[] = {script, "start", portArg.c_str(), NULL};
+		const char *argv_exec[] = {script, "start", bindArg.c_str(), NULL};
 		execve(script, const_cast<char * const *>(argv_exec), env);
 		_exit(127);
 	}
-	else if (cpid > 0)
-	{
-		status = 0;
-		waitpid(cpid, &status, 0);
-		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
-			std::cout << "Started FastCGI helper for port " << port << std::endl;
-		else
-			std::cerr << "FastCGI helper failed for port " << port << std::endl;
-	}
-	else
+	if (cpid < 0)
 		std::cerr << "Failed to fork for FastCGI helper" << std::endl;
-}
-
-bool	FastCgiBackend::waitForBackend(const std::string &host, int port) const
-{
-	int	retries;
-
-	for (retries = 0; retries < 15; ++retries)
-	{
-		if (isPortOpen(host, port))
-			return (true);
-		usleep(200000);
-	}
-	return (false);
+	else
+		_helpers[cpid] = endpoint.describe();
+	return (cpid);
 }
 
 void	FastCgiBackend::ensureBackendsRunning(const std::vector<ServerConfig> &servers, char **env)
 {
 	EndpointSet::const_iterator	it;
+	FastCgiEndpoint				spawned;
+	Startup						startup;
+	void						*shared;
+	std::map<std::string, int>	inherited;
+	std::map<std::string, int>::iterator	fd;
 
+	inherited = inheritedSockets();
 	collectEndpoints(servers);
-	for (it = _endpoints.begin(); it != _endpoints.end(); ++it)
+	// Every server carries the same fastcgi_spawn list
+	const std::map<std::string, FastCgiSpawnConfig>	&spawns = servers.front().fastcgi_spawns;
+	for (std::map<std::string, FastCgiSpawnConfig>::const_iterator sp = spawns.begin();
+		sp != spawns.end(); ++sp)
 	{
-		const std::string	&host = it->first;
-		int					port = it->second;
+		FastCgiWorkerPool	*pool = new FastCgiWorkerPool(sp->second, env);
+		int					listenFd = -1;
 
-		if (isPortOpen(host, port))
+		fd = inherited.find(sp->first);
+		if (fd != inherited.end())
+		{
+			listenFd = fd->second;
+			inherited.erase(fd);
+		}
+		if (!pool->start(listenFd))
+		{
+			delete pool;
+			throw std::runtime_error("Cannot start FastCGI workers for " + sp->first);
+		}
+		_pools.push_back(pool);
+		if (FastCgiEndpoint::parse(sp->first, spawned))
+			_endpoints.erase(spawned);
+	}
+	// Spawns the new configuration dropped
+	for (fd = inherited.begin(); fd != inherited.end(); ++fd)
+		close(fd->second);
+	// Helpers all start at once and nobody waits for them: tick() notices
+	// each backend coming up while the servers already run
+	for (it = _endpoints.begin(); it != _endpoints.end(); ++it)
+	{
+		if (isReachable(*it, 200))
 		{
-			std::cout << "FastCGI backend ready on " << host << ":"
-				<< port << std::endl;
+			std::cout << "FastCGI backend ready on " << it->describe() << std::endl;
 			continue;
 		}
-		startBackend(host, port, env);
-		if (waitForBackend(host, port))
-			std::cout << "FastCGI backend started on " << host << ":"
-				<< port << std::endl;
-		else
-			std::cerr << "Warning: FastCGI backend not reachable on "
-				<< host << ":" << port << std::endl;
+		if (startBackend(*it, env) < 0)
+			continue;
+		shared = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+		if (shared == MAP_FAILED)
+			continue;
+		startup.endpoint = *it;
+		startup.starting = static_cast<volatile int *>(shared);
+		*startup.starting = 1;
+		startup.deadline = std::time(NULL) + kStartupWindow;
+		flags()[it->describe()] = startup.starting;
+		_startups.push_back(startup);
 	}
 }
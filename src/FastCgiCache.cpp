@@ -0,0 +1,353 @@
+#include "FastCgiCache.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <vector>
+
+// Lives at the start of the mapping; shared by every process
+struct FastCgiCache::Arena
+{
+    pthread_mutex_t mutex;
+    size_t slot_count;
+    size_t data_size;
+    // Records run oldest to newest from tail to head, jumping back to 0
+    // at wrap: evicting always starts with the oldest
+    size_t head; // next write offset
+    size_t tail; // oldest record
+    size_t used; // bytes in records, to tell a full ring from an empty one
+    size_t wrap; // end of the records before the jump, data_size when none
+};
+
+// Starts every record in the data ring, followed by the key and output
+struct FastCgiCache::Record
+{
+    size_t length; // whole record, padded
+    size_t slot;   // index entry that pointed at it when written
+};
+
+struct FastCgiCache::Slot
+{
+    unsigned long hash; // 0 = empty
+    size_t offset;      // its Record in the data ring
+    size_t key_len;
+    size_t output_len;
+    time_t fresh_until;
+    time_t revalidate_until;
+    time_t error_until;
+    time_t updating_until; // a refresh is out until then
+};
+
+namespace {
+
+// One slot per this many arena bytes
+const size_t kBytesPerSlot = 4096;
+
+std::map<std::string, FastCgiCache *> &registry()
+{
+    static std::map<std::string, FastCgiCache *> zones;
+    return zones;
+}
+
+unsigned long hashKey(const std::string &key)
+{
+    // FNV-1a
+    unsigned long h = 2166136261UL;
+    for (size_t i = 0; i < key.size(); ++i)
+    {
+        h ^= static_cast<unsigned char>(key[i]);
+        h *= 16777619UL;
+    }
+    return h ? h : 1;
+}
+
+std::string lower(std::string s)
+{
+    for (size_t i = 0; i < s.size(); ++i)
+        s[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(s[i])));
+    return s;
+}
+
+// "name=N" directive of a Cache-Control value, -1 when absent
+time_t directiveSeconds(const std::vector<std::string> &directives, const std::string &name)
+{
+    for (size_t i = 0; i < directives.size(); ++i)
+    {
+        const std::string &d = directives[i];
+        if (d.size() > name.size() && d.compare(0, name.size(), name) == 0 && d[name.size()] == '=')
+        {
+            std::string value = d.substr(name.size() + 1);
+            if (!value.empty() && value[0] == '"')
+                value = value.substr(1, value.find('"', 1) - 1);
+            return static_cast<time_t>(std::strtol(value.c_str(), NULL, 10));
+        }
+    }
+    return -1;
+}
+
+bool hasDirective(const std::vector<std::string> &directives, const std::string &name)
+{
+    for (size_t i = 0; i < directives.size(); ++i)
+    {
+        if (directives[i] == name || directives[i].compare(0, name.size() + 1, name + "=") == 0)
+            return true;
+    }
+    return false;
+}
+
+} // namespace
+
+FastCgiCache::FastCgiCache(void *base, size_t size)
+    : arena(static_cast<Arena *>(base))
+    , slots(NULL)
+    , data(NULL)
+{
+    arena->slot_count = size / kBytesPerSlot;
+    slots = reinterpret_cast<Slot *>(arena + 1);
+    data = reinterpret_cast<char *>(slots + arena->slot_count);
+    arena->data_size = size - sizeof(Arena) - arena->slot_count * sizeof(Slot);
+    reset();
+    // The mapping starts zeroed: every slot is empty
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    // A process killed while holding the lock must not wedge the others
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(&arena->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void FastCgiCache::createZones(const std::map<std::string, size_t> &zones)
+{
+    for (std::map<std::string, size_t>::const_iterator it = zones.begin(); it != zones.end(); ++it)
+    {
+        if (registry().count(it->first))
+            continue;
+        void *base = mmap(NULL, it->second, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+        if (base == MAP_FAILED)
+            throw std::runtime_error("fastcgi_cache_zone " + it->first + ": mmap failed: " + std::strerror(errno));
+        registry()[it->first] = new FastCgiCache(base, it->second);
+    }
+}
+
+FastCgiCache *FastCgiCache::zone(const std::string &name)
+{
+    std::map<std::string, FastCgiCache *>::const_iterator it = registry().find(name);
+    return it == registry().end() ? NULL : it->second;
+}
+
+void FastCgiCache::lock()
+{
+    const int rc = pthread_mutex_lock(&arena->mutex);
+#ifdef __linux__
+    if (rc == EOWNERDEAD)
+    {
+        // The owner may have died mid-write: forget everything
+        std::memset(slots, 0, arena->slot_count * sizeof(Slot));
+        reset();
+        pthread_mutex_consistent(&arena->mutex);
+    }
+#else
+    (void)rc;
+#endif
+}
+
+void FastCgiCache::unlock()
+{
+    pthread_mutex_unlock(&arena->mutex);
+}
+
+void FastCgiCache::reset()
+{
+    arena->head = 0;
+    arena->tail = 0;
+    arena->used = 0;
+    arena->wrap = arena->data_size;
+}
+
+// Drops the record at tail, and its index entry unless that was reused
+void FastCgiCache::evictOldest()
+{
+    const Record *record = reinterpret_cast<const Record *>(data + arena->tail);
+    Slot &slot = slots[record->slot];
+    if (slot.hash && slot.offset == arena->tail)
+        slot.hash = 0;
+    arena->tail += record->length;
+    arena->used -= record->length;
+    if (arena->tail >= arena->wrap)
+    {
+        arena->tail = 0;
+        arena->wrap = arena->data_size;
+    }
+    if (!arena->used)
+        arena->tail = arena->head;
+}
+
+FastCgiCache::Slot *FastCgiCache::slotFor(unsigned long hash)
+{
+    return &slots[hash % arena->slot_count];
+}
+
+size_t FastCgiCache::maxEntry() const
+{
+    return arena->data_size / 4;
+}
+
+FastCgiCache::Entry FastCgiCache::lookup(const std::string &key, time_t now, time_t refresh_for)
+{
+    Entry entry;
+    entry.state = MISS;
+    entry.refresh = false;
+
+    const unsigned long hash = hashKey(key);
+    lock();
+    Slot *slot = slotFor(hash);
+    if (slot->hash != hash || slot->key_len != key.size()
+        || std::memcmp(data + slot->offset + sizeof(Record), key.data(), key.size()) != 0)
+    {
+        unlock();
+        return entry;
+    }
+    if (now < slot->fresh_until)
+        entry.state = FRESH;
+    else if (now < slot->revalidate_until)
+    {
+        entry.state = STALE_REVALIDATE;
+        if (slot->updating_until <= now)
+        {
+            entry.refresh = true;
+            slot->updating_until = now + refresh_for;
+        }
+    }
+    else if (now < slot->error_until)
+        entry.state = STALE_IF_ERROR;
+    if (entry.state != MISS)
+        entry.output.assign(data + slot->offset + sizeof(Record) + slot->key_len, slot->output_len);
+    unlock();
+    return entry;
+}
+
+void FastCgiCache::store(const std::string &key, const std::string &output, const Policy &policy, time_t now)
+{
+    const size_t align = sizeof(size_t);
+    const size_t need = (sizeof(Record) + key.size() + output.size() + align - 1) / align * align;
+    if (need > maxEntry())
+        return;
+
+    const unsigned long hash = hashKey(key);
+    lock();
+    size_t start = arena->head;
+    if (start + need > arena->data_size)
+    {
+        // The records past head are the oldest: they go before the jump
+        while (arena->used && arena->tail >= start)
+            evictOldest();
+        arena->wrap = start;
+        start = 0;
+        if (!arena->used)
+            arena->tail = 0;
+    }
+    // Then only the oldest records the new one lands on
+    while (arena->used && arena->tail >= start && arena->tail < start + need)
+        evictOldest();
+
+    Slot *slot = slotFor(hash);
+    Record *record = reinterpret_cast<Record *>(data + start);
+    record->length = need;
+    record->slot = slot - slots;
+    std::memcpy(data + start + sizeof(Record), key.data(), key.size());
+    std::memcpy(data + start + sizeof(Record) + key.size(), output.data(), output.size());
+    if (!arena->used)
+        arena->tail = start;
+    arena->used += need;
+
+    slot->hash = hash;
+    slot->offset = start;
+    slot->key_len = key.size();
+    slot->output_len = output.size();
+    slot->fresh_until = now + policy.ttl;
+    slot->revalidate_until = slot->fresh_until + policy.stale_while_revalidate;
+    slot->error_until = slot->fresh_until + policy.stale_if_error;
+    slot->updating_until = 0;
+    arena->head = start + need;
+    unlock();
+}
+
+bool FastCgiCache::policyFor(const std::string &header_block, time_t default_ttl, time_t now, Policy &policy)
+{
+    int status = 200;
+    std::string cache_control;
+    std::string expires;
+    bool has_expires = false;
+
+    std::istringstream hss(header_block);
+    std::string line;
+    while (std::getline(hss, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        const std::string::size_type colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        const std::string name = lower(line.substr(0, colon));
+        std::string value = line.substr(colon + 1);
+        while (!value.empty() && (value[0] == ' ' || value[0] == '\t'))
+            value.erase(0, 1);
+        if (name == "status")
+            status = std::atoi(value.c_str());
+        else if (name == "cache-control")
+            cache_control += (cache_control.empty() ? "" : ",") + lower(value);
+        else if (name == "expires")
+        {
+            expires = value;
+            has_expires = true;
+        }
+        else if (name == "set-cookie")
+            return false; // a session would be handed to everyone
+    }
+    if (status != 200 && status != 301 && status != 302)
+        return false;
+
+    std::vector<std::string> directives;
+    std::istringstream css(cache_control);
+    std::string directive;
+    while (std::getline(css, directive, ','))
+    {
+        const std::string::size_type first = directive.find_first_not_of(" \t");
+        if (first == std::string::npos)
+            continue;
+        directive = directive.substr(first, directive.find_last_not_of(" \t") - first + 1);
+        directives.push_back(directive);
+    }
+    if (hasDirective(directives, "no-store") || hasDirective(directives, "no-cache")
+        || hasDirective(directives, "private"))
+        return false;
+
+    // s-maxage is meant for shared caches, which this is
+    policy.ttl = directiveSeconds(directives, "s-maxage");
+    if (policy.ttl < 0)
+        policy.ttl = directiveSeconds(directives, "max-age");
+    if (policy.ttl < 0 && has_expires)
+    {
+        struct tm tm;
+        std::memset(&tm, 0, sizeof(tm));
+        // An unparsable date means already expired
+        policy.ttl = 0;
+        if (strptime(expires.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm))
+            policy.ttl = std::max(static_cast<time_t>(0), timegm(&tm) - now);
+    }
+    if (policy.ttl < 0)
+        policy.ttl = default_ttl;
+    policy.stale_while_revalidate = std::max(static_cast<time_t>(0), directiveSeconds(directives, "stale-while-revalidate"));
+    policy.stale_if_error = std::max(static_cast<time_t>(0), directiveSeconds(directives, "stale-if-error"));
+    return policy.ttl > 0 || policy.stale_while_revalidate > 0 || policy.stale_if_error > 0;
+}
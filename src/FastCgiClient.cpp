@@ -1,48 +1,23 @@
 #include "FastCgiClient.hpp"
+#include "CgiOutput.hpp"
+#include "FastCgiOffload.hpp"
+#include "FastCgiPool.hpp"
+#include "FastCgiProtocol.hpp"
 #include "macros.hpp"
 
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-#include <cerrno>
-#include <cstring>
+#include <cctype>
+#include <cstdlib>
 #include <sstream>
-#include <vector>
 
 namespace {
 
-const unsigned char FCGI_VERSION_1 = 1;
-const unsigned char FCGI_BEGIN_REQUEST = 1;
-const unsigned char FCGI_END_REQUEST = 3;
-const unsigned char FCGI_PARAMS = 4;
-const unsigned char FCGI_STDIN = 5;
-const unsigned char FCGI_STDOUT = 6;
-// const unsigned char FCGI_STDERR = 7;
-
-const unsigned short FCGI_RESPONDER = 1;
-
-struct FcgiHeader
-{
-    unsigned char version;
-    unsigned char type;
-    unsigned char requestIdB1;
-    unsigned char requestIdB0;
-    unsigned char contentLengthB1;
-    unsigned char contentLengthB0;
-    unsigned char paddingLength;
-    unsigned char reserved;
-};
-
-struct FcgiBeginRequestBody
-{
-    unsigned char roleB1;
-    unsigned char roleB0;
-    unsigned char flags;
-    unsigned char reserved[5];
-};
+// Body bytes buffered for a slow client before the upstream stops being read
+const size_t kHighWater = 256u * 1024u;
+// A script must finish its CGI header block within this many bytes
+const size_t kMaxHeaderBlock = 64u * 1024u;
+// Request body queued on the upstream socket before the client is paused
+// (spooling off) or handed over per drain from the spool file
+const size_t kStdinWindow = 256u * 1024u;
 
 std::string toString(size_t value)
 {
@@ -51,36 +26,36 @@ std::string toString(size_t value)
     return oss.str();
 }
 
-bool encodeNameValue(const std::string &name,
-                     const std::string &value,
-                     std::vector<unsigned char> &out)
+std::string lower(std::string s)
 {
-    size_t nlen = name.size();
-    size_t vlen = value.size();
+    for (size_t i = 0; i < s.size(); ++i)
+        s[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(s[i])));
+    return s;
+}
 
-    if (nlen < 128)
-        out.push_back(static_cast<unsigned char>(nlen));
-    else
+// Request header names keep the client's spelling
+std::string headerValue(const std::map<std::string, std::string> &headers, const std::string &name)
+{
+    const std::string wanted = lower(name);
+    for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it)
     {
-        out.push_back(static_cast<unsigned char>((nlen >> 24) | 0x80));
-        out.push_back(static_cast<unsigned char>((nlen >> 16) & 0xFF));
-        out.push_back(static_cast<unsigned char>((nlen >> 8) & 0xFF));
-        out.push_back(static_cast<unsigned char>(nlen & 0xFF));
+        if (lower(it->first) == wanted)
+            return it->second;
     }
+    return "";
+}
 
-    if (vlen < 128)
-        out.push_back(static_cast<unsigned char>(vlen));
-    else
+// Status: header of a CGI header block, 200 when absent
+int scriptStatus(const std::string &header_block)
+{
+    std::istringstream hss(header_block);
+    std::string line;
+    while (std::getline(hss, line))
     {
-        out.push_back(static_cast<unsigned char>((vlen >> 24) | 0x80));
-        out.push_back(static_cast<unsigned char>((vlen >> 16) & 0xFF));
-        out.push_back(static_cast<unsigned char>((vlen >> 8) & 0xFF));
-        out.push_back(static_cast<unsigned char>(vlen & 0xFF));
+        if (lower(line.substr(0, 7)) == "status:")
+            return std::atoi(line.c_str() + 7);
     }
-
-    out.insert(out.end(), name.begin(), name.end());
-    out.insert(out.end(), value.begin(), value.end());
-    return true;
+    return 200;
 }
 
 } // namespace
@@ -89,165 +64,143 @@ FastCgiClient::FastCgiClient(const HttpRequest &request,
                              const ServerConfig &server_config,
                              const LocationConfig &location_config,
                              const std::string &script_path)
-    : req(request)
-    , server(server_config)
+    : server(server_config)
     , location(location_config)
+    , pass(location_config.fastcgi_pass)
     , script(script_path)
-    , host()
-    , port(0)
+    , version(request.getHttpVersion())
+    , group(NULL)
+    , peer(NULL)
+    , sent_at()
+    , tried()
+    , last_failure(UPSTREAM_CONNECT)
+    , idempotent(false)
+    , params()
+    , body(request.getBody())
+    , body_streamed(request.isBodyStreamed())
+    , stdin_sent(0)
+    , spool_fd(-1)
+    , spool_read(0)
+    , spool_write(0)
+    , spool_last(false)
+    , draining(false)
+    , client_paused(false)
+    , cache(NULL)
+    , cache_key()
+    , cache_policy()
+    , cached()
+    , capturing(false)
+    , stale()
+    , detached(false)
+    , leading(false)
+    , leader(NULL)
+    , waiters()
+    , wait_until(0)
+    , context()
+    , client_fd(-1)
+    , conn(NULL)
+    , reused(false)
+    , retried(false)
+    , got_output(false)
+    , header_buf()
+    , head()
+    , pending()
+    , head_ready(false)
+    , head_sent(false)
+    , want_chunked(false)
+    , paused(false)
+    , done(false)
+    , failed(false)
+    , file(NULL)
+    , discard(false)
+    , mirror(NULL)
 {
-}
+    const std::string &method = request.getMethod();
+    idempotent = method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS";
 
-bool FastCgiClient::parseEndpoint()
-{
-    if (location.fastcgi_pass.empty())
-        return false;
+    params = buildParams(request);
 
-    std::string::size_type colon = location.fastcgi_pass.find(':');
-    if (colon == std::string::npos)
-        return false;
-
-    host = location.fastcgi_pass.substr(0, colon);
-    std::string port_str = location.fastcgi_pass.substr(colon + 1);
-    std::istringstream iss(port_str);
-    iss >> port;
-    if (!iss || port <= 0 || port > 65535)
-        return false;
-    return true;
+    if (!location.fastcgi_cache.empty() && (method == "GET" || method == "HEAD"))
+        cache_key = buildCacheKey(request);
 }
 
-bool FastCgiClient::writeAll(int fd, const void *buf, size_t len) const
+FastCgiClient::FastCgiClient(const FastCgiClient *origin, Detached kind)
+    : server(origin->server)
+    , location(origin->location)
+    , pass(kind == DETACHED_MIRROR ? origin->location.fastcgi_mirror : origin->pass)
+    , script(origin->script)
+    , version(origin->version)
+    , group(NULL)
+    , peer(NULL)
+    , sent_at()
+    , tried()
+    , last_failure(UPSTREAM_CONNECT)
+    , idempotent(origin->idempotent)
+    , params(origin->params)
+    , body(origin->body)
+    , body_streamed(kind == DETACHED_MIRROR && origin->body_streamed)
+    , stdin_sent(0)
+    , spool_fd(-1)
+    , spool_read(0)
+    , spool_write(0)
+    , spool_last(false)
+    , draining(false)
+    , client_paused(false)
+    , cache(kind == DETACHED_REFRESH ? origin->cache : NULL)
+    , cache_key(kind == DETACHED_REFRESH ? origin->cache_key : "")
+    , cache_policy()
+    , cached()
+    , capturing(false)
+    , stale()
+    , detached(true)
+    , leading(false)
+    , leader(NULL)
+    , waiters()
+    , wait_until(0)
+    , context()
+    , client_fd(-1)
+    , conn(NULL)
+    , reused(false)
+    , retried(false)
+    , got_output(false)
+    , header_buf()
+    , head()
+    , pending()
+    , head_ready(false)
+    , head_sent(false)
+    , want_chunked(false)
+    , paused(false)
+    , done(false)
+    , failed(false)
+    , file(NULL)
+    , discard(false)
+    , mirror(NULL)
 {
-    const char *p = static_cast<const char *>(buf);
-    size_t left = len;
-    while (left > 0)
-    {
-        ssize_t n = send(fd, p, left, 0);
-        if (n < 0)
-        {
-            if (errno == EINTR)
-                continue;
-            return false;
-        }
-        p += n;
-        left -= static_cast<size_t>(n);
-    }
-    return true;
 }
 
-bool FastCgiClient::sendBeginRequest(int fd) const
+FastCgiClient::~FastCgiClient()
 {
-    FcgiHeader header;
-    std::memset(&header, 0, sizeof(header));
-    header.version = FCGI_VERSION_1;
-    header.type = FCGI_BEGIN_REQUEST;
-    header.requestIdB1 = 0;
-    header.requestIdB0 = 1;
-    header.contentLengthB1 = 0;
-    header.contentLengthB0 = sizeof(FcgiBeginRequestBody);
-
-    FcgiBeginRequestBody body;
-    std::memset(&body, 0, sizeof(body));
-    body.roleB1 = 0;
-    body.roleB0 = static_cast<unsigned char>(FCGI_RESPONDER);
-    body.flags = 0;
-
-    return writeAll(fd, &header, sizeof(header))
-        && writeAll(fd, &body, sizeof(body));
+    if (leader)
+        leader->waiters.erase(std::find(leader->waiters.begin(), leader->waiters.end(), this));
+    releaseWaiters(NULL);
+    if (conn)
+        conn->abandon(this);
+    releasePeer(FastCgiUpstream::OUTCOME_NEUTRAL);
+    if (spool_fd >= 0)
+        close(spool_fd);
+    delete file;
+    if (mirror)
+        mirror->detach(this);
 }
 
-bool FastCgiClient::sendParams(int fd, const std::map<std::string, std::string> &params) const
+// Encoded FCGI_PARAMS: the location's precomputed pairs, then those that
+// depend on the request
+std::string FastCgiClient::buildParams(const HttpRequest &req) const
 {
-    std::vector<unsigned char> buffer;
-    buffer.reserve(1024);
+    std::string env = location.fastcgi_static_params;
 
-    std::map<std::string, std::string>::const_iterator it = params.begin();
-    while (it != params.end())
-    {
-        encodeNameValue(it->first, it->second, buffer);
-        ++it;
-        if (buffer.size() > 60000 || it == params.end())
-        {
-            FcgiHeader header;
-            std::memset(&header, 0, sizeof(header));
-            header.version = FCGI_VERSION_1;
-            header.type = FCGI_PARAMS;
-            header.requestIdB1 = 0;
-            header.requestIdB0 = 1;
-            header.contentLengthB1 = static_cast<unsigned char>((buffer.size() >> 8) & 0xFF);
-            header.contentLengthB0 = static_cast<unsigned char>(buffer.size() & 0xFF);
-            header.paddingLength = 0;
-
-            if (!writeAll(fd, &header, sizeof(header)))
-                return false;
-            if (!buffer.empty() && !writeAll(fd, &buffer[0], buffer.size()))
-                return false;
-            buffer.clear();
-        }
-    }
-
-    // Terminator params record
-    FcgiHeader header;
-    std::memset(&header, 0, sizeof(header));
-    header.version = FCGI_VERSION_1;
-    header.type = FCGI_PARAMS;
-    header.requestIdB1 = 0;
-    header.requestIdB0 = 1;
-    header.contentLengthB1 = 0;
-    header.contentLengthB0 = 0;
-    header.paddingLength = 0;
-    return writeAll(fd, &header, sizeof(header));
-}
-
-bool FastCgiClient::sendStdin(int fd, const std::string &body) const
-{
-    size_t offset = 0;
-    const size_t total = body.size();
-    while (offset < total)
-    {
-        size_t chunk = total - offset;
-        if (chunk > 65535)
-            chunk = 65535;
-
-        FcgiHeader header;
-        std::memset(&header, 0, sizeof(header));
-        header.version = FCGI_VERSION_1;
-        header.type = FCGI_STDIN;
-        header.requestIdB1 = 0;
-        header.requestIdB0 = 1;
-        header.contentLengthB1 = static_cast<unsigned char>((chunk >> 8) & 0xFF);
-        header.contentLengthB0 = static_cast<unsigned char>(chunk & 0xFF);
-        header.paddingLength = 0;
-
-        if (!writeAll(fd, &header, sizeof(header)))
-            return false;
-        if (!writeAll(fd, body.data() + offset, chunk))
-            return false;
-        offset += chunk;
-    }
-
-    // Terminator STDIN record
-    FcgiHeader header;
-    std::memset(&header, 0, sizeof(header));
-    header.version = FCGI_VERSION_1;
-    header.type = FCGI_STDIN;
-    header.requestIdB1 = 0;
-    header.requestIdB0 = 1;
-    header.contentLengthB1 = 0;
-    header.contentLengthB0 = 0;
-    header.paddingLength = 0;
-    return writeAll(fd, &header, sizeof(header));
-}
-
-std::map<std::string, std::string> FastCgiClient::buildParams() const
-{
-    std::map<std::string, std::string> env;
-
-    env["GATEWAY_INTERFACE"] = "CGI/1.1";
-    env["REQUEST_METHOD"] = req.getMethod();
-    env["SERVER_PROTOCOL"] = req.getHttpVersion();
-    env["SERVER_NAME"] = server.server_name;
-    env["SERVER_PORT"] = toString(server.port);
+    fcgi::encodeNameValue("REQUEST_METHOD", req.getMethod(), env);
+    fcgi::encodeNameValue("SERVER_PROTOCOL", req.getHttpVersion(), env);
 
     const std::string uri = req.getUri();
     std::string query;
@@ -258,213 +211,602 @@ std::map<std::string, std::string> FastCgiClient::buildParams() const
         query = uri.substr(qpos + 1);
         path_info = uri.substr(0, qpos);
     }
-    env["QUERY_STRING"] = query;
-    env["SCRIPT_NAME"] = path_info;
-    env["PATH_INFO"] = path_info;
-    env["SCRIPT_FILENAME"] = script;
-    env["DOCUMENT_ROOT"] = server.root;
+    fcgi::encodeNameValue("QUERY_STRING", query, env);
+    fcgi::encodeNameValue("SCRIPT_NAME", path_info, env);
+    fcgi::encodeNameValue("PATH_INFO", path_info, env);
+    fcgi::encodeNameValue("SCRIPT_FILENAME", script, env);
 
     const std::map<std::string, std::string> &hdrs = req.getHeaders();
     std::map<std::string, std::string>::const_iterator it = hdrs.find("Content-Type");
     if (it == hdrs.end())
         it = hdrs.find("content-type");
     if (it != hdrs.end())
-        env["CONTENT_TYPE"] = it->second;
+        fcgi::encodeNameValue("CONTENT_TYPE", it->second, env);
 
     it = hdrs.find("Content-Length");
     if (it == hdrs.end())
         it = hdrs.find("content-length");
     if (it != hdrs.end())
-        env["CONTENT_LENGTH"] = it->second;
+        fcgi::encodeNameValue("CONTENT_LENGTH", it->second, env);
     else
-        env["CONTENT_LENGTH"] = toString(req.getBody().size());
-
-    env["REDIRECT_STATUS"] = "200";
-
+        fcgi::encodeNameValue("CONTENT_LENGTH", toString(req.getBody().size()), env);
     return env;
 }
 
-std::string FastCgiClient::readResponse(int fd) const
+// Method, host and URI, then the location's fastcgi_cache_key_headers
+std::string FastCgiClient::buildCacheKey(const HttpRequest &req) const
 {
-    std::string stdout_data;
+    const std::map<std::string, std::string> &hdrs = req.getHeaders();
+    std::string host = lower(headerValue(hdrs, "Host"));
+    if (host.empty())
+        host = server.server_name + ":" + toString(server.port);
 
-    while (true)
+    std::string key = req.getMethod() + " " + host + req.getUri();
+    for (size_t i = 0; i < location.fastcgi_cache_key_headers.size(); ++i)
     {
-        FcgiHeader header;
-        ssize_t n = recv(fd, &header, sizeof(header), MSG_WAITALL);
-        if (n == 0)
-            break;
-        if (n < 0)
-        {
-            if (errno == EINTR)
-                continue;
-            return "";
-        }
-        if (n != static_cast<ssize_t>(sizeof(header)))
-            return "";
+        const std::string &name = location.fastcgi_cache_key_headers[i];
+        key += "\n" + lower(name) + ": " + headerValue(hdrs, name);
+    }
+    return key;
+}
 
-        unsigned short contentLength = static_cast<unsigned short>((header.contentLengthB1 << 8) | header.contentLengthB0);
-        unsigned char paddingLength = header.paddingLength;
+std::string FastCgiClient::cachedResponse(const std::string &output, const char *status) const
+{
+    std::string response = buildResponse(output);
+    const std::string::size_type eol = response.find("\r\n");
+    if (eol != std::string::npos)
+        response.insert(eol + 2, std::string("X-Cache: ") + status + "\r\n");
+    return response;
+}
 
-        if (contentLength > 0)
-        {
-            std::string payload;
-            payload.resize(contentLength);
-            ssize_t r = recv(fd, &payload[0], contentLength, MSG_WAITALL);
-            if (r != static_cast<ssize_t>(contentLength))
-                return "";
-
-            if (header.type == FCGI_STDOUT)
-                stdout_data.append(payload);
-            // STDERR is ignored for now
-        }
+std::string FastCgiClient::buildError(int code, const std::string &reason, const std::string &body) const
+{
+    return cgi_output::buildError(version, code, reason, body);
+}
 
-        if (paddingLength > 0)
+void FastCgiClient::attach(const StreamContext &ctx, int client)
+{
+    context = ctx;
+    client_fd = client;
+    if (!detached)
+        mirror = FastCgiMirror::start(this, *context.fastcgi);
+    if (!cache_key.empty())
+        cache = FastCgiCache::zone(location.fastcgi_cache);
+    if (cache && !detached && serveCached())
+        return;
+    group = context.fastcgi->upstream(server, pass);
+    if (!group)
+        return finish(buildError(502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>Invalid fastcgi_pass</p></body></html>"));
+    if (cache && !detached && location.fastcgi_cache_lock)
+    {
+        leader = context.fastcgi->lead(cache_key, this);
+        if (leader)
         {
-            char pad[256];
-            ssize_t r = recv(fd, pad, paddingLength, MSG_WAITALL);
-            if (r != static_cast<ssize_t>(paddingLength))
-                return "";
+            leader->waiters.push_back(this);
+            wait_until = std::time(NULL) + location.fastcgi_cache_lock_timeout;
+            return;
         }
-
-        if (header.type == FCGI_END_REQUEST)
-            break;
+        leading = true;
     }
+    startUpstream(false);
+}
 
-    return stdout_data;
+// Hands the leader's reply to everyone waiting for it. Without one (not
+// cacheable, failed, too large) each falls back to its stale copy or its
+// own upstream request.
+void FastCgiClient::releaseWaiters(const std::string *output)
+{
+    if (!leading)
+        return;
+    leading = false;
+    context.fastcgi->unlead(cache_key, this);
+
+    std::vector<FastCgiClient *> list;
+    list.swap(waiters);
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        FastCgiClient *waiter = list[i];
+        waiter->leader = NULL;
+        if (output)
+            waiter->finish(waiter->cachedResponse(*output, "HIT"));
+        else if (!waiter->serveStale())
+            waiter->startUpstream(false);
+    }
 }
 
-std::string FastCgiClient::buildError(int code, const std::string &reason, const std::string &body) const
+void FastCgiClient::expireWaiters(time_t now)
 {
-    std::ostringstream resp;
-    resp << req.getHttpVersion() << " " << code << " " << reason << "\r\n";
-    resp << "Content-Type: text/html; charset=UTF-8\r\n";
-    resp << "Content-Length: " << body.size() << "\r\n";
-    resp << "Connection: close\r\n\r\n";
-    resp << body;
-    return resp.str();
+    for (size_t i = waiters.size(); i > 0; --i)
+    {
+        FastCgiClient *waiter = waiters[i - 1];
+        if (now < waiter->wait_until)
+            continue;
+        waiters.erase(waiters.begin() + (i - 1));
+        waiter->leader = NULL;
+        waiter->startUpstream(false);
+    }
 }
 
-std::string FastCgiClient::execute()
+bool FastCgiClient::serveCached()
 {
-    if (!parseEndpoint())
-        return buildError(502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>Invalid fastcgi_pass</p></body></html>");
+    // A refresh may take as long as the backend is allowed to
+    const time_t refresh_for = location.fastcgi_connect_timeout + location.fastcgi_read_timeout;
+    const FastCgiCache::Entry entry = cache->lookup(cache_key, std::time(NULL), refresh_for);
 
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
-        return buildError(502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>socket failed</p></body></html>");
+    switch (entry.state)
+    {
+        case FastCgiCache::FRESH:
+            finish(cachedResponse(entry.output, "HIT"));
+            return true;
+        case FastCgiCache::STALE_REVALIDATE:
+            if (entry.refresh)
+                context.fastcgi->runDetached(new FastCgiClient(this, DETACHED_REFRESH));
+            finish(cachedResponse(entry.output, "UPDATING"));
+            return true;
+        case FastCgiCache::STALE_IF_ERROR:
+            stale = entry.output;
+            return false;
+        case FastCgiCache::MISS:
+            break;
+    }
+    return false;
+}
 
-    struct sockaddr_in addr;
-    std::memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(static_cast<unsigned short>(port));
-    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+// Answers with the stale-if-error entry instead of an upstream error
+bool FastCgiClient::serveStale()
+{
+    if (stale.empty())
+        return false;
+    finish(cachedResponse(stale, "STALE"));
+    std::string().swap(stale);
+    return true;
+}
+
+void FastCgiClient::capture(const char *data, size_t len)
+{
+    cached.append(data, len);
+    if (cached.size() > cache->maxEntry())
     {
-        close(fd);
-        return buildError(502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>Invalid FastCGI host</p></body></html>");
+        capturing = false;
+        std::string().swap(cached);
     }
+}
 
-    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+void FastCgiClient::startUpstream(bool fresh_only)
+{
+    FastCgiPool::Lease lease;
+
+    while (true)
     {
-        close(fd);
-        return buildError(504, "Gateway Timeout", "<html><body><h1>504 Gateway Timeout</h1><p>FastCGI connect failed</p></body></html>");
+        peer = group->select(std::time(NULL), tried);
+        if (!peer && !tried.empty())
+            return failUpstream(last_failure);
+        if (!peer && serveStale())
+            return;
+        if (!peer)
+            return finish(buildError(503, "Service Unavailable", "<html><body><h1>503 Service Unavailable</h1><p>No live FastCGI upstream</p></body></html>"));
+
+        lease = context.fastcgi->acquire(location, peer->endpoint, fresh_only);
+        if (lease.busy)
+        {
+            releasePeer(FastCgiUpstream::OUTCOME_NEUTRAL);
+            if (serveStale())
+                return;
+            return finish(buildError(503, "Service Unavailable", "<html><body><h1>503 Service Unavailable</h1><p>FastCGI backend at capacity</p></body></html>"));
+        }
+        if (lease.conn)
+            break;
+        // Refused on the spot
+        last_failure = UPSTREAM_CONNECT;
+        tried.push_back(peer);
+        releasePeer(FastCgiUpstream::OUTCOME_FAILURE);
+        if (!mayRetry())
+            return failUpstream(UPSTREAM_CONNECT);
+        fresh_only = false;
     }
+    gettimeofday(&sent_at, NULL);
+    conn = lease.conn;
+    reused = lease.reused;
+    conn->begin(this, params, body, !body_streamed, location.fastcgi_keepalive > 0);
+}
 
-    std::map<std::string, std::string> params = buildParams();
-    const std::string body = req.getBody();
+bool FastCgiClient::feedBody(const char *data, size_t len, bool last)
+{
+    if (mirror)
+        mirror->feedBody(data, len, last);
+    if (!conn)
+        return true; // the reply is already decided: drop the rest
 
-    bool ok = sendBeginRequest(fd)
-        && sendParams(fd, params)
-        && sendStdin(fd, body);
+    const size_t threshold = location.fastcgi_spool_threshold;
+    if (threshold == 0)
+    {
+        sendStdin(data, len, last);
+        if (last || !conn || conn->pendingOutput() < kStdinWindow)
+            return true;
+        // No spooling: hold the client until the backend catches up
+        client_paused = true;
+        conn->notifyWhenDrained(this);
+        return false;
+    }
 
-    if (!ok)
+    if (spool_read == spool_write && conn->pendingOutput() < threshold)
+    {
+        sendStdin(data, len, last);
+        return true;
+    }
+    if (!spool(data, len))
+    {
+        failSpool();
+        return true;
+    }
+    spool_last = last;
+    if (!draining)
     {
-        close(fd);
-        return buildError(502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>FastCGI send failed</p></body></html>");
+        draining = true;
+        conn->notifyWhenDrained(this);
     }
+    return true;
+}
 
-    std::string responseData = readResponse(fd);
-    close(fd);
-    if (responseData.empty())
-        return buildError(502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>Empty FastCGI response</p></body></html>");
+void FastCgiClient::sendStdin(const char *data, size_t len, bool last)
+{
+    // Counted first: a failure inside sendStdin must not trigger a retry
+    stdin_sent += len;
+    conn->sendStdin(this, data, len, last);
+}
 
-    // Split headers/body at first blank line
-    std::string::size_type pos = responseData.find("\r\n\r\n");
-    std::string::size_type alt = responseData.find("\n\n");
-    size_t delimLen = 4;
-    if (pos == std::string::npos || (alt != std::string::npos && alt < pos))
+bool FastCgiClient::spool(const char *data, size_t len)
+{
+    if (spool_fd < 0)
+    {
+        char path[] = "/tmp/webserv-spool-XXXXXX";
+        spool_fd = mkstemp(path);
+        if (spool_fd < 0)
+            return false;
+        unlink(path);
+        fcntl(spool_fd, F_SETFD, FD_CLOEXEC);
+    }
+    while (len > 0)
     {
-        pos = alt;
-        delimLen = 2;
+        const ssize_t n = pwrite(spool_fd, data, len, spool_write);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        spool_write += n;
+        data += n;
+        len -= static_cast<size_t>(n);
     }
+    return true;
+}
 
-    std::string headerBlock;
-    std::string bodyBlock;
-    if (pos != std::string::npos)
+void FastCgiClient::onStdinDrained()
+{
+    draining = false;
+    client_paused = false;
+    // Also counts as client activity: the upload is still moving
+    wake();
+    unspool();
+}
+
+// Moves the next window of spooled body onto the upstream socket
+void FastCgiClient::unspool()
+{
+    if (!conn || spool_read == spool_write)
+        return;
+
+    const off_t left = spool_write - spool_read;
+    std::string chunk(static_cast<size_t>(left) < kStdinWindow ? static_cast<size_t>(left) : kStdinWindow, '\0');
+    const ssize_t n = pread(spool_fd, &chunk[0], chunk.size(), spool_read);
+    if (n <= 0)
+        return failSpool();
+    spool_read += n;
+
+    const bool empty = (spool_read == spool_write);
+    if (empty)
     {
-        headerBlock = responseData.substr(0, pos);
-        bodyBlock = responseData.substr(pos + delimLen);
+        // Reuse the file from the start if the backend falls behind again
+        spool_read = 0;
+        spool_write = 0;
+        if (ftruncate(spool_fd, 0) < 0)
+            std::cerr << "FastCGI spool truncate failed" << std::endl;
     }
-    else
+    sendStdin(chunk.data(), static_cast<size_t>(n), empty && spool_last);
+    if (!empty && conn)
     {
-        bodyBlock = responseData;
+        draining = true;
+        conn->notifyWhenDrained(this);
     }
+}
 
-    int statusCode = 200;
-    std::string reason = "OK";
-    std::map<std::string, std::string> outHeaders;
+void FastCgiClient::failSpool()
+{
+    if (conn)
+        conn->abandon(this);
+    conn = NULL;
+    releasePeer(FastCgiUpstream::OUTCOME_NEUTRAL);
+    if (head_ready)
+    {
+        done = true;
+        failed = true;
+        wake();
+        return;
+    }
+    finish(buildError(500, "Internal Server Error", "<html><body><h1>500 Internal Server Error</h1><p>Cannot spool request body</p></body></html>"));
+}
 
-    std::istringstream hss(headerBlock);
-    std::string line;
-    while (std::getline(hss, line))
+void FastCgiClient::onStdout(const char *data, size_t len)
+{
+    if (!got_output)
     {
-        if (!line.empty() && line[line.size() - 1] == '\r')
-            line.erase(line.size() - 1);
-        std::string::size_type colon = line.find(':');
-        if (colon == std::string::npos)
-            continue;
-        std::string key = line.substr(0, colon);
-        std::string value = line.substr(colon + 1);
-        while (!value.empty() && (value[0] == ' ' || value[0] == '\t'))
-            value.erase(0, 1);
-        if (key == "Status")
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        group->observe(peer, (now.tv_sec - sent_at.tv_sec) * 1000.0 + (now.tv_usec - sent_at.tv_usec) / 1000.0);
+    }
+    got_output = true;
+    if (discard)
+        return;
+    if (head_ready)
+    {
+        if (capturing)
+            capture(data, len);
+        if (detached)
+            return; // only the cache wants it
+        pending.append(data, len);
+        // Only a socket carrying just this request may stop reading for it
+        if (!paused && pending.size() >= kHighWater && conn && conn->inFlight() == 1)
         {
-            std::istringstream iss(value);
-            iss >> statusCode;
-            if (iss)
-            {
-                std::string rest;
-                std::getline(iss, rest);
-                if (!rest.empty() && rest[0] == ' ')
-                    rest.erase(0, 1);
-                if (!rest.empty())
-                    reason = rest;
-            }
+            paused = true;
+            conn->pauseReading(true);
         }
-        else
+        wake();
+        return;
+    }
+
+    header_buf.append(data, len);
+    size_t body_start;
+    const std::string::size_type end = cgi_output::findHeaderEnd(header_buf, body_start);
+    if (end == std::string::npos)
+    {
+        if (header_buf.size() > kMaxHeaderBlock)
         {
-            outHeaders[key] = value;
+            if (conn)
+                conn->abandon(this);
+            conn = NULL;
+            releasePeer(FastCgiUpstream::OUTCOME_FAILURE);
+            finish(buildError(502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>FastCGI header block too large</p></body></html>"));
         }
+        return;
+    }
+
+    const std::string block = header_buf.substr(0, end);
+    if (!stale.empty() && scriptStatus(block) >= 500)
+    {
+        // stale-if-error covers a script that fails as well as a dead backend
+        if (conn)
+            conn->abandon(this);
+        conn = NULL;
+        releasePeer(FastCgiUpstream::OUTCOME_NEUTRAL);
+        serveStale();
+        return;
+    }
+    if (FastCgiOffload::requested(block))
+        return offload(block);
+    if (cache && FastCgiCache::policyFor(block, location.fastcgi_cache_valid, std::time(NULL), cache_policy))
+    {
+        capturing = true;
+        capture(header_buf.data(), header_buf.size());
+    }
+    head = buildHead(block, std::string::npos, want_chunked);
+    pending = header_buf.substr(body_start);
+    std::string().swap(header_buf);
+    head_ready = true;
+    wake();
+}
+
+size_t FastCgiClient::stdinBacklog() const
+{
+    return conn ? conn->pendingOutput() : 0;
+}
+
+void FastCgiClient::forwardBody(const char *data, size_t len, bool last)
+{
+    if (conn)
+        sendStdin(data, len, last);
+}
+
+void FastCgiClient::cancel()
+{
+    if (conn)
+        conn->abandon(this);
+    conn = NULL;
+    releasePeer(FastCgiUpstream::OUTCOME_NEUTRAL);
+    done = true;
+}
+
+// The script named a file to answer with: whatever else it writes is
+// dropped as it arrives
+void FastCgiClient::offload(const std::string &header_block)
+{
+    discard = true;
+    std::string().swap(header_buf);
+    if (detached)
+        return; // nobody to send the file to, and nothing to cache
+    std::string response;
+    file = FastCgiOffload(server, version).open(header_block, response);
+    if (!file)
+        return finish(response);
+    head = response;
+    want_chunked = false;
+    head_ready = true;
+    wake();
+}
+
+void FastCgiClient::onEnd()
+{
+    conn = NULL;
+    releasePeer(FastCgiUpstream::OUTCOME_SUCCESS);
+    if (capturing)
+    {
+        cache->store(cache_key, cached, cache_policy, std::time(NULL));
+        releaseWaiters(&cached);
+        capturing = false;
+        std::string().swap(cached);
+    }
+    releaseWaiters(NULL);
+    if (head_ready)
+    {
+        done = true;
+        wake();
+        return;
+    }
+    finish(buildResponse(header_buf));
+}
+
+void FastCgiClient::onFailure(UpstreamFailure reason)
+{
+    conn = NULL;
+
+    // A pooled socket may have been closed by the backend while idle. Nothing
+    // reached the script yet, so one retry on a new connection is safe as long
+    // as no streamed body went out with it. That is no fault of the server.
+    if (reused && !retried && !got_output && stdin_sent == 0 && reason != UPSTREAM_TIMEOUT)
+    {
+        retried = true;
+        releasePeer(FastCgiUpstream::OUTCOME_NEUTRAL);
+        return startUpstream(true);
     }
 
-    if (outHeaders.find("Content-Length") == outHeaders.end()
-        && outHeaders.find("content-length") == outHeaders.end())
+    // A close after output is how some backends end a reply
+    if (reason == UPSTREAM_CLOSED && got_output)
+        releasePeer(FastCgiUpstream::OUTCOME_SUCCESS);
+    else
     {
-        outHeaders["Content-Length"] = toString(bodyBlock.size());
+        last_failure = reason;
+        if (peer)
+            tried.push_back(peer);
+        releasePeer(FastCgiUpstream::OUTCOME_FAILURE);
+        if (mayRetry())
+            return startUpstream(false);
     }
-    if (outHeaders.find("Content-Type") == outHeaders.end()
-        && outHeaders.find("content-type") == outHeaders.end())
+
+    releaseWaiters(NULL);
+    if (head_ready)
     {
-        outHeaders["Content-Type"] = "text/html; charset=UTF-8";
+        // The head may already be on the wire: an EOF ends the body as sent,
+        // anything else truncates the response
+        done = true;
+        failed = (reason != UPSTREAM_CLOSED);
+        wake();
+        return;
     }
+    failUpstream(reason);
+}
 
-    std::ostringstream resp;
-    resp << req.getHttpVersion() << " " << statusCode << " " << reason << "\r\n";
-    for (std::map<std::string, std::string>::const_iterator it = outHeaders.begin(); it != outHeaders.end(); ++it)
+// Nothing of the reply was sent yet, so it can be replayed on another
+// server: idempotent methods only, and only within fastcgi_next_upstream_tries
+bool FastCgiClient::mayRetry() const
+{
+    return idempotent && !got_output && !head_ready && stdin_sent == 0
+        && tried.size() < location.fastcgi_next_upstream_tries;
+}
+
+void FastCgiClient::failUpstream(UpstreamFailure reason)
+{
+    if (serveStale())
+        return;
+    switch (reason)
     {
-        resp << it->first << ": " << it->second << "\r\n";
+        case UPSTREAM_CONNECT:
+            return finish(buildError(504, "Gateway Timeout", "<html><body><h1>504 Gateway Timeout</h1><p>FastCGI connect failed</p></body></html>"));
+        case UPSTREAM_SEND:
+            return finish(buildError(502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>FastCGI send failed</p></body></html>"));
+        case UPSTREAM_RECV:
+            return finish(buildError(502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>FastCGI read failed</p></body></html>"));
+        case UPSTREAM_CLOSED:
+            // Backend closed without END_REQUEST: serve what it produced, if anything
+            return finish(buildResponse(header_buf));
+        case UPSTREAM_TIMEOUT:
+            return finish(buildError(504, "Gateway Timeout", "<html><body><h1>504 Gateway Timeout</h1><p>FastCGI backend timed out</p></body></html>"));
     }
-    resp << "Connection: close\r\n\r\n";
-    resp << bodyBlock;
-    return resp.str();
+}
+
+// Whole response known up front (errors, or a reply that ended before its
+// header block did)
+void FastCgiClient::finish(const std::string &response)
+{
+    releaseWaiters(NULL);
+    head = response;
+    pending.clear();
+    want_chunked = false;
+    head_ready = true;
+    done = true;
+    wake();
+}
+
+void FastCgiClient::releasePeer(FastCgiUpstream::Outcome outcome)
+{
+    if (!peer)
+        return;
+    group->release(peer, outcome, std::time(NULL));
+    peer = NULL;
+}
+
+void FastCgiClient::wake()
+{
+    if (context.waker)
+        context.waker->wake(client_fd);
+}
+
+bool FastCgiClient::awaitingUpstream() const
+{
+    return (conn && !paused) || leader;
+}
+
+ResponseStream::Status FastCgiClient::pull(std::string &out)
+{
+    if (!head_ready)
+        return STREAM_AGAIN;
+
+    if (!head_sent)
+    {
+        // The head goes out alone when chunking, so it is never framed
+        head_sent = true;
+        out.swap(head);
+        std::string().swap(head);
+        if (want_chunked || file)
+            return STREAM_DATA;
+        out += pending;
+        pending.clear();
+        return (done && !failed) ? STREAM_END : (failed ? STREAM_ERROR : STREAM_DATA);
+    }
+
+    // The upstream's fate no longer matters once the file is being sent
+    if (file)
+        return file->pull(out);
+    setChunked(want_chunked);
+    if (failed)
+        return STREAM_ERROR;
+    out.swap(pending);
+    pending.clear();
+    if (paused && conn)
+    {
+        paused = false;
+        conn->pauseReading(false);
+    }
+    if (done)
+        return STREAM_END;
+    return out.empty() ? STREAM_AGAIN : STREAM_DATA;
+}
+
+std::string FastCgiClient::buildResponse(const std::string &responseData) const
+{
+    return cgi_output::buildResponse(version, responseData);
+}
+
+std::string FastCgiClient::buildHead(const std::string &headerBlock, size_t body_length, bool &chunked) const
+{
+    return cgi_output::buildHead(version, headerBlock, body_length, chunked);
 }
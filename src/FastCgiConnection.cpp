@@ -0,0 +1,456 @@
+#include "FastCgiConnection.hpp"
+
+#include "FastCgiClient.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+const size_t kRecvChunk = 65536;
+
+#ifdef IOV_MAX
+const size_t kMaxIov = IOV_MAX;
+#else
+const size_t kMaxIov = 16;
+#endif
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+size_t valueOf(const std::map<std::string, std::string> &values, const char *name)
+{
+    std::map<std::string, std::string>::const_iterator it = values.find(name);
+    if (it == values.end())
+        return 0;
+    return static_cast<size_t>(std::strtoul(it->second.c_str(), NULL, 10));
+}
+
+} // namespace
+
+FastCgiConnection::FastCgiConnection(EventLoop &event_loop, const std::string &endpoint, FastCgiCaps &endpoint_caps,
+                                     volatile FastCgiLoad *load_counter)
+    : loop(event_loop)
+    , key(endpoint)
+    , caps(endpoint_caps)
+    , fd(-1)
+    , state(CONNECTING)
+    , requests()
+    , keep(false)
+    , paused(false)
+    , outbuf()
+    , out_offset(0)
+    , inbuf()
+    , created(std::time(NULL))
+    , idle_since(created)
+    , send_stalled(0)
+    , last_io(created)
+    , load(load_counter)
+    , counted(0)
+{
+}
+
+FastCgiConnection::~FastCgiConnection()
+{
+    shutdown();
+}
+
+bool FastCgiConnection::connectTo(const FastCgiEndpoint &target)
+{
+    fd = target.connectSocket(true);
+    if (fd < 0)
+    {
+        shutdown();
+        return false;
+    }
+    // Writability reports connect completion
+    state = CONNECTING;
+    if (!loop.add(fd, IO_WRITE, this))
+    {
+        shutdown();
+        return false;
+    }
+    return true;
+}
+
+void FastCgiConnection::shutdown()
+{
+    state = DEAD;
+    recount();
+    if (fd < 0)
+        return;
+    loop.remove(fd);
+    close(fd);
+    fd = -1;
+}
+
+void FastCgiConnection::queryValues()
+{
+    std::string names;
+
+    fcgi::encodeNameValue("FCGI_MAX_CONNS", "", names);
+    fcgi::encodeNameValue("FCGI_MAX_REQS", "", names);
+    fcgi::encodeNameValue("FCGI_MPXS_CONNS", "", names);
+    fcgi::appendRecord(outbuf, fcgi::GET_VALUES, fcgi::MANAGEMENT_ID, names.data(), names.size());
+    caps.queried = true;
+    if (state == READY)
+        flush();
+}
+
+unsigned short FastCgiConnection::allocateId() const
+{
+    // Lowest free ID; the map is ordered so the first gap is the answer
+    unsigned short id = 1;
+    for (std::map<unsigned short, Slot>::const_iterator it = requests.begin();
+         it != requests.end() && it->first == id; ++it)
+        ++id;
+    return id;
+}
+
+FastCgiConnection::Slot *FastCgiConnection::findSlot(FastCgiClient *request, unsigned short &id)
+{
+    for (std::map<unsigned short, Slot>::iterator it = requests.begin(); it != requests.end(); ++it)
+    {
+        if (it->second.request == request)
+        {
+            id = it->first;
+            return &it->second;
+        }
+    }
+    return NULL;
+}
+
+void FastCgiConnection::begin(FastCgiClient *request, const std::string &params,
+                              const std::string &body, bool body_complete, bool keep_conn)
+{
+    const unsigned short id = allocateId();
+    Slot slot;
+    slot.request = request;
+    slot.drain_wait = false;
+    slot.stdin_done = body_complete ? std::time(NULL) : 0;
+    if (requests.empty())
+        last_io = std::time(NULL);
+    requests[id] = slot;
+    keep = keep_conn;
+    recount();
+
+    // BEGIN_REQUEST, PARAMS and STDIN go out in one gathered write
+    fcgi::Gather records(2 + fcgi::recordsFor(params.size()) + 1 + fcgi::recordsFor(body.size()) + 1);
+    records.beginRequest(id, keep_conn ? fcgi::KEEP_CONN : 0);
+    records.stream(fcgi::PARAMS, id, params);
+    if (body_complete)
+        records.stream(fcgi::STDIN, id, body);
+    else
+        records.streamData(fcgi::STDIN, id, body.data(), body.size());
+    write(records);
+}
+
+void FastCgiConnection::sendStdin(FastCgiClient *request, const char *data, size_t len, bool last)
+{
+    unsigned short id;
+    Slot *slot = findSlot(request, id);
+    if (!slot)
+        return; // the reply already ended: the script did not want the rest
+    if (last)
+        slot->stdin_done = std::time(NULL);
+
+    fcgi::Gather records(fcgi::recordsFor(len) + 1);
+    records.streamData(fcgi::STDIN, id, data, len);
+    if (last)
+        records.record(fcgi::STDIN, id, NULL, 0);
+    write(records);
+}
+
+void FastCgiConnection::notifyWhenDrained(FastCgiClient *request)
+{
+    unsigned short id;
+    Slot *slot = findSlot(request, id);
+    if (!slot)
+        return;
+    slot->drain_wait = true;
+    // An already empty buffer reports on the next writable event
+    if (state == READY)
+        updateInterest();
+}
+
+void FastCgiConnection::notifyDrained()
+{
+    std::vector<FastCgiClient *> waiting;
+
+    for (std::map<unsigned short, Slot>::iterator it = requests.begin(); it != requests.end(); ++it)
+    {
+        if (it->second.drain_wait && it->second.request)
+            waiting.push_back(it->second.request);
+        it->second.drain_wait = false;
+    }
+    for (size_t i = 0; i < waiting.size() && state != DEAD; ++i)
+        waiting[i]->onStdinDrained();
+}
+
+void FastCgiConnection::abandon(FastCgiClient *request)
+{
+    for (std::map<unsigned short, Slot>::iterator it = requests.begin(); it != requests.end(); ++it)
+    {
+        if (it->second.request != request)
+            continue;
+        it->second.request = NULL;
+        if (requests.size() == 1 && !caps.mpxs)
+        {
+            // Nothing else shares the socket: dropping it is cheaper than draining
+            requests.clear();
+            shutdown();
+            return;
+        }
+        // Keep the ID reserved and discard its records until END_REQUEST,
+        // which the backend owes us from now on
+        if (!it->second.stdin_done)
+            it->second.stdin_done = std::time(NULL);
+        fcgi::appendRecord(outbuf, fcgi::ABORT_REQUEST, it->first, NULL, 0);
+        if (state == READY)
+            flush();
+        return;
+    }
+}
+
+void FastCgiConnection::pauseReading(bool pause)
+{
+    paused = pause;
+    // Time spent paused is the client's, not the backend's
+    if (!pause)
+        last_io = std::time(NULL);
+    if (state == READY)
+        updateInterest();
+}
+
+void FastCgiConnection::updateInterest()
+{
+    if (fd < 0)
+        return;
+    unsigned int events = paused ? 0 : IO_READ;
+    if (out_offset < outbuf.size())
+        events |= IO_WRITE;
+    for (std::map<unsigned short, Slot>::const_iterator it = requests.begin(); it != requests.end(); ++it)
+    {
+        if (it->second.drain_wait)
+            events |= IO_WRITE;
+    }
+    loop.modify(fd, events);
+}
+
+void FastCgiConnection::recount()
+{
+    // An abandoned request still holds its worker until END_REQUEST
+    const long now_counted = state == DEAD ? 0 : static_cast<long>(requests.size());
+    if (load && now_counted != counted)
+        __sync_fetch_and_add(&load->inflight, now_counted - counted);
+    counted = now_counted;
+}
+
+void FastCgiConnection::handleIo(int io_fd, unsigned int events)
+{
+    if (io_fd != fd)
+        return;
+
+    if (state == CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            return fail(UPSTREAM_CONNECT);
+        state = READY;
+        flush();
+        return;
+    }
+
+    if (events & IO_WRITE)
+    {
+        flush();
+        if (state == DEAD)
+            return;
+    }
+    if (events & (IO_READ | IO_ERROR | IO_HUP))
+        receive();
+}
+
+void FastCgiConnection::expire(time_t now, int connect_timeout, int send_timeout, int read_timeout)
+{
+    if (state == DEAD)
+        return;
+    if (state == CONNECTING)
+    {
+        if (now - created >= connect_timeout)
+            fail(UPSTREAM_CONNECT);
+        return;
+    }
+    if (send_stalled && now - send_stalled >= send_timeout)
+        return fail(UPSTREAM_TIMEOUT);
+    if (paused)
+        return;
+    for (std::map<unsigned short, Slot>::const_iterator it = requests.begin(); it != requests.end(); ++it)
+    {
+        const time_t since = std::max(last_io, it->second.stdin_done);
+        if (it->second.stdin_done && now - since >= read_timeout)
+            return fail(UPSTREAM_TIMEOUT);
+    }
+}
+
+// One sendmsg straight from the callers' buffers when nothing is queued ahead;
+// only what the socket does not take is copied into outbuf
+void FastCgiConnection::write(const fcgi::Gather &records)
+{
+    if (state != READY || out_offset < outbuf.size())
+    {
+        records.appendRest(outbuf, 0);
+        if (state == READY)
+            flush();
+        return;
+    }
+
+    // sendmsg rather than writev: MSG_NOSIGNAL spares us a SIGPIPE
+    const size_t count = records.count() < kMaxIov ? records.count() : kMaxIov;
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<struct iovec *>(records.vectors());
+    msg.msg_iovlen = count;
+    ssize_t n = sendmsg(fd, &msg, kSendFlags);
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return fail(UPSTREAM_SEND);
+        n = 0;
+    }
+    if (n > 0)
+    {
+        send_stalled = 0;
+        last_io = std::time(NULL);
+    }
+    records.appendRest(outbuf, static_cast<size_t>(n));
+    if (out_offset == outbuf.size())
+        return flush(); // all sent: report the drain
+    // Partial: wait for writability rather than retrying right away
+    if (count == records.count() && !send_stalled)
+        send_stalled = std::time(NULL);
+    updateInterest();
+}
+
+void FastCgiConnection::flush()
+{
+    while (out_offset < outbuf.size())
+    {
+        const ssize_t n = send(fd, outbuf.data() + out_offset, outbuf.size() - out_offset, kSendFlags);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                if (!send_stalled)
+                    send_stalled = std::time(NULL);
+                break; // wait for the next writable event
+            }
+            return fail(UPSTREAM_SEND);
+        }
+        out_offset += static_cast<size_t>(n);
+        send_stalled = 0;
+        last_io = std::time(NULL);
+    }
+    if (out_offset == outbuf.size())
+    {
+        outbuf.clear();
+        out_offset = 0;
+        notifyDrained();
+        if (state == DEAD)
+            return;
+    }
+    updateInterest();
+}
+
+void FastCgiConnection::receive()
+{
+    char buffer[kRecvChunk];
+    const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        return fail(UPSTREAM_RECV);
+    }
+    if (n == 0)
+        return fail(UPSTREAM_CLOSED);
+
+    last_io = std::time(NULL);
+    inbuf.append(buffer, static_cast<size_t>(n));
+    size_t pos = 0;
+    fcgi::Record rec;
+    while (state != DEAD && fcgi::nextRecord(inbuf, pos, rec))
+        handleRecord(rec.type, rec.request_id, inbuf.data() + rec.content_offset, rec.content_length);
+    if (state != DEAD)
+        inbuf.erase(0, pos);
+}
+
+void FastCgiConnection::handleRecord(unsigned char type, unsigned short id, const char *data, size_t len)
+{
+    if (id == fcgi::MANAGEMENT_ID)
+        return handleManagement(type, data, len);
+
+    std::map<unsigned short, Slot>::iterator it = requests.find(id);
+    if (it == requests.end())
+        return; // late record for a request we no longer track
+
+    FastCgiClient *request = it->second.request;
+    // STDERR is ignored for now
+    if (type == fcgi::STDOUT && len > 0 && request)
+        request->onStdout(data, len);
+    else if (type == fcgi::END_REQUEST)
+    {
+        requests.erase(it);
+        recount();
+        if (load)
+            __sync_fetch_and_add(&load->served, 1);
+        if (requests.empty())
+        {
+            idle_since = std::time(NULL);
+            if (paused)
+                pauseReading(false);
+        }
+        if (!keep && requests.empty())
+            shutdown();
+        if (request)
+            request->onEnd();
+    }
+}
+
+void FastCgiConnection::handleManagement(unsigned char type, const char *data, size_t len)
+{
+    if (type == fcgi::GET_VALUES_RESULT)
+    {
+        std::map<std::string, std::string> values;
+        fcgi::decodeNameValues(data, len, values);
+        caps.max_conns = valueOf(values, "FCGI_MAX_CONNS");
+        caps.max_reqs = valueOf(values, "FCGI_MAX_REQS");
+        caps.mpxs = valueOf(values, "FCGI_MPXS_CONNS") == 1;
+        caps.known = true;
+    }
+    else if (type == fcgi::UNKNOWN_TYPE)
+        caps.known = true; // backend does not answer GET_VALUES: assume no multiplexing
+}
+
+void FastCgiConnection::fail(UpstreamFailure reason)
+{
+    std::vector<FastCgiClient *> pending;
+
+    for (std::map<unsigned short, Slot>::iterator it = requests.begin(); it != requests.end(); ++it)
+    {
+        if (it->second.request)
+            pending.push_back(it->second.request);
+    }
+    requests.clear();
+    shutdown();
+    for (size_t i = 0; i < pending.size(); ++i)
+        pending[i]->onFailure(reason);
+}
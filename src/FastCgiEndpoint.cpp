@@ -0,0 +1,138 @@
+#include "FastCgiEndpoint.hpp"
+
+#include "ext_libs.hpp"
+
+#include <sys/un.h>
+
+namespace {
+
+const int kDefaultPort = 9000;
+const char kUnixPrefix[] = "unix:";
+
+} // namespace
+
+bool FastCgiEndpoint::parse(const std::string &spec, FastCgiEndpoint &out)
+{
+    out = FastCgiEndpoint();
+    if (spec.compare(0, sizeof(kUnixPrefix) - 1, kUnixPrefix) == 0)
+    {
+        out.unix_path = spec.substr(sizeof(kUnixPrefix) - 1);
+        return !out.unix_path.empty() && out.unix_path.size() < sizeof(((struct sockaddr_un *)0)->sun_path);
+    }
+
+    const std::string::size_type colon = spec.find(':');
+    if (colon == std::string::npos)
+    {
+        out.host = spec;
+        out.port = kDefaultPort;
+        return !out.host.empty();
+    }
+
+    out.host = spec.substr(0, colon);
+    std::istringstream iss(spec.substr(colon + 1));
+    iss >> out.port;
+    return !out.host.empty() && iss && out.port > 0 && out.port <= 65535;
+}
+
+bool FastCgiEndpoint::isLocal() const
+{
+    return isUnix() || host == "127.0.0.1" || host == "localhost" || host == "0.0.0.0";
+}
+
+std::string FastCgiEndpoint::describe() const
+{
+    if (isUnix())
+        return kUnixPrefix + unix_path;
+    std::ostringstream oss;
+    oss << host << ":" << port;
+    return oss.str();
+}
+
+bool FastCgiEndpoint::address(struct sockaddr_storage &storage, socklen_t &len) const
+{
+    std::memset(&storage, 0, sizeof(storage));
+
+    if (isUnix())
+    {
+        struct sockaddr_un *addr = reinterpret_cast<struct sockaddr_un *>(&storage);
+        addr->sun_family = AF_UNIX;
+        std::strncpy(addr->sun_path, unix_path.c_str(), sizeof(addr->sun_path) - 1);
+        len = sizeof(*addr);
+    }
+    else
+    {
+        struct sockaddr_in *addr = reinterpret_cast<struct sockaddr_in *>(&storage);
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(static_cast<unsigned short>(port));
+        const std::string ip = (host == "localhost") ? "127.0.0.1" : host;
+        if (inet_pton(AF_INET, ip.c_str(), &addr->sin_addr) != 1)
+        {
+            errno = EINVAL;
+            return false;
+        }
+        len = sizeof(*addr);
+    }
+    return true;
+}
+
+int FastCgiEndpoint::connectSocket(bool non_blocking) const
+{
+    struct sockaddr_storage storage;
+    socklen_t len;
+    if (!address(storage, len))
+        return -1;
+
+    const int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (non_blocking)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&storage), len) < 0
+        && !(non_blocking && errno == EINPROGRESS))
+    {
+        const int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+int FastCgiEndpoint::listenSocket(int backlog) const
+{
+    struct sockaddr_storage storage;
+    socklen_t len;
+    if (!address(storage, len))
+        return -1;
+
+    const int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (isUnix())
+        unlink(unix_path.c_str());
+    else
+    {
+        const int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&storage), len) < 0 || listen(fd, backlog) < 0)
+    {
+        const int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+bool FastCgiEndpoint::operator<(const FastCgiEndpoint &rhs) const
+{
+    if (unix_path != rhs.unix_path)
+        return unix_path < rhs.unix_path;
+    if (host != rhs.host)
+        return host < rhs.host;
+    return port < rhs.port;
+}
@@ -0,0 +1,63 @@
+#include "FastCgiMirror.hpp"
+#include "FastCgiClient.hpp"
+#include "FastCgiPool.hpp"
+
+namespace {
+
+// Body bytes a copy's backend may fall behind by before the copy is dropped
+const size_t kMaxBacklog = 256u * 1024u;
+
+} // namespace
+
+FastCgiMirror::FastCgiMirror(const FastCgiClient *origin_request, FastCgiClient *copy_request)
+    : origin(origin_request)
+    , copy(copy_request)
+    , awaiting_body(copy_request->streamsBody())
+{
+}
+
+FastCgiMirror *FastCgiMirror::start(const FastCgiClient *origin, FastCgiPool &pool)
+{
+    const LocationConfig &location = origin->locationConfig();
+    if (location.fastcgi_mirror.empty() || !pool.sampleMirror(location))
+        return NULL;
+    FastCgiClient *copy = new FastCgiClient(origin, FastCgiClient::DETACHED_MIRROR);
+    FastCgiMirror *link = new FastCgiMirror(origin, copy);
+    copy->setMirror(link);
+    pool.runDetached(copy);
+    return link;
+}
+
+// A copy never pauses the client: when its backend falls behind, it is
+// dropped instead
+void FastCgiMirror::feedBody(const char *data, size_t len, bool last)
+{
+    if (last)
+        awaiting_body = false;
+    if (!copy)
+        return;
+    if (copy->stdinBacklog() >= kMaxBacklog)
+        return drop();
+    copy->forwardBody(data, len, last);
+}
+
+void FastCgiMirror::detach(const FastCgiClient *side)
+{
+    if (side == origin)
+    {
+        origin = NULL;
+        // The rest of the body will never come: the copy cannot complete
+        if (copy && awaiting_body)
+            drop();
+    }
+    else
+        copy = NULL;
+    if (!origin && !copy)
+        delete this;
+}
+
+void FastCgiMirror::drop()
+{
+    awaiting_body = false;
+    copy->cancel();
+}
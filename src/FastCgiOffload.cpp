@@ -0,0 +1,159 @@
+#include "FastCgiOffload.hpp"
+#include "CgiOutput.hpp"
+#include "HttpResponseHelpers.hpp"
+
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+namespace {
+
+std::string lower(std::string s)
+{
+    for (size_t i = 0; i < s.size(); ++i)
+        s[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(s[i])));
+    return s;
+}
+
+// Value of a CGI reply header, empty when absent
+std::string replyHeader(const std::string &header_block, const std::string &name)
+{
+    const std::string wanted = lower(name) + ":";
+    std::istringstream hss(header_block);
+    std::string line;
+    while (std::getline(hss, line))
+    {
+        if (lower(line.substr(0, wanted.size())) != wanted)
+            continue;
+        const std::string::size_type first = line.find_first_not_of(" \t", wanted.size());
+        if (first == std::string::npos)
+            return "";
+        return line.substr(first, line.find_last_not_of(" \t\r") - first + 1);
+    }
+    return "";
+}
+
+// Reply headers that still describe the file a script hands over
+std::string keptHeaders(const std::string &header_block)
+{
+    static const char *const kept[] = {"content-disposition:", "cache-control:", "expires:", "set-cookie:"};
+    std::istringstream hss(header_block);
+    std::string line;
+    std::string out;
+    while (std::getline(hss, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        for (size_t i = 0; i < sizeof(kept) / sizeof(kept[0]); ++i)
+        {
+            if (lower(line.substr(0, std::strlen(kept[i]))) == kept[i])
+                out += line + "\r\n";
+        }
+    }
+    return out;
+}
+
+} // namespace
+
+FastCgiOffload::FastCgiOffload(const ServerConfig &server_config, const std::string &http_version)
+    : server(server_config)
+    , version(http_version)
+{
+}
+
+bool FastCgiOffload::requested(const std::string &header_block)
+{
+    return !replyHeader(header_block, "X-Accel-Redirect").empty()
+        || !replyHeader(header_block, "X-Sendfile").empty();
+}
+
+FileStream *FastCgiOffload::open(const std::string &header_block, std::string &head) const
+{
+    const std::string accel = replyHeader(header_block, "X-Accel-Redirect");
+    const std::string path = !accel.empty() ? accelPath(accel) : sendfilePath(replyHeader(header_block, "X-Sendfile"));
+    if (path.empty())
+    {
+        head = cgi_output::buildError(version, 403, "Forbidden", "<html><body><h1>403 Forbidden</h1></body></html>");
+        return NULL;
+    }
+    FileStream *file = new FileStream();
+    if (!file->open(path))
+    {
+        delete file;
+        head = cgi_output::buildError(version, 404, "Not Found", "<html><body><h1>404 Not Found</h1></body></html>");
+        return NULL;
+    }
+
+    std::string type = replyHeader(header_block, "Content-Type");
+    if (type.empty())
+        type = server.mime_types.lookup(path);
+    std::ostringstream resp;
+    resp << version << " 200 OK\r\n";
+    resp << "Content-Type: " << type << "\r\n";
+    resp << keptHeaders(header_block);
+    resp << "Content-Length: " << file->size() << "\r\n";
+    resp << "Connection: close\r\n\r\n";
+    head = resp.str();
+    return file;
+}
+
+// The file a GET for uri would be answered with, when its location serves
+// plain files; empty otherwise so a script's source is never handed out
+std::string FastCgiOffload::accelPath(const std::string &uri) const
+{
+    const std::string target = http_response_helpers::stripQuery(uri);
+    if (target.empty() || target[0] != '/' || target.find("..") != std::string::npos)
+        return "";
+
+    const LocationRoute *route = server.router.match(target);
+    std::string base = server.root;
+    std::string suffix = target;
+    if (route)
+    {
+        const LocationConfig *loc = &server.locations[route->location_index];
+        if (route->handler == ROUTE_PROXY || route->handler == ROUTE_RETURN
+            || http_response_helpers::isFastCgiRequest(loc, target)
+            || http_response_helpers::isCgiRequest(loc, target))
+            return "";
+        base = route->read_dir;
+        suffix = target.substr(route->prefix_len);
+    }
+    if (!suffix.empty() && suffix[0] == '/')
+        suffix.erase(0, 1);
+    if (!base.empty() && base[base.size() - 1] != '/')
+        base += "/";
+    return base + suffix;
+}
+
+// X-Sendfile may name any file under the server root or the directory of a
+// location serving plain files: nothing a GET could not fetch already.
+// Other locations are left out, their path defaults to their URI.
+std::string FastCgiOffload::sendfilePath(const std::string &path) const
+{
+    char resolved[PATH_MAX];
+    if (!realpath(path.c_str(), resolved))
+        return "";
+    const std::string file_path = resolved;
+
+    std::vector<std::string> roots;
+    roots.push_back(server.root);
+    const std::vector<LocationRoute> &routes = server.router.allRoutes();
+    for (size_t i = 0; i < routes.size(); ++i)
+    {
+        if (routes[i].handler == ROUTE_STATIC)
+            roots.push_back(routes[i].read_dir);
+    }
+    for (size_t i = 0; i < roots.size(); ++i)
+    {
+        if (roots[i].empty() || !realpath(roots[i].c_str(), resolved))
+            continue;
+        std::string dir = resolved;
+        if (dir[dir.size() - 1] != '/')
+            dir += "/";
+        if (file_path.compare(0, dir.size(), dir) == 0)
+            return file_path;
+    }
+    return "";
+}
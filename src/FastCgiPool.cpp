@@ -0,0 +1,241 @@
+#include "FastCgiPool.hpp"
+
+#include "FastCgiClient.hpp"
+#include "FastCgiWorkerPool.hpp"
+
+namespace {
+
+// Mirror copies (and cache refreshes) running at once per worker before
+// further requests go unmirrored
+const size_t kMaxDetached = 64u;
+
+} // namespace
+
+FastCgiPool::FastCgiPool(EventLoop &event_loop)
+    : loop(event_loop)
+    , endpoints()
+    , upstreams()
+    , detached()
+    , leaders()
+    , mirror_seen()
+{
+}
+
+FastCgiPool::~FastCgiPool()
+{
+    // They hold connections and servers of the groups below
+    for (size_t i = 0; i < detached.size(); ++i)
+        delete detached[i];
+    for (std::map<std::string, Endpoint>::iterator it = endpoints.begin(); it != endpoints.end(); ++it)
+    {
+        for (size_t i = 0; i < it->second.conns.size(); ++i)
+            delete it->second.conns[i];
+    }
+    for (std::map<std::string, FastCgiUpstream *>::iterator it = upstreams.begin(); it != upstreams.end(); ++it)
+        delete it->second;
+}
+
+void FastCgiPool::configure(const ServerConfig &server)
+{
+    for (size_t i = 0; i < server.locations.size(); ++i)
+    {
+        if (!server.locations[i].fastcgi_pass.empty())
+            upstream(server, server.locations[i].fastcgi_pass);
+        if (!server.locations[i].fastcgi_mirror.empty())
+            upstream(server, server.locations[i].fastcgi_mirror);
+    }
+}
+
+FastCgiUpstream *FastCgiPool::upstream(const ServerConfig &server, const std::string &pass)
+{
+    std::map<std::string, FastCgiUpstream *>::iterator it = upstreams.find(pass);
+    if (it != upstreams.end())
+        return it->second;
+
+    FastCgiUpstream *group = NULL;
+    std::map<std::string, UpstreamConfig>::const_iterator named = server.upstreams.find(pass);
+    FastCgiEndpoint endpoint;
+    if (named != server.upstreams.end())
+        group = new FastCgiUpstream(loop, named->second);
+    else if (FastCgiEndpoint::parse(pass, endpoint))
+        group = new FastCgiUpstream(loop, pass, endpoint);
+    else
+        return NULL;
+    upstreams[pass] = group;
+    return group;
+}
+
+bool FastCgiPool::expired(const FastCgiConnection &conn, const Endpoint &ep, time_t now) const
+{
+    return now - conn.idleSince() >= ep.idle_timeout || now - conn.createdAt() >= ep.lifetime;
+}
+
+FastCgiPool::Lease FastCgiPool::acquire(const LocationConfig &location, const FastCgiEndpoint &target,
+                                        bool fresh_only)
+{
+    const std::string key = target.describe();
+    Endpoint &ep = endpoints[key];
+    const time_t now = std::time(NULL);
+    const bool keepalive = location.fastcgi_keepalive > 0;
+    Lease lease;
+
+    ep.max_idle = location.fastcgi_keepalive;
+    ep.idle_timeout = location.fastcgi_keepalive_timeout;
+    ep.lifetime = location.fastcgi_keepalive_lifetime;
+    ep.connect_timeout = location.fastcgi_connect_timeout;
+    ep.send_timeout = location.fastcgi_send_timeout;
+    ep.read_timeout = location.fastcgi_read_timeout;
+    ep.load = FastCgiWorkerPool::loadCounter(key);
+
+    lease.conn = NULL;
+    lease.reused = false;
+    lease.busy = false;
+
+    // Pick the least loaded usable socket, newest first: the backend is least
+    // likely to have dropped it. Only multiplexing backends take a busy one.
+    const bool shared = keepalive && ep.caps.mpxs;
+    size_t live = 0;
+    size_t in_flight = 0;
+    for (size_t i = ep.conns.size(); i > 0; --i)
+    {
+        FastCgiConnection *conn = ep.conns[i - 1];
+        if (conn->isDead())
+            continue;
+        if (conn->isIdle() && expired(*conn, ep, now))
+        {
+            conn->shutdown();
+            continue;
+        }
+        ++live;
+        in_flight += conn->inFlight();
+        if (fresh_only || !keepalive || (!shared && !conn->isIdle()))
+            continue;
+        if (!lease.conn || conn->inFlight() < lease.conn->inFlight())
+            lease.conn = conn;
+    }
+
+    if (ep.caps.max_reqs && in_flight >= ep.caps.max_reqs)
+    {
+        lease.conn = NULL;
+        lease.busy = true;
+        return lease;
+    }
+    if (lease.conn)
+    {
+        lease.reused = true;
+        return lease;
+    }
+    if (ep.caps.max_conns && live >= ep.caps.max_conns)
+    {
+        lease.busy = true;
+        return lease;
+    }
+
+    FastCgiConnection *conn = new FastCgiConnection(loop, key, ep.caps, ep.load);
+    if (!conn->connectTo(target))
+    {
+        delete conn;
+        return lease;
+    }
+    // The first socket to an endpoint learns what the backend can take
+    if (keepalive && !ep.caps.queried)
+        conn->queryValues();
+    ep.conns.push_back(conn);
+    lease.conn = conn;
+    return lease;
+}
+
+void FastCgiPool::runDetached(FastCgiClient *request)
+{
+    StreamContext ctx;
+    ctx.loop = &loop;
+    ctx.fastcgi = this;
+    detached.push_back(request);
+    request->attach(ctx, -1);
+}
+
+bool FastCgiPool::sampleMirror(const LocationConfig &location)
+{
+    const unsigned long n = ++mirror_seen[&location];
+    if (n * location.fastcgi_mirror_percent / 100 == (n - 1) * location.fastcgi_mirror_percent / 100)
+        return false;
+    return detached.size() < kMaxDetached;
+}
+
+FastCgiClient *FastCgiPool::lead(const std::string &key, FastCgiClient *request)
+{
+    std::map<std::string, FastCgiClient *>::iterator it = leaders.find(key);
+    if (it != leaders.end())
+        return it->second;
+    leaders[key] = request;
+    return NULL;
+}
+
+void FastCgiPool::unlead(const std::string &key, const FastCgiClient *request)
+{
+    std::map<std::string, FastCgiClient *>::iterator it = leaders.find(key);
+    if (it != leaders.end() && it->second == request)
+        leaders.erase(it);
+}
+
+void FastCgiPool::reap()
+{
+    const time_t now = std::time(NULL);
+
+    // Waiters that give up start their own requests: walk a copy
+    std::vector<FastCgiClient *> leading;
+    for (std::map<std::string, FastCgiClient *>::iterator it = leaders.begin(); it != leaders.end(); ++it)
+        leading.push_back(it->second);
+    for (size_t i = 0; i < leading.size(); ++i)
+        leading[i]->expireWaiters(now);
+
+    for (size_t i = detached.size(); i > 0; --i)
+    {
+        if (!detached[i - 1]->finished())
+            continue;
+        delete detached[i - 1];
+        detached.erase(detached.begin() + (i - 1));
+    }
+
+    for (std::map<std::string, FastCgiUpstream *>::iterator it = upstreams.begin(); it != upstreams.end(); ++it)
+        it->second->checkHealth(now);
+
+    // Failing a socket may start a retry that opens another one: index the
+    // vector afresh on every step
+    for (std::map<std::string, Endpoint>::iterator it = endpoints.begin(); it != endpoints.end(); ++it)
+    {
+        Endpoint &ep = it->second;
+        for (size_t i = 0; i < ep.conns.size(); ++i)
+            ep.conns[i]->expire(now, ep.connect_timeout, ep.send_timeout, ep.read_timeout);
+    }
+
+    for (std::map<std::string, Endpoint>::iterator it = endpoints.begin(); it != endpoints.end(); ++it)
+    {
+        Endpoint &ep = it->second;
+        size_t idle = 0;
+
+        // Walk newest first so the surplus over max_idle is the oldest
+        for (size_t i = ep.conns.size(); i > 0; --i)
+        {
+            FastCgiConnection *conn = ep.conns[i - 1];
+            if (conn->isIdle() && (idle >= ep.max_idle || expired(*conn, ep, now)))
+                conn->shutdown();
+            else if (conn->isIdle())
+                ++idle;
+            if (conn->isDead())
+            {
+                delete conn;
+                ep.conns.erase(ep.conns.begin() + (i - 1));
+            }
+        }
+    }
+}
+
+size_t FastCgiPool::size() const
+{
+    size_t n = 0;
+
+    for (std::map<std::string, Endpoint>::const_iterator it = endpoints.begin(); it != endpoints.end(); ++it)
+        n += it->second.conns.size();
+    return n;
+}
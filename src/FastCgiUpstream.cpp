@@ -0,0 +1,342 @@
+#include "FastCgiUpstream.hpp"
+#include "FastCgiBackend.hpp"
+
+namespace {
+
+// Weight of the newest latency sample in the moving average
+const double kEwmaAlpha = 0.3;
+
+// A plain address has no other server to take over: its breaker only
+// opens for a second, so a blip costs little while a dead server is still
+// tried once a second instead of on every request
+const time_t kPlainFailTimeout = 1;
+
+UpstreamServer defaultServer(const std::string &address)
+{
+    UpstreamServer server;
+    server.address = address;
+    server.weight = 1;
+    server.max_fails = 1;
+    server.fail_timeout = kPlainFailTimeout;
+    return server;
+}
+
+} // namespace
+
+FastCgiUpstream::FastCgiUpstream(EventLoop &event_loop, const UpstreamConfig &config)
+    : loop(event_loop)
+    , group_name(config.name)
+    , balance(config.balance)
+    , health_interval(config.health_interval)
+    , health_timeout(config.health_timeout)
+    , health_fails(config.health_fails)
+    , health_passes(config.health_passes)
+    , peers()
+    , rotation(0)
+{
+    peers.reserve(config.servers.size());
+    for (size_t i = 0; i < config.servers.size(); ++i)
+    {
+        FastCgiEndpoint endpoint;
+        if (FastCgiEndpoint::parse(config.servers[i].address, endpoint))
+            addPeer(endpoint, config.servers[i]);
+    }
+}
+
+FastCgiUpstream::FastCgiUpstream(EventLoop &event_loop, const std::string &name, const FastCgiEndpoint &endpoint)
+    : loop(event_loop)
+    , group_name(name)
+    , balance(BALANCE_ROUND_ROBIN)
+    , health_interval(0)
+    , health_timeout(1)
+    , health_fails(1)
+    , health_passes(1)
+    , peers()
+    , rotation(0)
+{
+    addPeer(endpoint, defaultServer(name));
+}
+
+FastCgiUpstream::~FastCgiUpstream()
+{
+    for (size_t i = 0; i < peers.size(); ++i)
+    {
+        if (peers[i].probe_fd < 0)
+            continue;
+        loop.remove(peers[i].probe_fd);
+        close(peers[i].probe_fd);
+    }
+}
+
+void FastCgiUpstream::addPeer(const FastCgiEndpoint &endpoint, const UpstreamServer &server)
+{
+    Peer peer;
+
+    peer.endpoint = endpoint;
+    peer.weight = server.weight;
+    peer.max_fails = server.max_fails;
+    peer.fail_timeout = server.fail_timeout;
+    peer.current_weight = 0;
+    peer.outstanding = 0;
+    peer.ewma_ms = 0;
+    peer.measured = false;
+    peer.fails = 0;
+    peer.fail_start = 0;
+    peer.breaker = BREAKER_CLOSED;
+    peer.open_until = 0;
+    peer.trial_inflight = false;
+    peer.starting = FastCgiBackend::startingFlag(endpoint.describe());
+    peer.healthy = true;
+    peer.probe_passes = 0;
+    peer.probe_fails = 0;
+    peer.probe_fd = -1;
+    peer.probe_started = 0;
+    peer.next_probe = 0;
+    peers.push_back(peer);
+}
+
+std::string FastCgiUpstream::label(const Peer &peer) const
+{
+    const std::string address = peer.endpoint.describe();
+    if (address == group_name)
+        return "upstream " + address;
+    return "upstream " + group_name + " server " + address;
+}
+
+bool FastCgiUpstream::usable(Peer &peer, time_t now)
+{
+    if (peer.starting && *peer.starting)
+        return false;
+    if (!peer.healthy)
+        return false;
+    if (peer.breaker == BREAKER_OPEN && now >= peer.open_until)
+        peer.breaker = BREAKER_HALF_OPEN;
+    if (peer.breaker == BREAKER_OPEN)
+        return false;
+    return peer.breaker == BREAKER_CLOSED || !peer.trial_inflight;
+}
+
+FastCgiUpstream::Peer *FastCgiUpstream::select(time_t now, const std::vector<const Peer *> &exclude)
+{
+    std::vector<Peer *> candidates;
+
+    for (size_t i = 0; i < peers.size(); ++i)
+    {
+        if (std::find(exclude.begin(), exclude.end(), &peers[i]) == exclude.end() && usable(peers[i], now))
+            candidates.push_back(&peers[i]);
+    }
+    // Nothing to try: failing fast beats paying a connect to a dead server
+    if (candidates.empty())
+        return NULL;
+
+    Peer *peer;
+    if (balance == BALANCE_LEAST_CONN)
+        peer = pickLeastConn(candidates);
+    else if (balance == BALANCE_EWMA)
+        peer = pickEwma(candidates);
+    else
+        peer = pickRoundRobin(candidates);
+    ++peer->outstanding;
+    if (peer->breaker == BREAKER_HALF_OPEN)
+        peer->trial_inflight = true;
+    return peer;
+}
+
+// nginx's smooth weighted round-robin: heavier servers are picked more often
+// without being picked in bursts
+FastCgiUpstream::Peer *FastCgiUpstream::pickRoundRobin(const std::vector<Peer *> &candidates)
+{
+    Peer *best = NULL;
+    int total = 0;
+
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        Peer *peer = candidates[i];
+        peer->current_weight += static_cast<int>(peer->weight);
+        total += static_cast<int>(peer->weight);
+        if (!best || peer->current_weight > best->current_weight)
+            best = peer;
+    }
+    best->current_weight -= total;
+    return best;
+}
+
+FastCgiUpstream::Peer *FastCgiUpstream::pickLeastConn(const std::vector<Peer *> &candidates)
+{
+    const size_t n = candidates.size();
+    Peer *best = NULL;
+
+    // Start the scan somewhere new each time so ties spread out
+    for (size_t k = 0; k < n; ++k)
+    {
+        Peer *peer = candidates[(rotation + k) % n];
+        // outstanding / weight, compared without division
+        if (!best || peer->outstanding * best->weight < best->outstanding * peer->weight)
+            best = peer;
+    }
+    ++rotation;
+    return best;
+}
+
+FastCgiUpstream::Peer *FastCgiUpstream::pickEwma(const std::vector<Peer *> &candidates)
+{
+    const size_t n = candidates.size();
+    Peer *best = NULL;
+    double best_score = 0;
+
+    for (size_t k = 0; k < n; ++k)
+    {
+        Peer *peer = candidates[(rotation + k) % n];
+        // Unmeasured servers score 0 so each gets a first sample; otherwise
+        // latency grows with the queue the request would join
+        const double score = peer->measured
+            ? peer->ewma_ms * static_cast<double>(peer->outstanding + 1) / peer->weight
+            : 0;
+        if (!best || score < best_score)
+        {
+            best = peer;
+            best_score = score;
+        }
+    }
+    ++rotation;
+    return best;
+}
+
+void FastCgiUpstream::observe(Peer *peer, double elapsed_ms)
+{
+    if (!peer)
+        return;
+    if (!peer->measured)
+    {
+        peer->ewma_ms = elapsed_ms;
+        peer->measured = true;
+        return;
+    }
+    peer->ewma_ms += kEwmaAlpha * (elapsed_ms - peer->ewma_ms);
+}
+
+void FastCgiUpstream::release(Peer *peer, Outcome outcome, time_t now)
+{
+    if (!peer)
+        return;
+    if (peer->outstanding > 0)
+        --peer->outstanding;
+
+    const bool trial = (peer->breaker == BREAKER_HALF_OPEN && peer->trial_inflight);
+    if (trial)
+        peer->trial_inflight = false;
+    if (outcome == OUTCOME_NEUTRAL)
+        return;
+
+    if (outcome == OUTCOME_SUCCESS)
+    {
+        peer->fails = 0;
+        if (trial)
+        {
+            peer->breaker = BREAKER_CLOSED;
+            std::cout << label(*peer) << " recovered" << std::endl;
+        }
+        return;
+    }
+    if (peer->max_fails == 0)
+        return;
+    if (trial)
+        return openBreaker(*peer, now);
+
+    if (now - peer->fail_start >= peer->fail_timeout)
+    {
+        peer->fails = 0;
+        peer->fail_start = now;
+    }
+    if (++peer->fails >= peer->max_fails && peer->breaker == BREAKER_CLOSED)
+        openBreaker(*peer, now);
+}
+
+void FastCgiUpstream::openBreaker(Peer &peer, time_t now)
+{
+    peer.fails = 0;
+    peer.breaker = BREAKER_OPEN;
+    peer.open_until = now + peer.fail_timeout;
+    std::cerr << label(peer)
+              << " failing, requests fail fast for " << peer.fail_timeout << "s" << std::endl;
+}
+
+void FastCgiUpstream::checkHealth(time_t now)
+{
+    if (health_interval <= 0)
+        return;
+    for (size_t i = 0; i < peers.size(); ++i)
+    {
+        Peer &peer = peers[i];
+        if (peer.probe_fd >= 0)
+        {
+            if (now - peer.probe_started >= health_timeout)
+                finishProbe(peer, false, now);
+        }
+        else if (now >= peer.next_probe)
+            startProbe(peer, now);
+    }
+}
+
+// Same check as FastCgiBackend::isReachable, without blocking the loop
+void FastCgiUpstream::startProbe(Peer &peer, time_t now)
+{
+    const int fd = peer.endpoint.connectSocket(true);
+    if (fd < 0)
+        return finishProbe(peer, false, now);
+    if (!loop.add(fd, IO_WRITE, this))
+    {
+        close(fd);
+        return finishProbe(peer, false, now);
+    }
+    peer.probe_fd = fd;
+    peer.probe_started = now;
+}
+
+void FastCgiUpstream::handleIo(int fd, unsigned int events)
+{
+    (void)events;
+    for (size_t i = 0; i < peers.size(); ++i)
+    {
+        if (peers[i].probe_fd != fd)
+            continue;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        const bool ok = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+        finishProbe(peers[i], ok, std::time(NULL));
+        return;
+    }
+}
+
+void FastCgiUpstream::finishProbe(Peer &peer, bool ok, time_t now)
+{
+    if (peer.probe_fd >= 0)
+    {
+        loop.remove(peer.probe_fd);
+        close(peer.probe_fd);
+        peer.probe_fd = -1;
+    }
+    peer.next_probe = now + health_interval;
+
+    if (ok)
+    {
+        peer.probe_fails = 0;
+        if (peer.healthy || ++peer.probe_passes < health_passes)
+            return;
+        peer.healthy = true;
+        peer.probe_passes = 0;
+        // The probe already proved the server answers: no trial needed
+        peer.breaker = BREAKER_CLOSED;
+        peer.fails = 0;
+        std::cout << label(peer) << " is back up" << std::endl;
+        return;
+    }
+
+    peer.probe_passes = 0;
+    if (!peer.healthy || ++peer.probe_fails < health_fails)
+        return;
+    peer.healthy = false;
+    peer.probe_fails = 0;
+    std::cerr << label(peer)
+              << " failed its health check" << std::endl;
+}
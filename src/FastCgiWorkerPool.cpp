@@ -0,0 +1,368 @@
+#include "FastCgiWorkerPool.hpp"
+
+#include <sys/mman.h>
+
+namespace
+{
+	// Idle time before a surplus worker is retired, and between retirements
+	const time_t	kIdleRetire = 10;
+	// A worker dying sooner than this after its start counts as a crash loop
+	const time_t	kMinUptime = 1;
+	const time_t	kMaxBackoff = 30;
+	const int		kBacklog = 128;
+	// Server processes counted apart, old generations included; any more
+	// share the last slot
+	const size_t	kLoadSlots = 64;
+}
+
+FastCgiWorkerPool::FastCgiWorkerPool(const FastCgiSpawnConfig &config, char **env)
+	: _config(config), _endpoint(), _env(env), _listenFd(-1), _shared(false), _load(NULL),
+	_workers(), _holdUntil(0), _backoff(1), _lastBusy(0), _lastRetire(0), _served(0)
+{
+	FastCgiEndpoint::parse(config.address, _endpoint);
+}
+
+FastCgiWorkerPool::~FastCgiWorkerPool(void)
+{
+	stop();
+}
+
+const std::string	&FastCgiWorkerPool::address(void) const
+{
+	return (_config.address);
+}
+
+std::map<std::string, volatile FastCgiWorkerPool::LoadSlot *>	&FastCgiWorkerPool::loadSlots(void)
+{
+	static std::map<std::string, volatile LoadSlot *>	registry;
+	return (registry);
+}
+
+volatile FastCgiLoad	*FastCgiWorkerPool::loadCounter(const std::string &endpoint)
+{
+	std::map<std::string, volatile LoadSlot *>::const_iterator	it;
+	const pid_t													self = getpid();
+	volatile LoadSlot											*slots;
+
+	it = loadSlots().find(endpoint);
+	if (it == loadSlots().end())
+		return (NULL);
+	slots = it->second;
+	for (size_t i = 0; i < kLoadSlots - 1; ++i)
+	{
+		if (slots[i].pid == self)
+			return (&slots[i].load);
+	}
+	for (size_t i = 0; i < kLoadSlots - 1; ++i)
+	{
+		if (__sync_bool_compare_and_swap(&slots[i].pid, 0, self))
+			return (&slots[i].load);
+	}
+	return (&slots[kLoadSlots - 1].load);
+}
+
+void	FastCgiWorkerPool::releaseLoad(pid_t pid)
+{
+	if (!_load)
+		return ;
+	for (size_t i = 0; i < kLoadSlots - 1; ++i)
+	{
+		if (_load[i].pid != pid)
+			continue;
+		// Count first: whoever claims the slot next starts from zero.
+		// served is only ever added to, so recycle() reads a running total.
+		_load[i].load.inflight = 0;
+		__sync_synchronize();
+		_load[i].pid = 0;
+	}
+}
+
+long	FastCgiWorkerPool::totalLoad(void) const
+{
+	long	total;
+
+	total = 0;
+	for (size_t i = 0; i < kLoadSlots; ++i)
+		total += _load[i].load.inflight;
+	return (total);
+}
+
+void	FastCgiWorkerPool::recycle(void)
+{
+	long		total;
+	long		fresh;
+	long		share;
+	long		rest;
+	size_t		live;
+	Worker		*oldest;
+
+	total = 0;
+	for (size_t i = 0; i < kLoadSlots; ++i)
+		total += _load[i].load.served;
+	fresh = total - _served;
+	_served = total;
+	live = liveWorkers();
+	if (fresh <= 0 || live == 0)
+		return ;
+	share = fresh / static_cast<long>(live);
+	rest = fresh % static_cast<long>(live);
+	oldest = NULL;
+	for (size_t i = 0; i < _workers.size(); ++i)
+	{
+		if (_workers[i].retiring)
+			continue;
+		// The remainder goes to the oldest workers, so they recycle first
+		_workers[i].served += share + (rest > 0 ? 1 : 0);
+		if (rest > 0)
+			--rest;
+		if (!oldest && _workers[i].served >= static_cast<long>(_config.php_max_requests))
+			oldest = &_workers[i];
+	}
+	// One at a time: workers started together would all stop together.
+	// SIGTERM lets a FastCGI worker finish the request it is serving.
+	if (oldest)
+	{
+		kill(oldest->pid, SIGTERM);
+		oldest->retiring = true;
+	}
+}
+
+int	FastCgiWorkerPool::handOver(bool in_child)
+{
+	if (_listenFd < 0)
+		return (-1);
+	if (in_child)
+		fcntl(_listenFd, F_SETFD, 0);
+	else
+		_shared = true;
+	return (_listenFd);
+}
+
+bool	FastCgiWorkerPool::start(int inherited_fd)
+{
+	void	*shared;
+	time_t	now;
+
+	// A socket bound by the previous master may still be served by it:
+	// its file is left alone whoever exits first
+	_shared = inherited_fd >= 0;
+	if (access(_config.argv[0].c_str(), X_OK) != 0)
+	{
+		if (inherited_fd >= 0)
+			close(inherited_fd);
+		std::cerr << "fastcgi_spawn " << _config.address << ": " << _config.argv[0]
+			<< ": " << std::strerror(errno) << std::endl;
+		return (false);
+	}
+	// Binding again would fail for TCP and unlink a unix socket still served
+	_listenFd = inherited_fd >= 0 ? inherited_fd : _endpoint.listenSocket(kBacklog);
+	if (_listenFd < 0)
+	{
+		std::cerr << "fastcgi_spawn " << _config.address << ": cannot listen: "
+			<< std::strerror(errno) << std::endl;
+		return (false);
+	}
+	// Anonymous shared mappings start zeroed: every slot is free
+	shared = mmap(NULL, kLoadSlots * sizeof(LoadSlot), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANON, -1, 0);
+	if (shared == MAP_FAILED)
+	{
+		close(_listenFd);
+		_listenFd = -1;
+		return (false);
+	}
+	_load = static_cast<volatile LoadSlot *>(shared);
+	loadSlots()[_endpoint.describe()] = _load;
+	now = std::time(NULL);
+	while (liveWorkers() < _config.min_spare && spawn(now))
+		;
+	std::cout << "FastCGI workers for " << _config.address << ": " << _workers.size()
+		<< " started (max " << _config.max_children << ")" << std::endl;
+	return (true);
+}
+
+bool	FastCgiWorkerPool::spawn(time_t now)
+{
+	std::vector<std::string>	vars;
+	std::vector<char *>			envp;
+	std::vector<char *>			argv;
+	pid_t						pid;
+	int							devnull;
+	Worker						worker;
+
+	pid = fork();
+	if (pid < 0)
+	{
+		std::cerr << "fastcgi_spawn " << _config.address << ": fork failed: "
+			<< std::strerror(errno) << std::endl;
+		return (false);
+	}
+	if (pid == 0)
+	{
+		// FastCGI workers accept on FCGI_LISTENSOCK_FILENO and must not
+		// write to stdout
+		dup2(_listenFd, STDIN_FILENO);
+		devnull = open("/dev/null", O_WRONLY);
+		if (devnull >= 0)
+		{
+			dup2(devnull, STDOUT_FILENO);
+			if (devnull > STDERR_FILENO)
+				close(devnull);
+		}
+		for (size_t i = 0; _env && _env[i]; ++i)
+		{
+			if (std::strncmp(_env[i], "PHP_FCGI_", 9) != 0)
+				vars.push_back(_env[i]);
+		}
+		// The pool is the process manager: php-cgi must not fork its own
+		vars.push_back("PHP_FCGI_CHILDREN=0");
+		if (_config.php_max_requests > 0)
+		{
+			std::ostringstream	oss;
+			oss << "PHP_FCGI_MAX_REQUESTS=" << _config.php_max_requests;
+			vars.push_back(oss.str());
+		}
+		for (size_t i = 0; i < vars.size(); ++i)
+			envp.push_back(const_cast<char *>(vars[i].c_str()));
+		envp.push_back(NULL);
+		for (size_t i = 0; i < _config.argv.size(); ++i)
+			argv.push_back(const_cast<char *>(_config.argv[i].c_str()));
+		argv.push_back(NULL);
+		execve(argv[0], &argv[0], &envp[0]);
+		std::cerr << "fastcgi_spawn: cannot run " << argv[0] << ": "
+			<< std::strerror(errno) << std::endl;
+		_exit(127);
+	}
+	worker.pid = pid;
+	worker.started = now;
+	worker.served = 0;
+	worker.retiring = false;
+	_workers.push_back(worker);
+	return (true);
+}
+
+size_t	FastCgiWorkerPool::liveWorkers(void) const
+{
+	size_t	n;
+
+	n = 0;
+	for (size_t i = 0; i < _workers.size(); ++i)
+	{
+		if (!_workers[i].retiring)
+			++n;
+	}
+	return (n);
+}
+
+bool	FastCgiWorkerPool::reap(pid_t pid, int status)
+{
+	std::vector<Worker>::iterator	it;
+	time_t							now;
+
+	for (it = _workers.begin(); it != _workers.end(); ++it)
+	{
+		if (it->pid == pid)
+			break;
+	}
+	if (it == _workers.end())
+		return (false);
+	now = std::time(NULL);
+	if (!it->retiring)
+	{
+		// A clean exit is php-cgi recycling itself after
+		// PHP_FCGI_MAX_REQUESTS, before the master counted that far
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			std::cerr << "FastCGI worker PID " << pid << " (" << _config.address << ") ";
+			if (WIFSIGNALED(status))
+				std::cerr << "killed by signal " << WTERMSIG(status) << std::endl;
+			else
+				std::cerr << "exited with status " << WEXITSTATUS(status) << std::endl;
+		}
+		if (now - it->started < kMinUptime)
+		{
+			_holdUntil = now + _backoff;
+			_backoff = std::min(_backoff * 2, kMaxBackoff);
+		}
+		else
+			_backoff = 1;
+	}
+	_workers.erase(it);
+	return (true);
+}
+
+void	FastCgiWorkerPool::tick(time_t now)
+{
+	long	load;
+	size_t	target;
+	size_t	live;
+
+	if (_listenFd < 0)
+		return ;
+	if (_config.php_max_requests > 0)
+		recycle();
+	load = totalLoad();
+	if (load < 0)
+		load = 0;
+	if (load > 0)
+		_lastBusy = now;
+	target = std::min(static_cast<size_t>(load) + _config.min_spare,
+		static_cast<size_t>(_config.max_children));
+	live = liveWorkers();
+	if (live < target)
+	{
+		if (now < _holdUntil)
+			return ;
+		while (live < target && spawn(now))
+			++live;
+		return ;
+	}
+	// Surplus workers go once no request has been in flight for a while:
+	// which worker took a request is unknown, so only then is any of them
+	// sure to be idle. SIGTERM still lets one finish a request it has just
+	// accepted.
+	if (live <= target || load > 0 || now - _lastBusy < kIdleRetire
+		|| now - _lastRetire < kIdleRetire)
+		return ;
+	for (size_t i = 0; i < _workers.size(); ++i)
+	{
+		if (_workers[i].retiring)
+			continue;
+		kill(_workers[i].pid, SIGTERM);
+		_workers[i].retiring = true;
+		_lastRetire = now;
+		return ;
+	}
+}
+
+void	FastCgiWorkerPool::stop(void)
+{
+	int	status;
+
+	for (size_t i = 0; i < _workers.size(); ++i)
+		kill(_workers[i].pid, SIGTERM);
+	// Two seconds to exit on their own, then SIGKILL
+	for (int tries = 0; tries < 20 && !_workers.empty(); ++tries)
+	{
+		for (size_t i = _workers.size(); i > 0; --i)
+		{
+			if (waitpid(_workers[i - 1].pid, &status, WNOHANG) != 0)
+				_workers.erase(_workers.begin() + (i - 1));
+		}
+		if (!_workers.empty())
+			usleep(100000);
+	}
+	for (size_t i = 0; i < _workers.size(); ++i)
+	{
+		kill(_workers[i].pid, SIGKILL);
+		waitpid(_workers[i].pid, &status, 0);
+	}
+	_workers.clear();
+	if (_listenFd >= 0)
+	{
+		close(_listenFd);
+		_listenFd = -1;
+		if (_endpoint.isUnix() && !_shared)
+			unlink(_endpoint.unix_path.c_str());
+	}
+}
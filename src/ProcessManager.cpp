@@ -2,27 +2,105 @@
 #include "Server.hpp"
 
 volatile std::sig_atomic_t ProcessManager::g_stopRequested = 0;
+volatile std::sig_atomic_t ProcessManager::g_drainRequested = 0;
+volatile std::sig_atomic_t ProcessManager::g_reloadRequested = 0;
+volatile std::sig_atomic_t ProcessManager::g_upgradeRequested = 0;
 
 static void	signalHandler(int sig)
 {
-	(void)sig;
-	ProcessManager::g_stopRequested = 1;
+	if (sig == SIGHUP)
+		ProcessManager::g_reloadRequested = 1;
+	else if (sig == SIGUSR2)
+		ProcessManager::g_upgradeRequested = 1;
+	else
+	{
+		// SIGINT, even after SIGTERM or SIGQUIT, stops without draining
+		ProcessManager::g_drainRequested = (sig != SIGINT);
+		ProcessManager::g_stopRequested = 1;
+	}
 }
 
-ProcessManager::ProcessManager(void) : _children()
+ProcessManager::ProcessManager(void)
+	: _children(), _supervisor(NULL), _listeners(), _generationPorts(), _previousPorts(),
+	_generation(0), _upgradePid(-1), _executable()
 {
 }
 
 ProcessManager::~ProcessManager(void)
 {
+	std::map<int, int>::iterator	it;
+
 	if (!_children.empty())
-		terminateAll();
+		terminateAll(SIGINT);
+	for (it = _listeners.begin(); it != _listeners.end(); ++it)
+		close(it->second);
 }
 
 void	ProcessManager::installSignalHandlers(void)
 {
 	std::signal(SIGINT, signalHandler);
 	std::signal(SIGTERM, signalHandler);
+	std::signal(SIGQUIT, signalHandler);
+	std::signal(SIGHUP, signalHandler);
+	std::signal(SIGUSR2, signalHandler);
+}
+
+void	ProcessManager::resolveExecutable(const char *argv0)
+{
+	char	path[PATH_MAX];
+	ssize_t	len;
+
+	// Read now: once the file is replaced the link reads "... (deleted)"
+	len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (len > 0)
+	{
+		path[len] = '\0';
+		_executable = path;
+	}
+	else if (realpath(argv0, path))
+		_executable = path;
+	else
+		_executable = argv0;
+}
+
+void	ProcessManager::adoptListeners(void)
+{
+	const char			*inherited = std::getenv("WEBSERV_LISTENERS");
+	std::stringstream	ss;
+	std::string			entry;
+	int					port;
+	int					fd;
+	char				colon;
+
+	if (!inherited)
+		return ;
+	// "port:fd;port:fd;..."
+	ss.str(inherited);
+	while (std::getline(ss, entry, ';'))
+	{
+		std::istringstream	item(entry);
+
+		if (!(item >> port >> colon >> fd) || colon != ':' || fd < 3)
+			continue;
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		_listeners[port] = fd;
+		std::cout << "Inherited listener for port " << port << " (fd " << fd << ")" << std::endl;
+	}
+	unsetenv("WEBSERV_LISTENERS");
+}
+
+int	ProcessManager::listenerFor(int port)
+{
+	std::map<int, int>::const_iterator	it;
+	int									fd;
+
+	it = _listeners.find(port);
+	if (it != _listeners.end())
+		return (it->second);
+	fd = Server::openListener(port);
+	if (fd >= 0)
+		_listeners[port] = fd;
+	return (fd);
 }
 
 void	ProcessManager::printBanner(const ServerConfig &config) const
@@ -33,51 +111,192 @@ void	ProcessManager::printBanner(const ServerConfig &config) const
 	std::cout << "Serving root: " << config.root << std::endl;
 }
 
-pid_t	ProcessManager::spawnServerProcess(const ServerConfig &config)
+// Every worker serves every server block; only the first prints banners
+pid_t	ProcessManager::spawnWorker(const std::vector<ServerConfig> &configs, int index)
 {
-	pid_t	pid;
+	std::vector<ServerConfig>::const_iterator	config;
+	std::map<int, int>::const_iterator			it;
+	std::map<int, int>							ports;
+	pid_t										pid;
+	int											listenFd;
 
+	for (config = configs.begin(); config != configs.end(); ++config)
+	{
+		if (ports.count(config->port))
+			continue;
+		listenFd = listenerFor(config->port);
+		if (listenFd < 0)
+		{
+			std::cerr << "Failed to listen on port " << config->port << std::endl;
+			continue;
+		}
+		ports[config->port] = listenFd;
+		_generationPorts.insert(config->port);
+	}
+	if (ports.empty())
+		return (-1);
 	pid = fork();
 	if (pid < 0)
 		throw std::runtime_error(std::string("fork() failed: ") + std::strerror(errno));
 	if (pid == 0)
 	{
-		Server	server(config);
+		// Sockets of ports it does not serve must close with their servers
+		for (it = _listeners.begin(); it != _listeners.end(); ++it)
+		{
+			if (!ports.count(it->first))
+				close(it->second);
+		}
+		g_stopRequested = 0;
+		g_drainRequested = 0;
+		g_reloadRequested = 0;
+		g_upgradeRequested = 0;
+		Server::installSignalHandlers();
+
+		Server	server(configs, ports);
 
+		// CGI pipes are written with write(): a script that exits early
+		// must not take the server down
+		std::signal(SIGPIPE, SIG_IGN);
 		if (!server.init())
 		{
-			std::cerr << "Failed to init server on port " << config.port << std::endl;
+			std::cerr << "Failed to init worker " << index << std::endl;
 			_exit(EXIT_FAILURE);
 		}
-		printBanner(config);
+		for (config = configs.begin(); index == 0 && config != configs.end(); ++config)
+		{
+			if (ports.count(config->port))
+				printBanner(*config);
+		}
 		server.run();
-		std::cout << "Server shutdown (port " << config.port << ")" << std::endl;
+		std::cout << "Worker " << index << " shutdown" << std::endl;
 		_exit(EXIT_SUCCESS);
 	}
 	return (pid);
 }
 
-void	ProcessManager::addProcess(pid_t pid, int port, const std::string &name)
+void	ProcessManager::addProcess(pid_t pid, const std::string &name)
 {
 	ServerProcess	proc;
 
 	proc.pid = pid;
-	proc.port = port;
 	proc.name = name;
+	proc.generation = _generation;
+	proc.retiring = false;
 	_children.push_back(proc);
 }
 
-void	ProcessManager::terminateAll(void)
+void	ProcessManager::terminateAll(int sig)
 {
 	std::vector<ServerProcess>::iterator	it;
 
 	for (it = _children.begin(); it != _children.end(); ++it)
 	{
 		if (it->pid > 0)
-			kill(it->pid, SIGTERM);
+			kill(it->pid, sig);
 	}
 }
 
+void	ProcessManager::beginGeneration(void)
+{
+	++_generation;
+	_previousPorts.swap(_generationPorts);
+	_generationPorts.clear();
+}
+
+void	ProcessManager::retireOldServers(void)
+{
+	std::vector<ServerProcess>::iterator	it;
+
+	for (it = _children.begin(); it != _children.end(); ++it)
+	{
+		if (it->generation == _generation || it->retiring)
+			continue;
+		// Stops accepting now, exits when its clients are served
+		kill(it->pid, SIGQUIT);
+		it->retiring = true;
+	}
+	closeUnusedListeners();
+}
+
+void	ProcessManager::abandonGeneration(void)
+{
+	std::vector<ServerProcess>::iterator	it;
+
+	for (it = _children.begin(); it != _children.end(); ++it)
+	{
+		if (it->generation != _generation || it->retiring)
+			continue;
+		// It may already have accepted a client on a shared socket
+		kill(it->pid, SIGQUIT);
+		it->retiring = true;
+	}
+	--_generation;
+	_generationPorts.swap(_previousPorts);
+	_previousPorts.clear();
+	// Ports only the new configuration opened
+	closeUnusedListeners();
+}
+
+void	ProcessManager::closeUnusedListeners(void)
+{
+	std::map<int, int>::iterator	ls;
+
+	// The retiring servers keep their own copy until they exit
+	for (ls = _listeners.begin(); ls != _listeners.end(); )
+	{
+		if (_generationPorts.count(ls->first))
+		{
+			++ls;
+			continue;
+		}
+		std::cout << "No longer listening on port " << ls->first << std::endl;
+		close(ls->second);
+		_listeners.erase(ls++);
+	}
+}
+
+void	ProcessManager::upgradeBinary(char *const argv[])
+{
+	std::map<int, int>::const_iterator	it;
+	std::ostringstream					inherited;
+	pid_t								pid;
+
+	if (_upgradePid > 0)
+	{
+		std::cerr << "Binary upgrade already running (PID " << _upgradePid << ")" << std::endl;
+		return ;
+	}
+	for (it = _listeners.begin(); it != _listeners.end(); ++it)
+		inherited << it->first << ":" << it->second << ";";
+	pid = fork();
+	if (pid < 0)
+	{
+		std::cerr << "Binary upgrade: fork() failed: " << std::strerror(errno) << std::endl;
+		return ;
+	}
+	if (pid == 0)
+	{
+		for (it = _listeners.begin(); it != _listeners.end(); ++it)
+			fcntl(it->second, F_SETFD, 0);
+		setenv("WEBSERV_LISTENERS", inherited.str().c_str(), 1);
+		if (_supervisor)
+			_supervisor->handOver(true);
+		execv(_executable.c_str(), argv);
+		std::cerr << "Binary upgrade: " << _executable << ": " << std::strerror(errno) << std::endl;
+		_exit(EXIT_FAILURE);
+	}
+	_upgradePid = pid;
+	if (_supervisor)
+		_supervisor->handOver(false);
+	std::cout << "Started new binary as PID " << pid
+		<< "; send SIGQUIT to " << getpid() << " once it serves" << std::endl;
+}
+
+void	ProcessManager::setSupervisor(ChildSupervisor *supervisor)
+{
+	_supervisor = supervisor;
+}
+
 bool	ProcessManager::hasChildren(void) const
 {
 	return (!_children.empty());
@@ -87,26 +306,33 @@ void	ProcessManager::handleChildExit(pid_t pid, int status)
 {
 	std::vector<ServerProcess>::iterator	it;
 
+	if (pid == _upgradePid)
+	{
+		// It only exits early when it could not start
+		std::cerr << "New binary (PID " << pid << ") exited, upgrade abandoned" << std::endl;
+		_upgradePid = -1;
+		return ;
+	}
 	for (it = _children.begin(); it != _children.end(); ++it)
 	{
 		if (it->pid != pid)
 			continue;
 		if (WIFEXITED(status))
 		{
-			std::cout << "Server PID " << pid << " (" << it->name << ":"
-				<< it->port << ") exited with status "
+			std::cout << "Server PID " << pid << " (" << it->name
+				<< ") exited with status "
 				<< WEXITSTATUS(status) << std::endl;
 		}
 		else if (WIFSIGNALED(status))
 		{
-			std::cout << "Server PID " << pid << " (" << it->name << ":"
-				<< it->port << ") terminated by signal "
+			std::cout << "Server PID " << pid << " (" << it->name
+				<< ") terminated by signal "
 				<< WTERMSIG(status) << std::endl;
 		}
 		else
 		{
-			std::cout << "Server PID " << pid << " (" << it->name << ":"
-				<< it->port << ") stopped" << std::endl;
+			std::cout << "Server PID " << pid << " (" << it->name
+				<< ") stopped" << std::endl;
 		}
 		_children.erase(it);
 		return ;
@@ -115,21 +341,35 @@ void	ProcessManager::handleChildExit(pid_t pid, int status)
 
 void	ProcessManager::monitorChildren(void)
 {
-	bool	termBroadcast;
+	int		sent;
+	int		wanted;
 	int		status;
 	pid_t	pid;
 
-	termBroadcast = false;
+	sent = 0;
 	while (!_children.empty())
 	{
-		if (g_stopRequested && !termBroadcast)
+		wanted = g_drainRequested ? SIGTERM : SIGINT;
+		if (g_stopRequested && sent != SIGINT && sent != wanted)
 		{
-			std::cout << "\nTermination requested, stopping servers..." << std::endl;
-			terminateAll();
-			termBroadcast = true;
+			sent = wanted;
+			if (sent == SIGTERM)
+				std::cout << "\nGraceful stop requested, draining servers..." << std::endl;
+			else
+				std::cout << "\nTermination requested, stopping servers..." << std::endl;
+			terminateAll(sent);
 		}
+		if (!g_stopRequested && (g_reloadRequested || g_upgradeRequested))
+			return ;
 		status = 0;
-		pid = waitpid(-1, &status, 0);
+		// With a supervisor the loop also wakes up to let it tick
+		pid = waitpid(-1, &status, _supervisor ? WNOHANG : 0);
+		if (pid == 0)
+		{
+			_supervisor->tick();
+			usleep(100000);
+			continue;
+		}
 		if (pid < 0)
 		{
 			if (errno == EINTR)
@@ -137,6 +377,8 @@ void	ProcessManager::monitorChildren(void)
 			perror("waitpid");
 			break;
 		}
+		if (_supervisor && _supervisor->childExited(pid, status))
+			continue;
 		handleChildExit(pid, status);
 	}
 }
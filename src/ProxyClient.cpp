@@ -0,0 +1,745 @@
+#include "ProxyClient.hpp"
+#include "CgiOutput.hpp"
+#include "FastCgiEndpoint.hpp"
+#include "ProxyPool.hpp"
+
+#include <cctype>
+#include <sstream>
+
+namespace {
+
+// Reply buffered for a slow client before the upstream stops being read
+const size_t kHighWater = 256u * 1024u;
+// The upstream must finish its header block within this many bytes
+const size_t kMaxHeaderBlock = 64u * 1024u;
+// Request body waiting for the upstream before the client is paused
+const size_t kBodyWindow = 256u * 1024u;
+const size_t kReadSize = 64u * 1024u;
+// Longest chunk-size or trailer line accepted
+const size_t kMaxChunkLine = 4096u;
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+enum ChunkState
+{
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_DATA_END, // CRLF after the data
+    CHUNK_TRAILER
+};
+
+std::string lower(std::string s)
+{
+    for (size_t i = 0; i < s.size(); ++i)
+        s[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(s[i])));
+    return s;
+}
+
+std::string strip(const std::string &s)
+{
+    const std::string::size_type first = s.find_first_not_of(" \t\r");
+    if (first == std::string::npos)
+        return "";
+    return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+}
+
+// Lowercased tokens of a comma-separated header value
+std::vector<std::string> tokens(const std::string &value)
+{
+    std::vector<std::string> out;
+    std::istringstream iss(value);
+    std::string token;
+    while (std::getline(iss, token, ','))
+    {
+        token = lower(strip(token));
+        if (!token.empty())
+            out.push_back(token);
+    }
+    return out;
+}
+
+bool contains(const std::vector<std::string> &list, const std::string &name)
+{
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        if (list[i] == name)
+            return true;
+    }
+    return false;
+}
+
+// RFC 7230 6.1: meaningful for a single connection only, never forwarded
+bool isHopByHop(const std::string &name)
+{
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+        || name == "te" || name == "trailer" || name == "transfer-encoding"
+        || name == "upgrade" || name == "proxy-authorization" || name == "proxy-authenticate";
+}
+
+bool parseLength(const std::string &value, size_t &out)
+{
+    if (value.empty() || value.size() > 18)
+        return false;
+    out = 0;
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        if (value[i] < '0' || value[i] > '9')
+            return false;
+        out = out * 10 + static_cast<size_t>(value[i] - '0');
+    }
+    return true;
+}
+
+std::string peerAddress(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    char ip[INET_ADDRSTRLEN];
+
+    if (getpeername(fd, reinterpret_cast<struct sockaddr *>(&addr), &len) != 0
+        || addr.sin_family != AF_INET
+        || !inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip)))
+        return "unknown";
+    return ip;
+}
+
+} // namespace
+
+ProxyClient::ProxyClient(const HttpRequest &request, const LocationConfig &location_config)
+    : location(location_config)
+    , method(request.getMethod())
+    , version(request.getHttpVersion())
+    , request_head()
+    , forwarded_for()
+    , body(request.getBody())
+    , body_streamed(request.isBodyStreamed())
+    , context()
+    , client_fd(-1)
+    , fd(-1)
+    , watch(0)
+    , connecting(false)
+    , reused(false)
+    , retried(false)
+    , idempotent(false)
+    , deadline(0)
+    , output()
+    , output_offset(0)
+    , output_last(false)
+    , client_paused(false)
+    , raw()
+    , got_reply(false)
+    , framing(BODY_NONE)
+    , remaining(0)
+    , chunk_state(CHUNK_SIZE)
+    , keepalive(false)
+    , head()
+    , pending()
+    , head_ready(false)
+    , head_sent(false)
+    , want_chunked(false)
+    , paused(false)
+    , done(false)
+    , failed(false)
+{
+    if (version != "HTTP/1.0" && version != "HTTP/1.1")
+        version = "HTTP/1.1";
+    request_head = buildRequestHead(request);
+    idempotent = method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS";
+}
+
+ProxyClient::~ProxyClient()
+{
+    closeUpstream();
+    if (context.proxy)
+        context.proxy->untrack(this);
+}
+
+// Request line and end-to-end headers; the blank line is added on attach
+std::string ProxyClient::buildRequestHead(const HttpRequest &request)
+{
+    const std::map<std::string, std::string> &headers = request.getHeaders();
+    std::vector<std::string> listed; // extra hop-by-hop names from Connection
+    std::string length;
+
+    for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it)
+    {
+        const std::string name = lower(it->first);
+        if (name == "connection")
+            listed = tokens(it->second);
+        else if (name == "content-length")
+            length = strip(it->second);
+    }
+
+    std::string uri = request.getUri();
+    if (!location.proxy_uri.empty() && uri.size() >= location.location.size())
+        uri = location.proxy_uri + uri.substr(location.location.size());
+
+    std::ostringstream out;
+    out << method << " " << uri << " HTTP/1.1\r\n";
+    out << "Host: " << location.proxy_host << "\r\n";
+    for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it)
+    {
+        const std::string name = lower(it->first);
+        if (isHopByHop(name) || contains(listed, name) || name == "host" || name == "expect"
+            || name == "content-length" || name == "x-forwarded-proto")
+            continue;
+        if (name == "x-forwarded-for")
+        {
+            forwarded_for = strip(it->second);
+            continue;
+        }
+        out << it->first << ": " << it->second << "\r\n";
+    }
+    // A streamed body is announced with the client's length, the rest of it is still on its way
+    if (body_streamed)
+        out << "Content-Length: " << length << "\r\n";
+    else if (!body.empty() || !length.empty())
+        out << "Content-Length: " << body.size() << "\r\n";
+    out << "X-Forwarded-Proto: http\r\n";
+    out << "Connection: " << (location.proxy_keepalive ? "keep-alive" : "close") << "\r\n";
+    return out.str();
+}
+
+void ProxyClient::attach(const StreamContext &ctx, int client)
+{
+    context = ctx;
+    client_fd = client;
+    context.proxy->track(this);
+
+    const std::string peer = peerAddress(client_fd);
+    request_head += "X-Forwarded-For: " + (forwarded_for.empty() ? peer : forwarded_for + ", " + peer) + "\r\n\r\n";
+    output = request_head + body;
+    output_last = !body_streamed;
+    if (body_streamed)
+        std::string().swap(body);
+
+    // A streamed body cannot be replayed, so it never risks a stale kept socket
+    connectUpstream(!body_streamed);
+}
+
+void ProxyClient::connectUpstream(bool allow_reuse)
+{
+    const time_t now = std::time(NULL);
+
+    fd = allow_reuse ? context.proxy->take(location.proxy_pass) : -1;
+    reused = (fd >= 0);
+    connecting = false;
+    if (!reused)
+    {
+        FastCgiEndpoint target;
+        if (!FastCgiEndpoint::parse(location.proxy_pass, target)
+            || (fd = target.connectSocket(true)) < 0)
+        {
+            fd = -1;
+            return fail(502, "Bad Gateway", "Cannot connect to upstream");
+        }
+        connecting = true;
+    }
+    deadline = now + (connecting ? location.proxy_connect_timeout : location.proxy_read_timeout);
+    updateInterest();
+}
+
+bool ProxyClient::feedBody(const char *data, size_t len, bool last)
+{
+    if (done)
+        return true; // the reply came first: the rest of the body is not wanted
+    output.append(data, len);
+    output_last = last;
+    if (fd >= 0 && !connecting)
+    {
+        deadline = std::time(NULL) + location.proxy_read_timeout;
+        updateInterest();
+    }
+    if (last || output.size() - output_offset < kBodyWindow)
+        return true;
+    // Hold the client until the upstream catches up
+    client_paused = true;
+    return false;
+}
+
+void ProxyClient::handleIo(int ready_fd, unsigned int events)
+{
+    if (ready_fd != fd)
+        return;
+
+    if (connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            return fail(502, "Bad Gateway", "Cannot connect to upstream");
+        connecting = false;
+        deadline = std::time(NULL) + location.proxy_read_timeout;
+    }
+    if (events & IO_WRITE)
+    {
+        writeUpstream();
+        if (fd != ready_fd || connecting || done)
+            return; // failed over to a new socket, or over
+    }
+    if (events & (IO_READ | IO_HUP | IO_ERROR))
+        readUpstream();
+}
+
+void ProxyClient::writeUpstream()
+{
+    while (output_offset < output.size())
+    {
+        const ssize_t n = send(fd, output.data() + output_offset, output.size() - output_offset, kSendFlags);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0)
+            return fail(502, "Bad Gateway", "Upstream closed the connection");
+        output_offset += static_cast<size_t>(n);
+        deadline = std::time(NULL) + location.proxy_read_timeout;
+    }
+    if (output_offset == output.size())
+    {
+        output.clear();
+        output_offset = 0;
+    }
+    if (client_paused && output.size() - output_offset < kBodyWindow)
+    {
+        client_paused = false;
+        wake();
+    }
+    updateInterest();
+}
+
+void ProxyClient::readUpstream()
+{
+    char buf[kReadSize];
+
+    while (fd >= 0 && !connecting && !paused && !done)
+    {
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0)
+            return fail(502, "Bad Gateway", "Upstream connection failed");
+        if (n == 0)
+        {
+            if (head_ready && framing == BODY_CLOSE)
+            {
+                keepalive = false;
+                return complete();
+            }
+            return fail(502, "Bad Gateway", "Upstream closed the connection");
+        }
+        got_reply = true;
+        deadline = std::time(NULL) + location.proxy_read_timeout;
+        if (head_ready)
+        {
+            decodeBody(buf, static_cast<size_t>(n));
+            continue;
+        }
+        raw.append(buf, static_cast<size_t>(n));
+        if (!parseHead())
+            return;
+    }
+}
+
+// Status line and headers of the final reply, once the blank line is in;
+// false when the request is over
+bool ProxyClient::parseHead()
+{
+    std::string block;
+    std::string protocol;
+    int code = 0;
+    std::string reason;
+
+    while (true)
+    {
+        const std::string::size_type end = raw.find("\r\n\r\n");
+        if (end == std::string::npos)
+        {
+            if (raw.size() <= kMaxHeaderBlock)
+                return true;
+            fail(502, "Bad Gateway", "Upstream header block too large");
+            return false;
+        }
+        block = raw.substr(0, end + 2);
+        raw.erase(0, end + 4);
+
+        std::istringstream status(block.substr(0, block.find("\r\n")));
+        status >> protocol >> code;
+        std::getline(status, reason);
+        reason = strip(reason);
+        if (!status.eof() && !status.good())
+            code = 0;
+        if (protocol.compare(0, 5, "HTTP/") != 0 || code < 100 || code > 999 || code == 101)
+        {
+            fail(502, "Bad Gateway", "Invalid upstream response");
+            return false;
+        }
+        if (code >= 200)
+            break;
+        // Interim replies (100 Continue, 103) are not relayed
+    }
+
+    std::vector<std::pair<std::string, std::string> > fields;
+    std::vector<std::string> listed;
+    bool chunked = false;
+    bool has_length = false;
+    size_t length = 0;
+
+    std::string::size_type pos = block.find("\r\n") + 2;
+    while (pos < block.size())
+    {
+        const std::string::size_type eol = block.find("\r\n", pos);
+        const std::string line = block.substr(pos, eol - pos);
+        pos = eol + 2;
+        const std::string::size_type colon = line.find(':');
+        if (colon == std::string::npos || colon == 0)
+            continue;
+        const std::string name = line.substr(0, colon);
+        const std::string value = strip(line.substr(colon + 1));
+        const std::string key = lower(name);
+        if (key == "connection")
+            listed = tokens(value);
+        else if (key == "transfer-encoding")
+            chunked = contains(tokens(value), "chunked");
+        else if (key == "content-length")
+        {
+            if (!parseLength(value, length))
+            {
+                fail(502, "Bad Gateway", "Invalid upstream Content-Length");
+                return false;
+            }
+            has_length = true;
+        }
+        fields.push_back(std::make_pair(name, value));
+    }
+
+    keepalive = (protocol == "HTTP/1.1") ? !contains(listed, "close") : contains(listed, "keep-alive");
+    if (method == "HEAD" || code == 204 || code == 304)
+        framing = BODY_NONE;
+    else if (chunked)
+        framing = BODY_CHUNKED;
+    else if (has_length)
+        framing = BODY_LENGTH;
+    else
+        framing = BODY_CLOSE;
+    remaining = length;
+
+    std::ostringstream resp;
+    resp << version << " " << code << (reason.empty() ? "" : " ") << reason << "\r\n";
+    for (size_t i = 0; i < fields.size(); ++i)
+    {
+        const std::string key = lower(fields[i].first);
+        if (isHopByHop(key) || contains(listed, key) || (key == "content-length" && framing != BODY_LENGTH && framing != BODY_NONE))
+            continue;
+        resp << fields[i].first << ": " << fields[i].second << "\r\n";
+    }
+    // Length unknown to the client: chunk on HTTP/1.1, else the close ends the body
+    if ((framing == BODY_CHUNKED || framing == BODY_CLOSE) && version == "HTTP/1.1")
+    {
+        resp << "Transfer-Encoding: chunked\r\n";
+        want_chunked = true;
+    }
+    resp << "Connection: close\r\n\r\n";
+    head = resp.str();
+    head_ready = true;
+    wake();
+
+    if (framing == BODY_NONE || (framing == BODY_LENGTH && remaining == 0))
+    {
+        if (!raw.empty())
+            keepalive = false;
+        complete();
+        return false;
+    }
+    std::string rest;
+    rest.swap(raw);
+    if (!rest.empty())
+        decodeBody(rest.data(), rest.size());
+    return !done;
+}
+
+void ProxyClient::decodeBody(const char *data, size_t len)
+{
+    if (framing == BODY_LENGTH)
+    {
+        const size_t take = (len < remaining) ? len : remaining;
+        pending.append(data, take);
+        remaining -= take;
+        if (take < len)
+            keepalive = false; // bytes past the reply: the socket is out of step
+        if (remaining == 0)
+            return complete();
+    }
+    else if (framing == BODY_CHUNKED)
+    {
+        raw.append(data, len);
+        if (!decodeChunked())
+            return;
+    }
+    else
+        pending.append(data, len);
+
+    if (done)
+        return;
+    if (pending.size() >= kHighWater)
+    {
+        paused = true;
+        updateInterest();
+    }
+    if (!pending.empty())
+        wake();
+}
+
+// Moves whole chunks from raw to pending; false once the request is over
+bool ProxyClient::decodeChunked()
+{
+    while (!done)
+    {
+        if (chunk_state == CHUNK_DATA)
+        {
+            if (raw.empty())
+                return true;
+            const size_t take = (raw.size() < remaining) ? raw.size() : remaining;
+            pending.append(raw, 0, take);
+            raw.erase(0, take);
+            remaining -= take;
+            if (remaining == 0)
+                chunk_state = CHUNK_DATA_END;
+            continue;
+        }
+
+        const std::string::size_type eol = raw.find("\r\n");
+        if (eol == std::string::npos)
+        {
+            if (raw.size() <= kMaxChunkLine)
+                return true;
+            fail(502, "Bad Gateway", "Invalid upstream chunk");
+            return false;
+        }
+        const std::string line = raw.substr(0, eol);
+        raw.erase(0, eol + 2);
+
+        if (chunk_state == CHUNK_DATA_END)
+        {
+            if (!line.empty())
+            {
+                fail(502, "Bad Gateway", "Invalid upstream chunk");
+                return false;
+            }
+            chunk_state = CHUNK_SIZE;
+        }
+        else if (chunk_state == CHUNK_TRAILER)
+        {
+            if (!line.empty())
+                continue; // trailers are dropped
+            if (!raw.empty())
+                keepalive = false;
+            complete();
+        }
+        else
+        {
+            size_t size = 0;
+            size_t digits = 0;
+            for (; digits < line.size() && std::isxdigit(static_cast<unsigned char>(line[digits])); ++digits)
+            {
+                if (size > (static_cast<size_t>(-1) >> 4))
+                    break;
+                const char c = static_cast<char>(std::tolower(static_cast<unsigned char>(line[digits])));
+                size = size * 16 + static_cast<size_t>(c <= '9' ? c - '0' : c - 'a' + 10);
+            }
+            if (digits == 0 || (digits < line.size() && line[digits] != ';' && line[digits] != ' ' && line[digits] != '\t'))
+            {
+                fail(502, "Bad Gateway", "Invalid upstream chunk");
+                return false;
+            }
+            remaining = size;
+            chunk_state = size ? CHUNK_DATA : CHUNK_TRAILER;
+        }
+    }
+    return false;
+}
+
+// The reply was read to its end: the socket goes back to the pool when the
+// upstream and our side of the exchange both allow it
+void ProxyClient::complete()
+{
+    done = true;
+    deadline = 0;
+    if (fd >= 0)
+    {
+        const bool reusable = keepalive && location.proxy_keepalive > 0
+            && output_last && output_offset == output.size();
+        if (reusable)
+        {
+            const int socket = fd;
+            if (watch)
+                context.loop->remove(fd);
+            watch = 0;
+            fd = -1;
+            context.proxy->give(location.proxy_pass, socket, location.proxy_keepalive,
+                                location.proxy_keepalive_timeout);
+        }
+        else
+            closeUpstream();
+    }
+    std::string().swap(output);
+    output_offset = 0;
+    wake();
+}
+
+// A socket taken from the pool may have been closed by the upstream just
+// before our request reached it: an idempotent request is sent again once,
+// on a new connection, while nothing of the reply was read. Others may
+// have been acted on and get the 502.
+bool ProxyClient::retry()
+{
+    if (!idempotent || !reused || retried || got_reply || body_streamed)
+        return false;
+    retried = true;
+    closeUpstream();
+    output = request_head + body;
+    output_offset = 0;
+    connectUpstream(false);
+    return true;
+}
+
+void ProxyClient::fail(int code, const std::string &reason, const std::string &detail)
+{
+    if (retry())
+        return;
+    closeUpstream();
+    if (head_ready)
+    {
+        // The client already has part of the reply: cut it short
+        failed = true;
+        done = true;
+        wake();
+        return;
+    }
+    std::cerr << "proxy_pass " << location.proxy_host << ": " << detail << std::endl;
+    std::ostringstream html;
+    html << "<html><body><h1>" << code << " " << reason << "</h1><p>" << detail << "</p></body></html>";
+    finish(cgi_output::buildError(version, code, reason, html.str()));
+}
+
+void ProxyClient::expire(time_t now)
+{
+    if (done || !deadline || now < deadline)
+        return;
+    // A silent upstream is not given a second chance on another socket
+    retried = true;
+    if (connecting)
+        fail(504, "Gateway Timeout", "Upstream connect timed out");
+    else
+        fail(504, "Gateway Timeout", "Upstream timed out");
+}
+
+void ProxyClient::closeUpstream()
+{
+    if (fd < 0)
+        return;
+    if (watch)
+        context.loop->remove(fd);
+    watch = 0;
+    close(fd);
+    fd = -1;
+    connecting = false;
+    deadline = 0;
+}
+
+// Writes while request bytes wait, reads unless the client is behind.
+// While nothing is expected either way no timer runs.
+void ProxyClient::updateInterest()
+{
+    if (fd < 0)
+        return;
+
+    unsigned int want = 0;
+    if (connecting || output_offset < output.size())
+        want |= IO_WRITE;
+    if (!connecting && !paused && !done)
+        want |= IO_READ;
+
+    if (!connecting)
+    {
+        if (paused && !(want & IO_WRITE))
+            deadline = 0;
+        else if (!deadline)
+            deadline = std::time(NULL) + location.proxy_read_timeout;
+    }
+    if (want == watch)
+        return;
+
+    bool ok = true;
+    if (!want)
+        context.loop->remove(fd);
+    else if (!watch)
+        ok = context.loop->add(fd, want, this);
+    else
+        ok = context.loop->modify(fd, want);
+    watch = ok ? want : 0;
+    if (!ok)
+        fail(502, "Bad Gateway", "Cannot watch upstream socket");
+}
+
+// Whole response known up front; the upstream is no longer wanted
+void ProxyClient::finish(const std::string &response)
+{
+    closeUpstream();
+    head = response;
+    pending.clear();
+    want_chunked = false;
+    head_ready = true;
+    done = true;
+    wake();
+}
+
+void ProxyClient::wake()
+{
+    if (context.waker)
+        context.waker->wake(client_fd);
+}
+
+bool ProxyClient::awaitingUpstream() const
+{
+    return fd >= 0 && !paused && !done;
+}
+
+ResponseStream::Status ProxyClient::pull(std::string &out)
+{
+    if (!head_ready)
+        return STREAM_AGAIN;
+
+    if (!head_sent)
+    {
+        // The head goes out alone when chunking, so it is never framed
+        head_sent = true;
+        out.swap(head);
+        std::string().swap(head);
+        if (want_chunked)
+            return STREAM_DATA;
+        out += pending;
+        pending.clear();
+        return (done && !failed) ? STREAM_END : STREAM_DATA;
+    }
+
+    setChunked(want_chunked);
+    if (failed && pending.empty())
+        return STREAM_ERROR;
+    out.swap(pending);
+    pending.clear();
+    if (paused)
+    {
+        paused = false;
+        updateInterest();
+    }
+    if (done && !failed)
+        return STREAM_END;
+    return out.empty() ? STREAM_AGAIN : STREAM_DATA;
+}
@@ -0,0 +1,106 @@
+#include "ProxyPool.hpp"
+#include "ProxyClient.hpp"
+
+#include <algorithm>
+#include <unistd.h>
+
+ProxyPool::ProxyPool(EventLoop &event_loop)
+    : loop(event_loop)
+    , idle()
+    , targets()
+    , clients()
+{
+}
+
+ProxyPool::~ProxyPool()
+{
+    for (std::map<int, std::string>::iterator it = targets.begin(); it != targets.end(); ++it)
+    {
+        loop.remove(it->first);
+        close(it->first);
+    }
+}
+
+int ProxyPool::take(const std::string &target)
+{
+    std::map<std::string, std::vector<Idle> >::iterator it = idle.find(target);
+    if (it == idle.end() || it->second.empty())
+        return -1;
+
+    const int fd = it->second.back().fd;
+    it->second.pop_back();
+    targets.erase(fd);
+    loop.remove(fd);
+    return fd;
+}
+
+void ProxyPool::give(const std::string &target, int fd, size_t max_idle, int idle_timeout)
+{
+    std::vector<Idle> &sockets = idle[target];
+
+    if (sockets.size() >= max_idle || !loop.add(fd, IO_READ, this))
+    {
+        close(fd);
+        return;
+    }
+    Idle entry;
+    entry.fd = fd;
+    entry.expires = std::time(NULL) + idle_timeout;
+    sockets.push_back(entry);
+    targets[fd] = target;
+}
+
+void ProxyPool::track(ProxyClient *client)
+{
+    clients.push_back(client);
+}
+
+void ProxyPool::untrack(ProxyClient *client)
+{
+    std::vector<ProxyClient *>::iterator it = std::find(clients.begin(), clients.end(), client);
+    if (it != clients.end())
+        clients.erase(it);
+}
+
+void ProxyPool::drop(const std::string &target, size_t index)
+{
+    std::vector<Idle> &sockets = idle[target];
+    const int fd = sockets[index].fd;
+
+    sockets.erase(sockets.begin() + index);
+    targets.erase(fd);
+    loop.remove(fd);
+    close(fd);
+}
+
+void ProxyPool::reap()
+{
+    const time_t now = std::time(NULL);
+
+    for (std::map<std::string, std::vector<Idle> >::iterator it = idle.begin(); it != idle.end(); ++it)
+    {
+        // Oldest first: stop at the first socket still within its timeout
+        while (!it->second.empty() && it->second.front().expires <= now)
+            drop(it->first, 0);
+    }
+    // expire() may finish a request but never deletes it
+    const std::vector<ProxyClient *> running(clients);
+    for (size_t i = 0; i < running.size(); ++i)
+        running[i]->expire(now);
+}
+
+void ProxyPool::handleIo(int fd, unsigned int events)
+{
+    (void)events;
+    std::map<int, std::string>::iterator it = targets.find(fd);
+    if (it == targets.end())
+        return;
+
+    const std::string target = it->second;
+    std::vector<Idle> &sockets = idle[target];
+    for (size_t i = 0; i < sockets.size(); ++i)
+    {
+        if (sockets[i].fd == fd)
+            return drop(target, i);
+    }
+}
@@ -2,23 +2,60 @@
 #include "Server.hpp"
 #include "macros.hpp"
 
+#include <cerrno>
+#include <csignal>
 #include <cstring>
+#include <ctime>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
+
+namespace {
+
+#ifdef __linux__
+sigset_t stopSignals()
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGQUIT);
+    return set;
+}
+#else
+// Without signalfd the handler leaves the signal for run() to pick up;
+// SIGINT wins over a pending graceful stop
+volatile std::sig_atomic_t g_pending = 0;
 
-Server::Server(const ServerConfig & config)
-    : config(config)
-    , clients(config)
-    , address()
-    , server_fd(-1)
+void onStopSignal(int sig)
+{
+    if (sig == SIGINT || !g_pending)
+        g_pending = sig;
+}
+#endif
+
+} // namespace
+
+Server::Server(const std::vector<ServerConfig> &servers, const std::map<int, int> &listeners)
+    : servers(servers)
+    , vhosts(this->servers)
+    , loop()
+    , clients(vhosts, loop)
+    , listeners()
+    , signal_fd(-1)
+    , shutdown_timeout(0)
+    , shutdown_deadline(0)
     , is_running(false)
     , is_init(false)
 {
-    std::memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = inet_addr("127.0.0.1"); // localhost
-    address.sin_port = htons(config.port);
-#ifdef __linux__
-    epoll_fd = -1;
-#endif
+    for (std::map<int, int>::const_iterator it = listeners.begin(); it != listeners.end(); ++it)
+        this->listeners[it->second] = it->first;
+    for (size_t i = 0; i < servers.size(); ++i)
+    {
+        if (servers[i].shutdown_timeout > shutdown_timeout)
+            shutdown_timeout = servers[i].shutdown_timeout;
+    }
 }
 
 Server::~Server()
@@ -26,83 +63,93 @@ Server::~Server()
     cleanup();
 }
 
-bool Server::init()
+int Server::openListener(int port)
 {
-    if (is_init)
-        return (true);
-    
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1)
+    sockaddr_in address;
+
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr("127.0.0.1"); // localhost
+    address.sin_port = htons(port);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
     {
         perror("socket creation failed");
-        return (false);
+        return (-1);
     }
 
     // Add SO_REUSEADDR to prevent "Address already in use" errors
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         perror("setsockopt failed");
-        close(server_fd);
-        return false;
+        close(fd);
+        return (-1);
     }
 
-    if (::bind(server_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
         perror("bind");
-        close(server_fd);
-        return (false);
+        close(fd);
+        return (-1);
     }
 
     // 128 backlog queue (pending clients) , not MAX_CLIENTS of concurrent clients
-    if (listen(server_fd, 128) == -1) {
+    if (listen(fd, 128) == -1) {
         perror("listen");
-        close(server_fd);
-        return (false);
-    } 
+        close(fd);
+        return (-1);
+    }
+    // Old and new workers share it for a moment during a reload: whoever
+    // loses the race for a connection must not block in accept()
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return (fd);
+}
+
+void Server::installSignalHandlers()
+{
 #ifdef __linux__
-    // Create epoll instance and register server fd on Linux
-    epoll_fd = epoll_create(1);
-    if (epoll_fd < 0) {
-        std::cerr << "epoll_create failed" << std::endl;
-        close(server_fd);
-        return false;
+    // Queued until init() opens the signalfd that reads them
+    const sigset_t set = stopSignals();
+    sigprocmask(SIG_BLOCK, &set, NULL);
+#else
+    std::signal(SIGINT, onStopSignal);
+    std::signal(SIGTERM, onStopSignal);
+    std::signal(SIGQUIT, onStopSignal);
+#endif
+    // Meant for the master
+    std::signal(SIGHUP, SIG_IGN);
+    std::signal(SIGUSR2, SIG_IGN);
+}
+
+bool Server::init()
+{
+    if (is_init)
+        return (true);
+    if (listeners.empty() || !loop.init())
+        return (false);
+    for (std::map<int, int>::const_iterator it = listeners.begin(); it != listeners.end(); ++it)
+    {
+        if (!loop.add(it->first, IO_READ, this)) {
+            std::cerr << "event loop setup failed" << std::endl;
+            return false;
+        }
     }
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = server_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
-        std::cerr << "epoll_ctl ADD server_fd failed" << std::endl;
-        close(epoll_fd);
-        epoll_fd = -1;
-        close(server_fd);
+#ifdef __linux__
+    const sigset_t set = stopSignals();
+    signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1 || !loop.add(signal_fd, IO_READ, this)) {
+        perror("signalfd");
         return false;
     }
 #endif
     is_init = true;
-    std::cout << "Server listening on port " << config.port << "...\n";
+    std::cout << "Worker " << getpid() << " serving " << servers.size() << " server(s) on "
+              << listeners.size() << " port(s)...\n";
     return (true);
 }
 
 
-void Server::buildPollFds()
-{
-    poll_fds.clear();
-    struct pollfd pfd;
-    pfd.fd = server_fd;
-    pfd.events = POLLIN; // watch for incoming connections
-    pfd.revents = 0;
-    poll_fds.push_back(pfd);
-
-    // add client sockets
-    for (std::map<int, Client>::const_iterator it = clients.clientsBegin(); it != clients.clientsEnd(); ++it)
-    {
-        struct pollfd cfd;
-        cfd.fd = it->first;
-        cfd.events = POLLIN; // only read for now
-        cfd.revents = 0;
-        poll_fds.push_back(cfd);
-    }
-}
-
 void Server::run() {
     if (!is_init)
     {
@@ -111,170 +158,132 @@ void Server::run() {
     }
     is_running = true;
 
-#ifdef __APPLE__
     while (is_running)
     {
-        buildPollFds();
-
-        // If no fds to poll, sleep briefly and continue
-        if (poll_fds.empty()) {
-            usleep(10000); // 10ms
-            continue;
-        }
-
-        // poll timeout in milliseconds (5s)
-        int ret = poll(&poll_fds[0], poll_fds.size(), 5000);
-        if (ret < 0)
+        // wait timeout in milliseconds (1s): bounds how late client and
+        // upstream timers fire
+        int n = loop.dispatch(1000);
+        if (n < 0 && errno != EINTR)
         {
-            std::cerr << "poll failed" << std::endl;
+            std::cerr << "epoll_wait failed" << std::endl;
             break;
         }
-        if (ret == 0)
+#ifndef __linux__
+        if (g_pending)
         {
-            // timeout: still do timeout checks
-            clients.checkTimeouts();
-            continue;
+            const int sig = g_pending;
+            g_pending = 0;
+            handleSignal(sig);
         }
-        processReadyFds();
-    }
 #endif
-#ifdef __linux__
-    while (is_running)
-    {
-        // epoll timeout in milliseconds (5s)
-        const int MAX_EVENTS = 1024;
-        struct epoll_event events[MAX_EVENTS];
-        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 5000);
-        if (n < 0)
-        {
-            std::cerr << "epoll_wait failed" << std::endl;
+        clients.checkTimeouts();
+        if (!listeners.empty() || !is_running)
+            continue;
+        // Draining: done once the last in-flight client is gone
+        if (clients.getClientCount() == 0)
             break;
-        }
-        if (n == 0)
+        if (std::time(NULL) >= shutdown_deadline)
         {
-            clients.checkTimeouts();
-            continue;
+            std::cerr << "shutdown_timeout reached, dropping " << clients.getClientCount()
+                      << " client(s)" << std::endl;
+            break;
         }
+    }
+    std::cout << "Worker " << getpid() << " stopped" << std::endl;
+}
 
-        std::vector<int> readable;
-        for (int i = 0; i < n; ++i)
-        {
-            int fd = events[i].data.fd;
-            uint32_t ev = events[i].events;
-            if (fd == server_fd && (ev & EPOLLIN))
-            {
-                // Accept a single new connection per readiness indication
-                handleNewConnection();
-                continue;
-            }
-            if (ev & (EPOLLERR | EPOLLHUP))
-            {
-                clients.removeClient(fd);
-                continue;
-            }
-            if (ev & EPOLLIN)
-            {
-                readable.push_back(fd);
-            }
-        }
-        if (!readable.empty())
-            clients.processClientRequestPoll(readable);
-        clients.checkTimeouts();
+void Server::handleIo(int fd, unsigned int events)
+{
+    std::map<int, int>::const_iterator listener = listeners.find(fd);
+    if (listener != listeners.end() && (events & IO_READ))
+    {
+        // Accept a single new connection per readiness indication
+        handleNewConnection(fd, listener->second);
+    }
+#ifdef __linux__
+    else if (fd == signal_fd && (events & IO_READ))
+    {
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info)))
+            handleSignal(static_cast<int>(info.ssi_signo));
     }
 #endif
-    std::cout << "Server stopped : " << config.server_name << std::endl;
 }
 
-bool Server::handleNewConnection()
+// SIGINT stops at once; SIGTERM and SIGQUIT stop accepting and give the
+// clients already in shutdown_timeout seconds to be served
+void Server::handleSignal(int sig)
 {
-    if (!is_running || server_fd == -1)
+    if (sig == SIGINT)
+    {
+        is_running = false;
+        return;
+    }
+    if (listeners.empty())
+        return;
+    shutdown_deadline = std::time(NULL) + shutdown_timeout;
+    stopAccepting();
+}
+
+bool Server::handleNewConnection(int listen_fd, int port)
+{
+    if (!is_running)
         return (false);
     
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
 
-    int new_socket = accept(server_fd, (struct sockaddr*) &client_addr, &client_len);
+    int new_socket = accept(listen_fd, (struct sockaddr*) &client_addr, &client_len);
     if (new_socket < 0)
     {
+        // Another worker sharing the listener took it
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return (false);
         perror("accept");
         return (false);
     }
     printf("New connection: socket fd is %d, IP is %s, port %d\n",
            new_socket, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
     
-    if (!clients.addClient(new_socket, client_addr))
+    if (!clients.addClient(new_socket, client_addr, port))
     {
         std::cerr << "Failed to add client - server full" << std::endl;
         close(new_socket);
         return (false);
     }
-#ifdef __linux__
-    // register new client socket with epoll
-    if (epoll_fd >= 0) {
-        struct epoll_event ev;
-        ev.events = EPOLLIN;
-        ev.data.fd = new_socket;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_socket, &ev) < 0) {
-            std::cerr << "epoll_ctl ADD client failed" << std::endl;
-            // We still keep the client; read loop will likely fail and clean up
-        }
-    }
-#endif
     return (true); 
 }
 
-void Server::processReadyFds()
+void Server::stopAccepting()
 {
-    // index 0 is server fd
-    if (poll_fds.empty())
-        return;
-    if (poll_fds[0].revents & POLLIN)
+    std::cout << "Draining " << clients.getClientCount() << " client(s) in worker "
+              << getpid() << std::endl;
+    for (std::map<int, int>::const_iterator it = listeners.begin(); it != listeners.end(); ++it)
     {
-        handleNewConnection();
+        loop.remove(it->first);
+        close(it->first);
     }
-    // collect readable client fds
-    std::vector<int> readable;
-    for (size_t i = 1; i < poll_fds.size(); ++i)
-    {
-        if (poll_fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
-        {
-            clients.removeClient(poll_fds[i].fd);
-            continue;
-        }
-        if (poll_fds[i].revents & POLLIN)
-            readable.push_back(poll_fds[i].fd);
-    }
-    if (!readable.empty())
-        clients.processClientRequestPoll(readable); // new API
-    clients.checkTimeouts();
+    listeners.clear();
 }
 
-
 void Server::cleanup()
 {
-    if (server_fd != -1)
+    if (signal_fd != -1)
     {
-        close(server_fd);
-        server_fd = -1;
+        loop.remove(signal_fd);
+        close(signal_fd);
+        signal_fd = -1;
     }
-#ifdef __linux__
-    if (epoll_fd != -1) {
-        close(epoll_fd);
-        epoll_fd = -1;
+    for (std::map<int, int>::const_iterator it = listeners.begin(); it != listeners.end(); ++it)
+    {
+        loop.remove(it->first);
+        close(it->first);
     }
-#endif
+    listeners.clear();
     is_running = false;
     is_init = false;
 }
 
-int Server::getPort() const {
-    return config.port;
-}
-
-int Server::getServerFd() const {
-    return server_fd;
-}
-
 bool Server::isRunning() const {
     return is_running;
 }
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <netdb.h>
 
 namespace ConfigUtils {
 	std::string stripInlineComment(const std::string& line);
@@ -9,6 +10,46 @@ namespace ConfigUtils {
 	std::string removeTrailingSemicolon(std::string line);
 	void trim(std::string& str);
 	bool parseBoolToken(std::string value);
+	size_t parseSizeToken(const std::string& token);
+}
+
+// proxy_pass http://host[:port][/uri]; the host is resolved once, here
+static void parseProxyPass(const std::string &value, LocationConfig &location)
+{
+	const std::string scheme = "http://";
+	if (value.compare(0, scheme.size(), scheme) != 0)
+		throw std::runtime_error("proxy_pass supports http:// upstreams only: " + value);
+
+	const std::string rest = value.substr(scheme.size());
+	const std::string::size_type slash = rest.find('/');
+	const std::string authority = rest.substr(0, slash);
+	location.proxy_uri = (slash == std::string::npos) ? "" : rest.substr(slash);
+
+	std::string host = authority;
+	std::string port = "80";
+	const std::string::size_type colon = authority.find(':');
+	if (colon != std::string::npos)
+	{
+		host = authority.substr(0, colon);
+		port = authority.substr(colon + 1);
+	}
+	const int port_number = stringtoi(port);
+	if (host.empty() || port_number <= 0 || port_number > 65535)
+		throw std::runtime_error("Invalid proxy_pass address: " + value);
+
+	struct addrinfo hints;
+	struct addrinfo *found = NULL;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), NULL, &hints, &found) != 0 || !found)
+		throw std::runtime_error("proxy_pass host not found: " + host);
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in *>(found->ai_addr)->sin_addr, ip, sizeof(ip));
+	freeaddrinfo(found);
+
+	location.proxy_pass = std::string(ip) + ":" + port;
+	location.proxy_host = authority;
 }
 
 LocationConfig Config::parseLocationBlock(std::ifstream& file, const std::string& location_path)
@@ -18,11 +59,36 @@ LocationConfig Config::parseLocationBlock(std::ifstream& file, const std::string
 	location.path = location_path;
 	location.allowed_methods.clear();
 	location.autoindex = false;
+	location.internal = false;
+	location.autoindex_format = "html";
 	location.has_methods = false;
 	location.upload_dir.clear();
 	location.cgi_extensions.clear();
 	location.cgi_path.clear();
 	location.fastcgi_pass.clear();
+	location.fastcgi_keepalive = 8;
+	location.fastcgi_keepalive_timeout = 60;
+	location.fastcgi_keepalive_lifetime = 600;
+	location.fastcgi_spool_threshold = 1024 * 1024;
+	location.fastcgi_connect_timeout = 60;
+	location.fastcgi_send_timeout = 60;
+	location.fastcgi_read_timeout = 60;
+	location.fastcgi_next_upstream_tries = 2;
+	location.fastcgi_cache.clear();
+	location.fastcgi_cache_valid = 0;
+	location.fastcgi_cache_key_headers.clear();
+	location.fastcgi_cache_lock = false;
+	location.fastcgi_cache_lock_timeout = 5;
+	location.fastcgi_static_params.clear();
+	location.fastcgi_mirror.clear();
+	location.fastcgi_mirror_percent = 100;
+	location.proxy_pass.clear();
+	location.proxy_host.clear();
+	location.proxy_uri.clear();
+	location.proxy_keepalive = 8;
+	location.proxy_keepalive_timeout = 60;
+	location.proxy_connect_timeout = 60;
+	location.proxy_read_timeout = 60;
 	location.has_return = false;
 	location.return_code = 0;
 	location.return_target.clear();
@@ -63,6 +129,14 @@ LocationConfig Config::parseLocationBlock(std::ifstream& file, const std::string
 		}
 		else if (directive == "autoindex" && tokens.size() >= 2)
 			location.autoindex = ConfigUtils::parseBoolToken(tokens[1]);
+		else if (directive == "internal" && tokens.size() == 1)
+			location.internal = true;
+		else if (directive == "autoindex_format" && tokens.size() >= 2)
+		{
+			if (tokens[1] != "html" && tokens[1] != "json")
+				throw std::runtime_error("autoindex_format must be html or json: " + tokens[1]);
+			location.autoindex_format = tokens[1];
+		}
 		else if ((directive == "upload_store" || directive == "upload_dir") && tokens.size() >= 2)
 			location.upload_dir = tokens[1];
 		else if ((directive == "cgi_extension" || directive == "cgi_extensions") && tokens.size() >= 2)
@@ -71,11 +145,170 @@ LocationConfig Config::parseLocationBlock(std::ifstream& file, const std::string
 			location.cgi_path = tokens[1];
 		else if (directive == "fastcgi_pass" && tokens.size() >= 2)
 			location.fastcgi_pass = tokens[1];
-		else if (directive == "return" && tokens.size() >= 3)
+		else if (directive == "fastcgi_keepalive" && tokens.size() >= 2 && tokens.size() <= 4)
+		{
+			// fastcgi_keepalive <max_idle>|off [idle_timeout] [max_lifetime];
+			if (tokens[1] == "off")
+				location.fastcgi_keepalive = 0;
+			else
+			{
+				const int max_idle = stringtoi(tokens[1]);
+				if (max_idle < 0)
+					throw std::runtime_error("Invalid fastcgi_keepalive connection count: " + tokens[1]);
+				location.fastcgi_keepalive = static_cast<size_t>(max_idle);
+			}
+			if (tokens.size() >= 3)
+				location.fastcgi_keepalive_timeout = stringtoi(tokens[2]);
+			if (tokens.size() >= 4)
+				location.fastcgi_keepalive_lifetime = stringtoi(tokens[3]);
+			if (location.fastcgi_keepalive_timeout <= 0 || location.fastcgi_keepalive_lifetime <= 0)
+				throw std::runtime_error("fastcgi_keepalive timeouts must be positive seconds");
+		}
+		else if (directive == "fastcgi_spool_threshold" && tokens.size() == 2)
+		{
+			// fastcgi_spool_threshold <size>|off;
+			if (tokens[1] == "off")
+				location.fastcgi_spool_threshold = 0;
+			else
+				location.fastcgi_spool_threshold = ConfigUtils::parseSizeToken(tokens[1]);
+		}
+		else if ((directive == "fastcgi_connect_timeout" || directive == "fastcgi_send_timeout"
+			|| directive == "fastcgi_read_timeout") && tokens.size() == 2)
+		{
+			// Seconds, with an optional trailing 's'
+			std::string value = tokens[1];
+			if (value.size() > 1 && value[value.size() - 1] == 's')
+				value.erase(value.size() - 1);
+			const int seconds = stringtoi(value);
+			if (seconds <= 0)
+				throw std::runtime_error("Invalid " + directive + " value: " + tokens[1]);
+			if (directive == "fastcgi_connect_timeout")
+				location.fastcgi_connect_timeout = seconds;
+			else if (directive == "fastcgi_send_timeout")
+				location.fastcgi_send_timeout = seconds;
+			else
+				location.fastcgi_read_timeout = seconds;
+		}
+		else if (directive == "fastcgi_next_upstream_tries" && tokens.size() == 2)
+		{
+			const int tries = stringtoi(tokens[1]);
+			if (tries <= 0)
+				throw std::runtime_error("fastcgi_next_upstream_tries must be at least 1: " + tokens[1]);
+			location.fastcgi_next_upstream_tries = static_cast<unsigned int>(tries);
+		}
+		else if (directive == "fastcgi_cache" && tokens.size() == 2)
+		{
+			// fastcgi_cache <zone>|off;
+			if (tokens[1] == "off")
+				location.fastcgi_cache.clear();
+			else
+				location.fastcgi_cache = tokens[1];
+		}
+		else if (directive == "fastcgi_cache_valid" && tokens.size() == 2)
+		{
+			std::string value = tokens[1];
+			if (value.size() > 1 && value[value.size() - 1] == 's')
+				value.erase(value.size() - 1);
+			if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+				throw std::runtime_error("Invalid fastcgi_cache_valid value: " + tokens[1]);
+			location.fastcgi_cache_valid = stringtoi(value);
+		}
+		else if (directive == "fastcgi_cache_key_headers" && tokens.size() >= 2)
+			location.fastcgi_cache_key_headers.assign(tokens.begin() + 1, tokens.end());
+		else if (directive == "fastcgi_cache_lock" && tokens.size() == 2)
+		{
+			if (tokens[1] != "on" && tokens[1] != "off")
+				throw std::runtime_error("fastcgi_cache_lock must be on or off: " + tokens[1]);
+			location.fastcgi_cache_lock = (tokens[1] == "on");
+		}
+		else if (directive == "fastcgi_cache_lock_timeout" && tokens.size() == 2)
+		{
+			std::string value = tokens[1];
+			if (value.size() > 1 && value[value.size() - 1] == 's')
+				value.erase(value.size() - 1);
+			const int seconds = stringtoi(value);
+			if (seconds <= 0)
+				throw std::runtime_error("Invalid fastcgi_cache_lock_timeout value: " + tokens[1]);
+			location.fastcgi_cache_lock_timeout = seconds;
+		}
+		else if (directive == "mirror" && tokens.size() >= 2 && tokens.size() <= 3)
+		{
+			// mirror <host:port|unix:/path|upstream>|off [percent%];
+			if (tokens[1] == "off")
+				location.fastcgi_mirror.clear();
+			else
+				location.fastcgi_mirror = tokens[1];
+			if (tokens.size() == 3)
+			{
+				std::string value = tokens[2];
+				if (value.size() > 1 && value[value.size() - 1] == '%')
+					value.erase(value.size() - 1);
+				const int percent = stringtoi(value);
+				if (value.find_first_not_of("0123456789") != std::string::npos || percent <= 0 || percent > 100)
+					throw std::runtime_error("Invalid mirror sample: " + tokens[2]);
+				location.fastcgi_mirror_percent = static_cast<unsigned int>(percent);
+			}
+		}
+		else if (directive == "proxy_pass" && tokens.size() == 2)
+			parseProxyPass(tokens[1], location);
+		else if (directive == "proxy_keepalive" && tokens.size() >= 2 && tokens.size() <= 3)
+		{
+			// proxy_keepalive <max_idle>|off [idle_timeout];
+			if (tokens[1] == "off")
+				location.proxy_keepalive = 0;
+			else
+			{
+				const int max_idle = stringtoi(tokens[1]);
+				if (max_idle < 0)
+					throw std::runtime_error("Invalid proxy_keepalive connection count: " + tokens[1]);
+				location.proxy_keepalive = static_cast<size_t>(max_idle);
+			}
+			if (tokens.size() == 3)
+				location.proxy_keepalive_timeout = stringtoi(tokens[2]);
+			if (location.proxy_keepalive_timeout <= 0)
+				throw std::runtime_error("proxy_keepalive timeout must be positive seconds");
+		}
+		else if ((directive == "proxy_connect_timeout" || directive == "proxy_read_timeout") && tokens.size() == 2)
+		{
+			std::string value = tokens[1];
+			if (value.size() > 1 && value[value.size() - 1] == 's')
+				value.erase(value.size() - 1);
+			const int seconds = stringtoi(value);
+			if (seconds <= 0)
+				throw std::runtime_error("Invalid " + directive + " value: " + tokens[1]);
+			if (directive == "proxy_connect_timeout")
+				location.proxy_connect_timeout = seconds;
+			else
+				location.proxy_read_timeout = seconds;
+		}
+		else if (directive == "return" && tokens.size() >= 2)
 		{
+			// return <code> [text|URL]; or return <URL>; (302)
 			location.has_return = true;
-			location.return_code = std::atoi(tokens[1].c_str());
-			location.return_target = tokens[2];
+			if (tokens[1].find_first_not_of("0123456789") != std::string::npos)
+			{
+				location.return_code = 302;
+				location.return_target = tokens[1];
+			}
+			else
+			{
+				location.return_code = std::atoi(tokens[1].c_str());
+				if (location.return_code < 100 || location.return_code > 599)
+					throw std::runtime_error("Invalid return code: " + tokens[1]);
+				for (size_t i = 2; i < tokens.size(); ++i)
+				{
+					if (i > 2)
+						location.return_target += " ";
+					location.return_target += tokens[i];
+				}
+				const std::string &t = location.return_target;
+				if (t.size() >= 2 && t[0] == '"' && t[t.size() - 1] == '"')
+					location.return_target = t.substr(1, t.size() - 2);
+			}
+			const int code = location.return_code;
+			if ((code == 301 || code == 302 || code == 303 || code == 307 || code == 308)
+				&& location.return_target.empty())
+				throw std::runtime_error("return " + tokens[1] + " requires a target URL");
 		}
 		else
 			throw std::runtime_error("Unknown location directive: " + directive);
@@ -83,6 +316,10 @@ LocationConfig Config::parseLocationBlock(std::ifstream& file, const std::string
 
 	if (!found_closing_brace)
 		throw std::runtime_error("Unclosed location block (missing closing brace)");
+	if (!location.proxy_pass.empty() && !location.fastcgi_pass.empty())
+		throw std::runtime_error("Location " + location_path + " has both proxy_pass and fastcgi_pass");
+	if (!location.fastcgi_mirror.empty() && location.fastcgi_pass.empty())
+		throw std::runtime_error("Location " + location_path + " has mirror without fastcgi_pass");
 	if (location.allowed_methods.empty())
 		location.allowed_methods.push_back("GET");
 
@@ -20,15 +20,22 @@ const ServerConfig* Config::getServerByPort(int port) const
 void Config::printDebug(std::ostream& os) const
 {
 	os << "\n=== Parsed Servers: " << servers.size() << " ===" << std::endl;
+	if (!servers.empty())
+		os << "Worker Processes: " << servers.front().worker_processes << std::endl;
 	for (size_t i = 0; i < servers.size(); ++i)
 	{
 		const ServerConfig& server = servers[i];
 		os << "Server #" << (i + 1) << std::endl;
-		os << "  Port: " << server.port << std::endl;
-		os << "  Server Name: " << server.server_name << std::endl;
+		os << "  Port: " << server.port << (server.default_server ? " (default server)" : "") << std::endl;
+		os << "  Server Names:";
+		for (size_t n = 0; n < server.server_names.size(); ++n)
+			os << " " << server.server_names[n];
+		os << std::endl;
 		os << "  Root: " << server.root << std::endl;
 		os << "  Client Max Body Size: " << server.client_max_body_size << std::endl;
 		os << "  Client Timeout: " << server.client_timeout << std::endl;
+		os << "  Shutdown Timeout: " << server.shutdown_timeout << std::endl;
+		os << "  MIME Types: " << server.mime_types.size() << " extensions" << std::endl;
 
 		os << "  Index Files: ";
 		if (server.index_files.empty())
@@ -75,7 +82,10 @@ void Config::printDebug(std::ostream& os) const
 				}
 			}
 			os << std::endl;
-			os << "      Autoindex: " << (loc.autoindex ? "on" : "off") << std::endl;
+			os << "      Autoindex: " << (loc.autoindex ? "on" : "off")
+				<< " (" << loc.autoindex_format << ")" << std::endl;
+			if (loc.internal)
+				os << "      Internal: yes" << std::endl;
 			os << "      Upload Dir: " << (loc.upload_dir.empty() ? "(none)" : loc.upload_dir) << std::endl;
 			os << "      CGI Path: " << (loc.cgi_path.empty() ? "(none)" : loc.cgi_path) << std::endl;
 			os << "      CGI Extensions: ";
@@ -91,7 +101,33 @@ void Config::printDebug(std::ostream& os) const
 				}
 			}
 			os << std::endl;
+			if (!loc.proxy_pass.empty())
+				os << "      Proxy Pass: http://" << loc.proxy_host << loc.proxy_uri << " (" << loc.proxy_pass
+					<< "), keepalive " << loc.proxy_keepalive << " idle/" << loc.proxy_keepalive_timeout
+					<< "s, connect " << loc.proxy_connect_timeout << "s, read " << loc.proxy_read_timeout << "s" << std::endl;
 			os << "      FastCGI Pass: " << (loc.fastcgi_pass.empty() ? "(none)" : loc.fastcgi_pass) << std::endl;
+			if (!loc.fastcgi_pass.empty())
+			{
+				os << "      FastCGI Keepalive: " << loc.fastcgi_keepalive << " idle, "
+					<< loc.fastcgi_keepalive_timeout << "s timeout, "
+					<< loc.fastcgi_keepalive_lifetime << "s lifetime" << std::endl;
+				os << "      FastCGI Spool Threshold: " << loc.fastcgi_spool_threshold << std::endl;
+				os << "      FastCGI Timeouts: connect " << loc.fastcgi_connect_timeout << "s, send "
+					<< loc.fastcgi_send_timeout << "s, read " << loc.fastcgi_read_timeout << "s, "
+					<< loc.fastcgi_next_upstream_tries << " tries" << std::endl;
+				if (!loc.fastcgi_cache.empty())
+				{
+					os << "      FastCGI Cache: zone " << loc.fastcgi_cache << ", default "
+						<< loc.fastcgi_cache_valid << "s, key headers:";
+					for (size_t kh = 0; kh < loc.fastcgi_cache_key_headers.size(); ++kh)
+						os << " " << loc.fastcgi_cache_key_headers[kh];
+					os << std::endl;
+					if (loc.fastcgi_cache_lock)
+						os << "      FastCGI Cache Lock: " << loc.fastcgi_cache_lock_timeout << "s" << std::endl;
+				}
+				if (!loc.fastcgi_mirror.empty())
+					os << "      FastCGI Mirror: " << loc.fastcgi_mirror << " (" << loc.fastcgi_mirror_percent << "%)" << std::endl;
+			}
 
 			if (loc.has_return)
 				os << "      Redirect: " << loc.return_code << " -> " << loc.return_target << std::endl;
@@ -102,6 +138,35 @@ void Config::printDebug(std::ostream& os) const
 		if (i + 1 != servers.size())
 			os << std::endl;
 	}
+
+	static const char *balance_names[] = {"round_robin", "least_conn", "ewma"};
+	for (std::map<std::string, UpstreamConfig>::const_iterator up = upstreams.begin();
+		 up != upstreams.end(); ++up)
+	{
+		const UpstreamConfig& group = up->second;
+		os << "\nUpstream " << group.name << " (" << balance_names[group.balance] << ")" << std::endl;
+		for (size_t s = 0; s < group.servers.size(); ++s)
+		{
+			const UpstreamServer& peer = group.servers[s];
+			os << "  " << peer.address << " weight=" << peer.weight << " max_fails=" << peer.max_fails
+				<< " fail_timeout=" << peer.fail_timeout << std::endl;
+		}
+		if (group.health_interval > 0)
+			os << "  Health Check: every " << group.health_interval << "s, timeout " << group.health_timeout
+				<< "s, fails=" << group.health_fails << " passes=" << group.health_passes << std::endl;
+	}
+	for (std::map<std::string, FastCgiSpawnConfig>::const_iterator sp = fastcgi_spawns.begin();
+		 sp != fastcgi_spawns.end(); ++sp)
+	{
+		os << "\nFastCGI Spawn " << sp->first << ":";
+		for (size_t a = 0; a < sp->second.argv.size(); ++a)
+			os << " " << sp->second.argv[a];
+		os << std::endl << "  min_spare=" << sp->second.min_spare << " max_children=" << sp->second.max_children
+			<< " php_max_requests=" << sp->second.php_max_requests << std::endl;
+	}
+	for (std::map<std::string, size_t>::const_iterator zone = cache_zones.begin();
+		 zone != cache_zones.end(); ++zone)
+		os << "\nFastCGI Cache Zone " << zone->first << ": " << zone->second << " bytes" << std::endl;
 	os << std::endl;
 }
 
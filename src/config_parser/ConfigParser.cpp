@@ -18,16 +18,25 @@ void Config::parseConfigFile(const std::string& path)
 		throw std::runtime_error("Unable to open config file: " + path);
 
 	servers.clear();
+	upstreams.clear();
+	cache_zones.clear();
+	fastcgi_spawns.clear();
+	const std::string::size_type slash = path.rfind('/');
+	config_dir = (slash == std::string::npos) ? "." : path.substr(0, slash);
 
 	ServerConfig defaults;
 	defaults.port = 8080;
+	defaults.default_server = false;
 	defaults.server_name = "localhost";
+	defaults.server_names.assign(1, defaults.server_name);
+	defaults.worker_processes = 1;
 	defaults.root = ""; // Don't provide default root - must be explicit
 	defaults.index_files.clear();
 	defaults.index_files.push_back("index.html");
 	defaults.error_pages.clear();
 	defaults.client_max_body_size = 1024 * 1024; // 1MB
 	defaults.client_timeout = CLIENT_TIMEOUT;
+	defaults.shutdown_timeout = SHUTDOWN_TIMEOUT;
 	defaults.locations.clear();
 
 	std::string raw_line;
@@ -58,6 +67,18 @@ void Config::parseConfigFile(const std::string& path)
 			continue;
 		}
 
+		const std::string head = ConfigUtils::splitTokens(line)[0];
+		if (head == "types" || head == "types{")
+		{
+			parseTypesBlock(file, line, defaults.mime_types);
+			continue;
+		}
+		if (head == "upstream")
+		{
+			parseUpstreamBlock(file, line);
+			continue;
+		}
+
 		if (!line.empty() && line[line.size() - 1] != ';')
 			throw std::runtime_error("Directive outside server block must end with ';': " + line);
 
@@ -72,18 +93,58 @@ void Config::parseConfigFile(const std::string& path)
 			defaults.client_max_body_size = ConfigUtils::parseSizeToken(tokens[1]);
 		else if (directive == "client_timeout" && tokens.size() >= 2)
 			defaults.client_timeout = std::atoi(tokens[1].c_str());
+		else if (directive == "shutdown_timeout" && tokens.size() >= 2)
+			defaults.shutdown_timeout = std::atoi(tokens[1].c_str());
 		else if (directive == "error_page" && tokens.size() >= 3)
 			defaults.error_pages[std::atoi(tokens[1].c_str())] = tokens[2];
 		else if (directive == "root" && tokens.size() >= 2)
 			defaults.root = tokens[1];
 		else if (directive == "server_name" && tokens.size() >= 2)
+		{
 			defaults.server_name = tokens[1];
+			defaults.server_names.assign(tokens.begin() + 1, tokens.end());
+		}
+		else if (directive == "worker_processes" && tokens.size() == 2)
+		{
+			defaults.worker_processes = std::atoi(tokens[1].c_str());
+			if (defaults.worker_processes < 1 || defaults.worker_processes > 64)
+				throw std::runtime_error("worker_processes must be between 1 and 64");
+		}
 		else if (directive == "index" && tokens.size() >= 2)
 			defaults.index_files.assign(tokens.begin() + 1, tokens.end());
+		else if (directive == "include" && tokens.size() >= 2)
+			includeTypesFile(tokens[1], defaults.mime_types);
+		else if (directive == "fastcgi_spawn" && tokens.size() >= 3)
+			parseSpawnDirective(tokens);
+		else if (directive == "fastcgi_cache_zone" && tokens.size() == 3)
+		{
+			// fastcgi_cache_zone <name> <size>; shared by every server process
+			const size_t size = ConfigUtils::parseSizeToken(tokens[2]);
+			if (size < 64 * 1024)
+				throw std::runtime_error("fastcgi_cache_zone must be at least 64K: " + tokens[1]);
+			if (cache_zones.count(tokens[1]))
+				throw std::runtime_error("Duplicate fastcgi_cache_zone: " + tokens[1]);
+			cache_zones[tokens[1]] = size;
+		}
 		else
 			std::cerr << "Warning: Unknown global directive '" << directive << "'" << std::endl;
 	}
 
 	if (servers.empty())
 		throw std::runtime_error("Config file does not define any server blocks");
+
+	// Upstream blocks and worker_processes may follow the servers that use them
+	for (size_t i = 0; i < servers.size(); ++i)
+	{
+		servers[i].upstreams = upstreams;
+		servers[i].cache_zones = cache_zones;
+		servers[i].fastcgi_spawns = fastcgi_spawns;
+		servers[i].worker_processes = defaults.worker_processes;
+		for (size_t j = 0; j < servers[i].locations.size(); ++j)
+		{
+			const std::string &zone = servers[i].locations[j].fastcgi_cache;
+			if (!zone.empty() && !cache_zones.count(zone))
+				throw std::runtime_error("fastcgi_cache names an undefined fastcgi_cache_zone: " + zone);
+		}
+	}
 }
@@ -1,4 +1,5 @@
 #include "Config.hpp"
+#include "FastCgiProtocol.hpp"
 
 namespace ConfigUtils
 {
@@ -65,6 +66,14 @@ ServerConfig Config::parseServerBlock(std::ifstream& file, std::string& line, co
 			continue;
 		}
 
+		const std::string head = ConfigUtils::splitTokens(current)[0];
+		if (head == "types" || head == "types{")
+		{
+			has_directives = true;
+			parseTypesBlock(file, current, server.mime_types);
+			continue;
+		}
+
 		if (current[current.size() - 1] != ';')
 			throw std::runtime_error("Directive inside server block must end with ';': " + current);
 
@@ -85,6 +94,9 @@ ServerConfig Config::parseServerBlock(std::ifstream& file, std::string& line, co
 			has_listen = true;
 			has_directives = true;
 			server.port = ConfigUtils::parsePortToken(tokens[1]);
+			if (tokens.size() > 3 || (tokens.size() == 3 && tokens[2] != "default_server"))
+				throw std::runtime_error("Unknown listen parameter: " + tokens.back());
+			server.default_server = (tokens.size() == 3);
 		}
 		else if (directive == "server_name")
 		{
@@ -92,6 +104,7 @@ ServerConfig Config::parseServerBlock(std::ifstream& file, std::string& line, co
 				throw std::runtime_error("server_name directive requires a value");
 			has_directives = true;
 			server.server_name = tokens[1];
+			server.server_names.assign(tokens.begin() + 1, tokens.end());
 		}
 		else if (directive == "root")
 		{
@@ -128,6 +141,22 @@ ServerConfig Config::parseServerBlock(std::ifstream& file, std::string& line, co
 			has_directives = true;
 			server.client_timeout = std::atoi(tokens[1].c_str());
 		}
+		else if (directive == "shutdown_timeout")
+		{
+			if (tokens.size() < 2)
+				throw std::runtime_error("shutdown_timeout directive requires a value");
+			has_directives = true;
+			server.shutdown_timeout = std::atoi(tokens[1].c_str());
+			if (server.shutdown_timeout < 0)
+				throw std::runtime_error("shutdown_timeout must not be negative");
+		}
+		else if (directive == "include")
+		{
+			if (tokens.size() < 2)
+				throw std::runtime_error("include directive requires a file path");
+			has_directives = true;
+			includeTypesFile(tokens[1], server.mime_types);
+		}
 		else if (directive == "cgi_extension" || directive == "cgi_extensions")
 		{
 			// CGI extensions at server level - store for later use if needed
@@ -163,6 +192,24 @@ ServerConfig Config::parseServerBlock(std::ifstream& file, std::string& line, co
 		}
 	}
 
+	for (size_t i = 0; i < server.locations.size(); ++i)
+	{
+		LocationConfig &loc = server.locations[i];
+		if (loc.fastcgi_pass.empty())
+			continue;
+		std::ostringstream port;
+		port << server.port;
+		loc.fastcgi_static_params.clear();
+		fcgi::encodeNameValue("GATEWAY_INTERFACE", "CGI/1.1", loc.fastcgi_static_params);
+		fcgi::encodeNameValue("SERVER_NAME", server.server_name, loc.fastcgi_static_params);
+		fcgi::encodeNameValue("SERVER_PORT", port.str(), loc.fastcgi_static_params);
+		fcgi::encodeNameValue("DOCUMENT_ROOT", server.root, loc.fastcgi_static_params);
+		fcgi::encodeNameValue("REDIRECT_STATUS", "200", loc.fastcgi_static_params);
+	}
+
+	server.router.compile(server.locations, server.root, server.allowed_methods);
+	server.error_cache.load(server.error_pages, server.root, server.mime_types);
+
 	// clear server_methods for next server block
 	server_methods.clear();
 
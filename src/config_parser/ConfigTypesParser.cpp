@@ -0,0 +1,86 @@
+#include "Config.hpp"
+
+namespace ConfigUtils {
+	std::string stripInlineComment(const std::string& line);
+	std::vector<std::string> splitTokens(const std::string& statement);
+	std::string removeTrailingSemicolon(std::string line);
+	void trim(std::string& str);
+}
+
+// Lines look like nginx's mime.types: "<type> <ext> [ext...];"
+void Config::parseTypesBlock(std::ifstream& file, const std::string& header, MimeTypes& types)
+{
+	if (header.find('{') == std::string::npos)
+	{
+		std::string brace_line;
+		while (std::getline(file, brace_line))
+		{
+			brace_line = ConfigUtils::stripInlineComment(brace_line);
+			trim(brace_line);
+			if (brace_line.empty())
+				continue;
+			if (brace_line != "{")
+				throw std::runtime_error("types block must open with '{': " + brace_line);
+			break;
+		}
+	}
+
+	bool found_closing_brace = false;
+	std::string raw_line;
+	while (std::getline(file, raw_line))
+	{
+		std::string current = ConfigUtils::stripInlineComment(raw_line);
+		trim(current);
+		if (current.empty())
+			continue;
+
+		if (current == "}")
+		{
+			found_closing_brace = true;
+			break;
+		}
+
+		if (current[current.size() - 1] != ';')
+			throw std::runtime_error("Entry inside types block must end with ';': " + current);
+
+		current = ConfigUtils::removeTrailingSemicolon(current);
+		std::vector<std::string> tokens = ConfigUtils::splitTokens(current);
+		if (tokens.size() < 2)
+			throw std::runtime_error("types entry requires a type and at least one extension: " + current);
+		for (size_t i = 1; i < tokens.size(); ++i)
+			types.set(tokens[i], tokens[0]);
+	}
+
+	if (!found_closing_brace)
+		throw std::runtime_error("Unclosed types block (missing closing brace)");
+}
+
+// "include <file>;" pulls in a mime.types style file holding a types block.
+// Relative paths are resolved against the directory of the main config.
+void Config::includeTypesFile(const std::string& path, MimeTypes& types)
+{
+	std::string resolved = path;
+	if (!path.empty() && path[0] != '/' && !config_dir.empty())
+		resolved = config_dir + "/" + path;
+
+	std::ifstream file(resolved.c_str());
+	if (!file.is_open())
+		throw std::runtime_error("Unable to open included file: " + resolved);
+
+	std::string raw_line;
+	while (std::getline(file, raw_line))
+	{
+		std::string line = ConfigUtils::stripInlineComment(raw_line);
+		trim(line);
+		if (line.empty())
+			continue;
+
+		const std::vector<std::string> tokens = ConfigUtils::splitTokens(line);
+		if (tokens[0] == "types" || tokens[0] == "types{")
+		{
+			parseTypesBlock(file, line, types);
+			continue;
+		}
+		throw std::runtime_error("Included file may only contain types blocks: " + resolved);
+	}
+}
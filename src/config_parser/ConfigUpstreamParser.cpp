@@ -0,0 +1,220 @@
+#include "Config.hpp"
+#include "FastCgiEndpoint.hpp"
+
+namespace ConfigUtils {
+	std::string stripInlineComment(const std::string& line);
+	std::vector<std::string> splitTokens(const std::string& statement);
+	std::string removeTrailingSemicolon(std::string line);
+	void trim(std::string& str);
+}
+
+namespace {
+
+// "key=value" parameter of a server or health_check line
+bool splitParam(const std::string& token, std::string& key, std::string& value)
+{
+	const std::string::size_type eq = token.find('=');
+	if (eq == std::string::npos || eq == 0 || eq + 1 >= token.size())
+		return false;
+	key = token.substr(0, eq);
+	value = token.substr(eq + 1);
+	return true;
+}
+
+// Non-negative count or seconds; a trailing 's' is accepted for the latter
+int parseUpstreamNumber(std::string value, const std::string& what)
+{
+	if (value.size() > 1 && value[value.size() - 1] == 's')
+		value.erase(value.size() - 1);
+	if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+		throw std::runtime_error("Invalid " + what + " value: " + value);
+	return stringtoi(value);
+}
+
+UpstreamServer parseServerLine(const std::vector<std::string>& tokens)
+{
+	UpstreamServer server;
+	server.address = tokens[1];
+	server.weight = 1;
+	server.max_fails = 1;
+	server.fail_timeout = 10;
+
+	FastCgiEndpoint endpoint;
+	if (!FastCgiEndpoint::parse(server.address, endpoint))
+		throw std::runtime_error("Invalid upstream server address: " + server.address);
+
+	for (size_t i = 2; i < tokens.size(); ++i)
+	{
+		std::string key;
+		std::string value;
+		if (!splitParam(tokens[i], key, value))
+			throw std::runtime_error("Invalid upstream server parameter: " + tokens[i]);
+		if (key == "weight")
+			server.weight = static_cast<unsigned int>(parseUpstreamNumber(value, "weight"));
+		else if (key == "max_fails")
+			server.max_fails = static_cast<unsigned int>(parseUpstreamNumber(value, "max_fails"));
+		else if (key == "fail_timeout")
+			server.fail_timeout = parseUpstreamNumber(value, "fail_timeout");
+		else
+			throw std::runtime_error("Unknown upstream server parameter: " + key);
+	}
+	if (server.weight == 0)
+		throw std::runtime_error("Upstream server weight must be positive: " + server.address);
+	return server;
+}
+
+} // namespace
+
+// fastcgi_spawn <address> [min_spare=N] [max_children=N] [php_max_requests=N] <program> [args...];
+// Workers are recycled after php_max_requests; php-cgi also gets it as
+// PHP_FCGI_MAX_REQUESTS and then recycles itself.
+void Config::parseSpawnDirective(const std::vector<std::string>& tokens)
+{
+	FastCgiSpawnConfig spawn;
+	spawn.address = tokens[1];
+	spawn.min_spare = 2;
+	spawn.max_children = 8;
+	spawn.php_max_requests = 0;
+
+	FastCgiEndpoint endpoint;
+	if (!FastCgiEndpoint::parse(spawn.address, endpoint) || !endpoint.isLocal())
+		throw std::runtime_error("fastcgi_spawn needs a local address or unix socket: " + spawn.address);
+	if (fastcgi_spawns.count(spawn.address))
+		throw std::runtime_error("Duplicate fastcgi_spawn: " + spawn.address);
+
+	size_t i = 2;
+	for (; i < tokens.size(); ++i)
+	{
+		std::string key;
+		std::string value;
+		// The program starts at the first token that is not a known parameter
+		if (!splitParam(tokens[i], key, value)
+			|| (key != "min_spare" && key != "max_children" && key != "php_max_requests"))
+			break;
+		const unsigned int number = static_cast<unsigned int>(parseUpstreamNumber(value, key));
+		if (key == "min_spare")
+			spawn.min_spare = number;
+		else if (key == "max_children")
+			spawn.max_children = number;
+		else
+			spawn.php_max_requests = number;
+	}
+	if (i >= tokens.size())
+		throw std::runtime_error("fastcgi_spawn has no program: " + spawn.address);
+	spawn.argv.assign(tokens.begin() + i, tokens.end());
+	if (spawn.max_children == 0 || spawn.min_spare > spawn.max_children)
+		throw std::runtime_error("fastcgi_spawn needs 0 <= min_spare <= max_children, max_children >= 1: "
+			+ spawn.address);
+	fastcgi_spawns[spawn.address] = spawn;
+}
+
+// upstream <name> {
+//     balance round_robin|least_conn|ewma;
+//     server <address> [weight=N] [max_fails=N] [fail_timeout=N];
+//     health_check [interval=N] [timeout=N] [fails=N] [passes=N];
+// }
+void Config::parseUpstreamBlock(std::ifstream& file, const std::string& header)
+{
+	std::string before_brace = header.substr(0, header.find('{'));
+	trim(before_brace);
+	const std::vector<std::string> name_tokens = ConfigUtils::splitTokens(before_brace);
+	if (name_tokens.size() != 2)
+		throw std::runtime_error("upstream block requires exactly one name: " + header);
+	if (upstreams.count(name_tokens[1]))
+		throw std::runtime_error("Duplicate upstream block: " + name_tokens[1]);
+
+	if (header.find('{') == std::string::npos)
+	{
+		std::string brace_line;
+		while (std::getline(file, brace_line))
+		{
+			brace_line = ConfigUtils::stripInlineComment(brace_line);
+			trim(brace_line);
+			if (brace_line.empty())
+				continue;
+			if (brace_line != "{")
+				throw std::runtime_error("upstream block must open with '{': " + brace_line);
+			break;
+		}
+	}
+
+	UpstreamConfig upstream;
+	upstream.name = name_tokens[1];
+	upstream.balance = BALANCE_ROUND_ROBIN;
+	upstream.health_interval = 0;
+	upstream.health_timeout = 1;
+	upstream.health_fails = 1;
+	upstream.health_passes = 1;
+
+	bool found_closing_brace = false;
+	std::string raw_line;
+	while (std::getline(file, raw_line))
+	{
+		std::string current = ConfigUtils::stripInlineComment(raw_line);
+		trim(current);
+		if (current.empty())
+			continue;
+
+		if (current == "}")
+		{
+			found_closing_brace = true;
+			break;
+		}
+
+		if (current[current.size() - 1] != ';')
+			throw std::runtime_error("Directive inside upstream block must end with ';': " + current);
+
+		current = ConfigUtils::removeTrailingSemicolon(current);
+		trim(current);
+		const std::vector<std::string> tokens = ConfigUtils::splitTokens(current);
+		if (tokens.empty())
+			continue;
+
+		const std::string directive = tokens[0];
+		if (directive == "server" && tokens.size() >= 2)
+			upstream.servers.push_back(parseServerLine(tokens));
+		else if (directive == "balance" && tokens.size() == 2)
+		{
+			if (tokens[1] == "round_robin")
+				upstream.balance = BALANCE_ROUND_ROBIN;
+			else if (tokens[1] == "least_conn")
+				upstream.balance = BALANCE_LEAST_CONN;
+			else if (tokens[1] == "ewma")
+				upstream.balance = BALANCE_EWMA;
+			else
+				throw std::runtime_error("balance must be round_robin, least_conn or ewma: " + tokens[1]);
+		}
+		else if (directive == "health_check")
+		{
+			upstream.health_interval = 5;
+			for (size_t i = 1; i < tokens.size(); ++i)
+			{
+				std::string key;
+				std::string value;
+				if (!splitParam(tokens[i], key, value))
+					throw std::runtime_error("Invalid health_check parameter: " + tokens[i]);
+				if (key == "interval")
+					upstream.health_interval = parseUpstreamNumber(value, "interval");
+				else if (key == "timeout")
+					upstream.health_timeout = parseUpstreamNumber(value, "timeout");
+				else if (key == "fails")
+					upstream.health_fails = static_cast<unsigned int>(parseUpstreamNumber(value, "fails"));
+				else if (key == "passes")
+					upstream.health_passes = static_cast<unsigned int>(parseUpstreamNumber(value, "passes"));
+				else
+					throw std::runtime_error("Unknown health_check parameter: " + key);
+			}
+			if (upstream.health_interval <= 0 || upstream.health_timeout <= 0
+				|| upstream.health_fails == 0 || upstream.health_passes == 0)
+				throw std::runtime_error("health_check values must be positive");
+		}
+		else
+			throw std::runtime_error("Unknown upstream directive: " + directive);
+	}
+
+	if (!found_closing_brace)
+		throw std::runtime_error("Unclosed upstream block (missing closing brace)");
+	if (upstream.servers.empty())
+		throw std::runtime_error("upstream block has no servers: " + upstream.name);
+	upstreams[upstream.name] = upstream;
+}
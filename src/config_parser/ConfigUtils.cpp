@@ -18,7 +18,9 @@ std::string stripInlineComment(const std::string& line)
 		{
 			if (c == '#')
 				return line.substr(0, i);
-			if (c == '/' && i + 1 < line.size() && line[i + 1] == '/')
+			// "//" only starts a comment at a word boundary, so URLs survive
+			if (c == '/' && i + 1 < line.size() && line[i + 1] == '/'
+				&& (i == 0 || std::isspace(static_cast<unsigned char>(line[i - 1]))))
 				return line.substr(0, i);
 		}
 	}
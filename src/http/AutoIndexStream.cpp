@@ -0,0 +1,360 @@
+#include "AutoIndexStream.hpp"
+
+#include "ext_libs.hpp"
+
+#include <dirent.h>
+#include <iomanip>
+#include <sstream>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+const size_t kBatchSize = 32768u;
+
+#ifdef __linux__
+// Layout returned by SYS_getdents64 (see getdents(2))
+struct LinuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#endif
+
+std::string humanReadableSize(off_t bytes)
+{
+    if (bytes < 0)
+        return "-";
+
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    double size = static_cast<double>(bytes);
+    size_t unit = 0;
+
+    while (size >= 1024.0 && unit < (sizeof(units) / sizeof(units[0])) - 1)
+    {
+        size /= 1024.0;
+        ++unit;
+    }
+
+    std::ostringstream oss;
+    if (unit == 0)
+        oss << static_cast<long long>(bytes) << ' ' << units[unit];
+    else
+    {
+        oss << std::fixed << std::setprecision(size >= 100 ? 0 : (size >= 10 ? 1 : 2));
+        oss << size << ' ' << units[unit];
+    }
+    return oss.str();
+}
+
+std::string formatTimestamp(time_t ts)
+{
+    struct tm *tm = localtime(&ts);
+    if (!tm)
+        return "-";
+
+    char buffer[64];
+    if (!strftime(buffer, sizeof(buffer), "%d %b %Y • %H:%M", tm))
+        return "-";
+    return buffer;
+}
+
+void appendHtmlEscaped(std::string &out, const std::string &s)
+{
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        switch (s[i])
+        {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '"': out += "&quot;"; break;
+            default: out += s[i];
+        }
+    }
+}
+
+void appendJsonEscaped(std::string &out, const std::string &s)
+{
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        const unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x20)
+        {
+            char esc[8];
+            std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        }
+        else
+            out += static_cast<char>(c);
+    }
+}
+
+std::string buildBreadcrumb(const std::string &uri)
+{
+    std::string nav = "<nav class=\"crumbs\"><a href=\"/\">root</a>";
+
+    std::string trimmed = uri;
+    if (!trimmed.empty() && trimmed[0] == '/')
+        trimmed.erase(0, 1);
+    if (!trimmed.empty() && trimmed[trimmed.size() - 1] == '/')
+        trimmed.erase(trimmed.size() - 1);
+
+    std::istringstream iss(trimmed);
+    std::string segment;
+    std::string href;
+    while (std::getline(iss, segment, '/'))
+    {
+        if (segment.empty())
+            continue;
+        href += "/";
+        href += segment;
+        nav += "<span>/</span><a href=\"";
+        appendHtmlEscaped(nav, href);
+        nav += "\">";
+        appendHtmlEscaped(nav, segment);
+        nav += "</a>";
+    }
+    nav += "</nav>";
+    return nav;
+}
+
+const char *kStyle =
+    "<style>:root{--bg:#04060f;--accent:#8c6ff7;--accent2:#5de0e6;--panel:rgba(13,17,38,.85);--text:#f4f6ff;--muted:#b8bfda;}"
+    "body{font-family:'Space Grotesk',system-ui,sans-serif;background:radial-gradient(circle at 20% 20%,rgba(92,69,255,.4),transparent 50%),radial-gradient(circle at 80% 0,rgba(93,224,230,.3),transparent 45%),var(--bg);color:var(--text);min-height:100vh;margin:0;padding:32px;display:flex;justify-content:center;}"
+    ".backdrop{width:100%;max-width:960px;background:linear-gradient(135deg,rgba(23,27,62,.95),rgba(10,12,24,.9));border:1px solid rgba(255,255,255,.08);border-radius:24px;box-shadow:0 25px 80px rgba(0,0,0,.45);backdrop-filter:blur(14px);overflow:hidden;}"
+    "header{padding:32px;border-bottom:1px solid rgba(255,255,255,.05);}"
+    "h1{margin:0;font-size:28px;font-weight:600;letter-spacing:.02em;}"
+    ".subtitle{color:var(--muted);margin-top:8px;font-size:15px;}"
+    ".crumbs{margin-top:18px;font-size:13px;text-transform:uppercase;letter-spacing:.2em;color:var(--muted);}"
+    ".crumbs a{color:var(--text);text-decoration:none;font-weight:500;}"
+    ".crumbs span{margin:0 8px;color:rgba(255,255,255,.4);}"
+    "main{padding:32px;}"
+    ".grid{display:grid;grid-template-columns:repeat(auto-fit,minmax(240px,1fr));gap:18px;}"
+    ".item{display:block;padding:20px;border-radius:18px;background:var(--panel);border:1px solid rgba(255,255,255,.06);text-decoration:none;color:var(--text);transition:transform .2s ease, border-color .2s ease, background .2s ease;}"
+    ".item:hover{transform:translateY(-4px);border-color:rgba(255,255,255,.25);background:rgba(25,31,64,.9);}"
+    ".item.dir{border-color:rgba(92,69,255,.3);}"
+    ".name{font-size:17px;font-weight:600;margin-bottom:10px;display:flex;gap:8px;align-items:center;}"
+    ".badge{font-size:11px;padding:2px 8px;border-radius:999px;background:rgba(255,255,255,.1);text-transform:uppercase;letter-spacing:.08em;}"
+    ".meta{display:flex;justify-content:space-between;color:var(--muted);font-size:13px;}"
+    ".empty{margin:40px auto;text-align:center;color:var(--muted);font-size:15px;}"
+    ".more{display:block;margin-top:24px;text-align:center;color:var(--accent2);}"
+    "footer{padding:18px 32px;border-top:1px solid rgba(255,255,255,.05);color:var(--muted);font-size:13px;text-align:right;}"
+    "@media(max-width:600px){body{padding:16px;}header,main{padding:24px;} .grid{grid-template-columns:repeat(auto-fit,minmax(180px,1fr));}}"
+    "</style>";
+
+} // namespace
+
+AutoIndexStream::AutoIndexStream(const std::string &uri, const std::string &dirPath,
+                                 Format format, size_t offset, size_t limit)
+    : uri(uri)
+    , dirPath(dirPath)
+    , format(format)
+    , offset(offset)
+    , limit(limit)
+    , phase(PHASE_HEAD)
+    , dir_fd(-1)
+    , dir(NULL)
+    , batch()
+    , seen(0)
+    , emitted(0)
+    , has_more(false)
+{
+}
+
+AutoIndexStream::~AutoIndexStream()
+{
+#ifdef __linux__
+    if (dir_fd != -1)
+        close(dir_fd);
+#else
+    if (dir)
+        closedir(static_cast<DIR *>(dir));
+#endif
+}
+
+const char *AutoIndexStream::contentType(Format format)
+{
+    if (format == FORMAT_JSON)
+        return "application/json";
+    return "text/html; charset=UTF-8";
+}
+
+bool AutoIndexStream::open()
+{
+#ifdef __linux__
+    dir_fd = ::open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return false;
+    batch.resize(kBatchSize);
+#else
+    DIR *d = opendir(dirPath.c_str());
+    if (!d)
+        return false;
+    dir = d;
+    dir_fd = dirfd(d);
+#endif
+    return true;
+}
+
+void AutoIndexStream::appendHead(std::string &out) const
+{
+    if (format == FORMAT_JSON)
+    {
+        out += "{\"path\":\"";
+        appendJsonEscaped(out, uri);
+        out += "\",\"entries\":[";
+        return;
+    }
+    out += "<!doctype html><html><head><meta charset=\"utf-8\">"
+        "<meta name=\"viewport\" content=\"width=device-width,initial-scale=1\">"
+        "<title>Index of ";
+    appendHtmlEscaped(out, uri);
+    out += "</title>";
+    out += kStyle;
+    out += "</head><body><div class=\"backdrop\"><header><h1>Index of ";
+    appendHtmlEscaped(out, uri);
+    out += "</h1><p class=\"subtitle\">Browse files served by webserv</p>";
+    out += buildBreadcrumb(uri);
+    out += "</header><main><div class=\"grid\">";
+}
+
+void AutoIndexStream::appendFooter(std::string &out) const
+{
+    std::ostringstream next;
+    next << (offset + emitted);
+
+    if (format == FORMAT_JSON)
+    {
+        out += "],\"next_offset\":";
+        out += has_more ? next.str() : "null";
+        out += "}";
+        return;
+    }
+    out += "</div>";
+    if (emitted == 0 && offset == 0)
+        out += "<p class=\"empty\">This folder is feeling lonely.</p>";
+    if (has_more)
+    {
+        std::ostringstream lim;
+        lim << limit;
+        out += "<a class=\"more\" href=\"?offset=" + next.str() + "&amp;limit=" + lim.str() + "\">Next page</a>";
+    }
+    out += "</main><footer>autoindex • webserv</footer></div></body></html>";
+}
+
+void AutoIndexStream::appendEntry(std::string &out, const char *name, unsigned char type)
+{
+    if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0)
+        return;
+    if (seen++ < offset)
+        return;
+    if (limit && emitted >= limit)
+    {
+        has_more = true;
+        return;
+    }
+
+    struct stat entStat;
+    const bool statOk = (fstatat(dir_fd, name, &entStat, 0) == 0);
+    bool isDir = (type == DT_DIR);
+    if (statOk && type == DT_UNKNOWN)
+        isDir = S_ISDIR(entStat.st_mode);
+
+    if (format == FORMAT_JSON)
+    {
+        std::ostringstream meta;
+        meta << "\",\"type\":\"" << (isDir ? "dir" : "file") << "\"";
+        if (statOk)
+        {
+            if (!isDir)
+                meta << ",\"size\":" << static_cast<long long>(entStat.st_size);
+            meta << ",\"mtime\":" << static_cast<long long>(entStat.st_mtime);
+        }
+        meta << "}";
+        out += emitted ? ",{\"name\":\"" : "{\"name\":\"";
+        appendJsonEscaped(out, name);
+        out += meta.str();
+        ++emitted;
+        return;
+    }
+
+    std::string href = uri;
+    if (!href.empty() && href[href.size() - 1] != '/')
+        href += '/';
+    href += name;
+
+    const std::string sizeLabel = isDir ? "Directory" : (statOk ? humanReadableSize(entStat.st_size) : "-");
+    const std::string mtimeStr = statOk ? formatTimestamp(entStat.st_mtime) : "-";
+
+    out += "<a class=\"item ";
+    out += isDir ? "dir" : "file";
+    out += "\" href=\"";
+    appendHtmlEscaped(out, href);
+    out += "\"><div class=\"name\">";
+    appendHtmlEscaped(out, name);
+    if (isDir)
+        out += "/";
+    out += "<span class=\"badge\">";
+    out += isDir ? "folder" : "file";
+    out += "</span></div><div class=\"meta\"><span>" + sizeLabel + "</span><span>" + mtimeStr + "</span></div></a>";
+    ++emitted;
+}
+
+// Consumes one kernel batch of directory entries. Returns false once the
+// directory is exhausted (or the page is full).
+bool AutoIndexStream::readBatch(std::string &out)
+{
+#ifdef __linux__
+    const long n = syscall(SYS_getdents64, dir_fd, &batch[0], batch.size());
+    if (n <= 0)
+        return false;
+    for (long pos = 0; pos < n && !has_more;)
+    {
+        const LinuxDirent64 *ent = reinterpret_cast<const LinuxDirent64 *>(&batch[pos]);
+        appendEntry(out, ent->d_name, ent->d_type);
+        pos += ent->d_reclen;
+    }
+#else
+    // readdir already buffers internally; walk a bounded slice per pull
+    for (size_t i = 0; i < 256 && !has_more; ++i)
+    {
+        struct dirent *ent = readdir(static_cast<DIR *>(dir));
+        if (!ent)
+            return false;
+        appendEntry(out, ent->d_name, ent->d_type);
+    }
+#endif
+    return !has_more;
+}
+
+ResponseStream::Status AutoIndexStream::pull(std::string &out)
+{
+    switch (phase)
+    {
+        case PHASE_HEAD:
+            appendHead(out);
+            phase = PHASE_ENTRIES;
+            return STREAM_DATA;
+        case PHASE_ENTRIES:
+            if (!readBatch(out))
+            {
+                appendFooter(out);
+                phase = PHASE_DONE;
+            }
+            return STREAM_DATA;
+        case PHASE_DONE:
+            break;
+    }
+    return STREAM_END;
+}
@@ -0,0 +1,131 @@
+#include "CgiOutput.hpp"
+
+#include <map>
+#include <sstream>
+
+namespace cgi_output {
+
+std::string::size_type findHeaderEnd(const std::string &data, size_t &body_start)
+{
+    // Scripts may end lines with "\n" alone; whichever blank line comes first wins
+    std::string::size_type pos = data.find("\r\n\r\n");
+    std::string::size_type alt = data.find("\n\n");
+    body_start = pos + 4;
+    if (pos == std::string::npos || (alt != std::string::npos && alt < pos))
+    {
+        pos = alt;
+        body_start = alt + 2;
+    }
+    return pos;
+}
+
+std::string buildHead(const std::string &version, const std::string &header_block,
+                      size_t body_length, bool &chunked)
+{
+    int statusCode = 200;
+    std::string reason = "OK";
+    std::map<std::string, std::string> outHeaders;
+
+    std::istringstream hss(header_block);
+    std::string line;
+    while (std::getline(hss, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        std::string::size_type colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string key = line.substr(0, colon);
+        std::string value = line.substr(colon + 1);
+        while (!value.empty() && (value[0] == ' ' || value[0] == '\t'))
+            value.erase(0, 1);
+        if (key == "Status")
+        {
+            std::istringstream iss(value);
+            iss >> statusCode;
+            if (iss)
+            {
+                std::string rest;
+                std::getline(iss, rest);
+                if (!rest.empty() && rest[0] == ' ')
+                    rest.erase(0, 1);
+                if (!rest.empty())
+                    reason = rest;
+            }
+        }
+        else
+        {
+            outHeaders[key] = value;
+        }
+    }
+
+    chunked = false;
+    if (outHeaders.find("Content-Length") == outHeaders.end()
+        && outHeaders.find("content-length") == outHeaders.end())
+    {
+        // Length unknown while streaming: chunk on HTTP/1.1, else the close ends the body
+        if (body_length != std::string::npos)
+        {
+            std::ostringstream len;
+            len << body_length;
+            outHeaders["Content-Length"] = len.str();
+        }
+        else if (version == "HTTP/1.1")
+        {
+            outHeaders["Transfer-Encoding"] = "chunked";
+            chunked = true;
+        }
+    }
+    if (outHeaders.find("Content-Type") == outHeaders.end()
+        && outHeaders.find("content-type") == outHeaders.end())
+    {
+        outHeaders["Content-Type"] = "text/html; charset=UTF-8";
+    }
+
+    std::ostringstream resp;
+    resp << version << " " << statusCode << " " << reason << "\r\n";
+    for (std::map<std::string, std::string>::const_iterator it = outHeaders.begin(); it != outHeaders.end(); ++it)
+    {
+        resp << it->first << ": " << it->second << "\r\n";
+    }
+    resp << "Connection: close\r\n\r\n";
+    return resp.str();
+}
+
+std::string buildResponse(const std::string &version, const std::string &output)
+{
+    if (output.empty())
+        return buildError(version, 502, "Bad Gateway", "<html><body><h1>502 Bad Gateway</h1><p>Empty script response</p></body></html>");
+
+    size_t body_start = 0;
+    const std::string::size_type pos = findHeaderEnd(output, body_start);
+
+    std::string headerBlock;
+    std::string bodyBlock;
+    if (pos != std::string::npos)
+    {
+        headerBlock = output.substr(0, pos);
+        bodyBlock = output.substr(body_start);
+    }
+    else
+    {
+        bodyBlock = output;
+    }
+
+    bool chunked = false;
+    return buildHead(version, headerBlock, bodyBlock.size(), chunked) + bodyBlock;
+}
+
+std::string buildError(const std::string &version, int code, const std::string &reason,
+                       const std::string &body)
+{
+    std::ostringstream resp;
+    resp << version << " " << code << " " << reason << "\r\n";
+    resp << "Content-Type: text/html; charset=UTF-8\r\n";
+    resp << "Content-Length: " << body.size() << "\r\n";
+    resp << "Connection: close\r\n\r\n";
+    resp << body;
+    return resp.str();
+}
+
+} // namespace cgi_output
@@ -0,0 +1,117 @@
+#include "ErrorPages.hpp"
+
+#include "HttpResponse.hpp"
+
+#include <sstream>
+
+namespace {
+
+// How often a served page re-stats its file to pick up edits
+const time_t kRecheckSeconds = 1;
+
+} // namespace
+
+ErrorPages::ErrorPages()
+    : custom()
+    , builtin()
+{
+}
+
+std::string ErrorPages::serialize(int code, const std::string &type, const std::string &body)
+{
+    std::ostringstream resp;
+    resp << " " << code << " " << HttpResponse::getReasonPhraseFromCode(code) << "\r\n";
+    resp << "Content-Type: " << type << "\r\n";
+    resp << "Content-Length: " << body.size() << "\r\n";
+    resp << "Connection: close\r\n\r\n";
+    resp << body;
+    return resp.str();
+}
+
+bool ErrorPages::readPage(int code, Page &page)
+{
+    struct stat st;
+    if (stat(page.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    std::ifstream in(page.path.c_str(), std::ios::in | std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    std::ostringstream body;
+    body << in.rdbuf();
+    page.response = serialize(code, page.type, body.str());
+    page.mtime = st.st_mtime;
+    return true;
+}
+
+void ErrorPages::load(const std::map<int, std::string> &pages, const std::string &root,
+                      const MimeTypes &types)
+{
+    custom.clear();
+    for (std::map<int, std::string>::const_iterator it = pages.begin(); it != pages.end(); ++it)
+    {
+        Page page;
+        page.path = it->second;
+        if (!root.empty() && !page.path.empty() && page.path[0] == '/')
+        {
+            const std::string underRoot = root + page.path;
+            if (access(underRoot.c_str(), F_OK) == 0 || access(page.path.c_str(), F_OK) != 0)
+                page.path = underRoot;
+        }
+        page.type = types.lookup(page.path);
+        page.mtime = 0;
+        page.checked = std::time(NULL);
+        page.ok = readPage(it->first, page);
+        if (!page.ok)
+            std::cerr << "Warning: error_page " << it->first << " unreadable: " << page.path << std::endl;
+        custom[it->first] = page;
+    }
+}
+
+size_t ErrorPages::loaded() const
+{
+    size_t n = 0;
+
+    for (std::map<int, Page>::const_iterator it = custom.begin(); it != custom.end(); ++it)
+    {
+        if (it->second.ok)
+            ++n;
+    }
+    return n;
+}
+
+const std::string &ErrorPages::find(int code) const
+{
+    std::map<int, Page>::iterator it = custom.find(code);
+    if (it != custom.end())
+    {
+        Page &page = it->second;
+        const time_t now = std::time(NULL);
+        if (now - page.checked >= kRecheckSeconds)
+        {
+            page.checked = now;
+            struct stat st;
+            if (stat(page.path.c_str(), &st) == 0)
+            {
+                if (!page.ok || st.st_mtime != page.mtime)
+                    page.ok = readPage(code, page);
+            }
+            else
+                page.ok = false;
+        }
+        if (page.ok)
+            return page.response;
+    }
+
+    std::map<int, std::string>::iterator b = builtin.find(code);
+    if (b != builtin.end())
+        return b->second;
+
+    const std::string reason = HttpResponse::getReasonPhraseFromCode(code);
+    std::ostringstream body;
+    body << "<html><head><title>" << code << " " << reason
+        << "</title></head><body><h1>" << code << " " << reason
+        << "</h1></body></html>";
+    return builtin[code] = serialize(code, "text/html; charset=UTF-8", body.str());
+}
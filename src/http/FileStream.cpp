@@ -0,0 +1,59 @@
+#include "FileStream.hpp"
+
+#include "ext_libs.hpp"
+
+namespace {
+
+const size_t kBlockSize = 65536u;
+
+} // namespace
+
+FileStream::FileStream()
+    : fd(-1)
+    , length(0)
+    , left(0)
+{
+}
+
+FileStream::~FileStream()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+bool FileStream::open(const std::string &path)
+{
+    struct stat st;
+
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    length = st.st_size;
+    left = st.st_size;
+    return true;
+}
+
+ResponseStream::Status FileStream::pull(std::string &out)
+{
+    if (left == 0)
+        return STREAM_END;
+
+    const size_t want = (left < static_cast<off_t>(kBlockSize)) ? static_cast<size_t>(left) : kBlockSize;
+    out.resize(want);
+    ssize_t n;
+    do
+        n = read(fd, &out[0], want);
+    while (n < 0 && errno == EINTR);
+    // The length went out in the head: a file shrinking under us cannot be served
+    if (n <= 0)
+        return STREAM_ERROR;
+    out.resize(static_cast<size_t>(n));
+    left -= n;
+    return (left == 0) ? STREAM_END : STREAM_DATA;
+}
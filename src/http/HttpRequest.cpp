@@ -2,7 +2,8 @@
 #include "ext_libs.hpp"
 
 HttpRequest::HttpRequest()
-    : isQuery(false)
+    : bodyStreamed(false)
+    , isQuery(false)
 {
 }
 
@@ -121,3 +122,11 @@ const std::string& HttpRequest::getHeader(const std::string& key) const {
 }
 const std::string &HttpRequest::getRoot() const { return root; }
 const std::string &HttpRequest::getBody() const { return body; }
+bool HttpRequest::isBodyStreamed() const { return bodyStreamed; }
+void HttpRequest::setBodyStreamed(bool streamed) { bodyStreamed = streamed; }
+const std::string &HttpRequest::getQueryParam(const std::string& key) const {
+    static const std::string empty = "";
+    std::map<std::string, std::string>::const_iterator it = queryParams.find(key);
+    if (it != queryParams.end()) return it->second;
+    return empty;
+}
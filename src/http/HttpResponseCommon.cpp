@@ -4,6 +4,23 @@
 
 #include <sstream>
 
+HttpResponse::HttpResponse()
+    : statusCode(0)
+    , reasonPhrase()
+    , headers()
+    , body()
+    , fullResponse()
+    , stream(NULL)
+    , server(NULL)
+    , route(NULL)
+{
+}
+
+HttpResponse::~HttpResponse()
+{
+    delete stream;
+}
+
 // Helper: map status code to reason phrase
 std::string HttpResponse::getReasonPhraseFromCode(int statusCode)
 {
@@ -14,13 +31,17 @@ std::string HttpResponse::getReasonPhraseFromCode(int statusCode)
         case 204: return ("No Content");
         case 301: return ("Moved Permanently");
         case 302: return ("Found");
+        case 303: return ("See Other");
         case 304: return ("Not Modified");
+        case 307: return ("Temporary Redirect");
+        case 308: return ("Permanent Redirect");
         case 400: return ("Bad Request");
         case 401: return ("Unauthorized");
         case 403: return ("Forbidden");
         case 404: return ("Not Found");
         case 405: return ("Method Not Allowed");
         case 408: return ("Request Timeout");
+        case 410: return ("Gone");
         case 413: return ("Payload Too Large");
         case 414: return ("URI Too Long");
         case 500: return ("Internal Server Error");
@@ -126,24 +147,16 @@ void HttpResponse::createOkResponse(const HttpRequest &request)
     fullResponse += body;
 }
 
-// Define missing function: builds an error response string
+// Error responses come pre-serialized from the server's ErrorPages cache;
+// only the HTTP version is prepended per request.
 std::string HttpResponse::createErrorResponse(const HttpRequest &request, int errorCode) const
 {
-    const std::string reason = getReasonPhraseFromCode(errorCode);
-
-    std::ostringstream bodyStream;
-    bodyStream << "<html><head><title>" << errorCode << " " << reason
-        << "</title></head><body><h1>" << errorCode << " " << reason
-        << "</h1></body></html>";
-
-    const std::string errBody = bodyStream.str();
-
-    std::ostringstream resp;
-    resp << request.getHttpVersion() << " " << errorCode << " " << reason << "\r\n";
-    resp << "Content-Type: text/html; charset=UTF-8\r\n";
-    resp << "Content-Length: " << errBody.size() << "\r\n";
-    resp << "Connection: close\r\n\r\n";
-    resp << errBody;
-
-    return resp.str();
+    static const ErrorPages fallback;
+    const std::string &page = server ? server->error_cache.find(errorCode) : fallback.find(errorCode);
+
+    std::string resp;
+    resp.reserve(request.getHttpVersion().size() + page.size());
+    resp += request.getHttpVersion();
+    resp += page;
+    return resp;
 }
@@ -1,96 +1,22 @@
 #include "HttpResponse.hpp"
 
+#include "CgiProcess.hpp"
 #include "FastCgiClient.hpp"
 #include "HttpResponseHelpers.hpp"
 #include "macros.hpp"
 
 #include <sstream>
 
-namespace {
-
-const LocationConfig *matchBestLocation(const ServerConfig &config, const std::string &uri, size_t &bestLen)
-{
-    const LocationConfig *best = NULL;
-
-    bestLen = 0;
-    for (size_t i = 0; i < config.locations.size(); ++i)
-    {
-        const std::string &p = config.locations[i].location;
-        if (!p.empty() && uri.compare(0, p.size(), p) == 0 && p.size() > bestLen)
-        {
-            best = &config.locations[i];
-            bestLen = p.size();
-        }
-    }
-    return best;
-}
-
-bool isMethodAllowed(const std::vector<std::string> &methods, const std::string &method)
-{
-    for (size_t i = 0; i < methods.size(); ++i)
-    {
-        if (methods[i] == method)
-            return true;
-    }
-    return false;
-}
-
-std::string make405(const HttpRequest &request, const std::vector<std::string> &allow)
-{
-    const std::string msg = "<html><body><h1>405 Method Not Allowed</h1></body></html>";
-
-    std::ostringstream resp;
-    resp << request.getHttpVersion() << " 405 Method Not Allowed\r\n";
-    if (!allow.empty())
-        resp << http_response_helpers::buildAllowHeader(allow);
-    resp << "Content-Type: text/html; charset=UTF-8\r\n";
-    resp << "Content-Length: " << msg.size() << "\r\n";
-    resp << "Connection: close\r\n\r\n";
-    resp << msg;
-
-    return resp.str();
-}
-
-} // namespace
-
-const std::string HttpResponse::createDeleteResponse(const HttpRequest &request, const ServerConfig &config) const
+const std::string HttpResponse::createDeleteResponse(const HttpRequest &request, const ServerConfig &config)
 {
     std::string uri = http_response_helpers::stripQuery(request.getUri());
 
-    size_t bestLen = 0;
-    const LocationConfig *best = matchBestLocation(config, uri, bestLen);
-
-    std::string baseDir;
-    std::string suffix;
-
-    if (best)
-    {
-        if (!best->upload_dir.empty())
-            baseDir = best->upload_dir;
-        else if (!best->path.empty())
-            baseDir = best->path;
-        else if (best->location == "/")
-            baseDir = request.getRoot();
-        else
-        {
-            std::string loc = best->location;
-            if (!loc.empty() && loc[0] == '/')
-                loc.erase(0, 1);
-            baseDir = request.getRoot() + "/" + loc;
-        }
+    const LocationConfig *best = route ? &config.locations[route->location_index] : NULL;
 
-        suffix = uri.substr(bestLen);
-        if (!suffix.empty() && suffix[0] == '/')
-            suffix.erase(0, 1);
-    }
-    else
-    {
-        baseDir = request.getRoot();
-        if (!uri.empty() && uri[0] == '/')
-            suffix = uri.substr(1);
-        else
-            suffix = uri;
-    }
+    const std::string &baseDir = route ? route->write_dir : request.getRoot();
+    std::string suffix = route ? uri.substr(route->prefix_len) : uri;
+    if (!suffix.empty() && suffix[0] == '/')
+        suffix.erase(0, 1);
 
     if (suffix.find("..") != std::string::npos)
     {
@@ -109,23 +35,20 @@ const std::string HttpResponse::createDeleteResponse(const HttpRequest &request,
         targetPath += "/";
     targetPath += suffix;
 
-    std::vector<std::string> methodsToCheck;
-    if (best && !best->allowed_methods.empty())
-        methodsToCheck = best->allowed_methods;
-    else if (!config.allowed_methods.empty())
-        methodsToCheck = config.allowed_methods;
-
-    if (!methodsToCheck.empty() && !isMethodAllowed(methodsToCheck, "DELETE"))
-        return make405(request, methodsToCheck);
-
     struct stat st;
     if (stat(targetPath.c_str(), &st) != 0)
         return createErrorResponse(request, HTTP_NOT_FOUND);
 
     if (best && http_response_helpers::isFastCgiRequest(best, targetPath))
     {
-        FastCgiClient fcgi(request, config, *best, targetPath);
-        return fcgi.execute();
+        // The reply arrives through the event loop; the head is produced by the stream
+        stream = new FastCgiClient(request, config, *best, targetPath);
+        return "";
+    }
+    if (best && http_response_helpers::isCgiRequest(best, targetPath))
+    {
+        stream = new CgiProcess(request, config, *best, targetPath);
+        return "";
     }
 
     if (S_ISDIR(st.st_mode))
@@ -1,5 +1,6 @@
 #include "HttpResponse.hpp"
 
+#include "CgiProcess.hpp"
 #include "FastCgiClient.hpp"
 #include "HttpResponseHelpers.hpp"
 #include "macros.hpp"
@@ -8,53 +9,6 @@
 
 namespace {
 
-const LocationConfig *matchBestLocation(const ServerConfig &config, const std::string &uri, size_t &bestLen)
-{
-    const LocationConfig *best = NULL;
-
-    bestLen = 0;
-    for (size_t i = 0; i < config.locations.size(); ++i)
-    {
-        const std::string &p = config.locations[i].location;
-        if (!p.empty() && uri.compare(0, p.size(), p) == 0 && p.size() > bestLen)
-        {
-            best = &config.locations[i];
-            bestLen = p.size();
-        }
-    }
-    return best;
-}
-
-bool isMethodAllowed(const std::vector<std::string> &methods, const std::string &method)
-{
-    for (size_t i = 0; i < methods.size(); ++i)
-    {
-        if (methods[i] == method)
-            return true;
-    }
-    return false;
-}
-
-std::string make405(const HttpRequest &request, const std::vector<std::string> &allow, const std::string &extra)
-{
-    const std::string msg = extra.empty()
-        ? "<html><body><h1>405 Method Not Allowed</h1></body></html>"
-        : extra;
-
-    std::ostringstream resp;
-    resp << request.getHttpVersion() << " 405 Method Not Allowed\r\n";
-    if (!allow.empty())
-        resp << http_response_helpers::buildAllowHeader(allow);
-    else
-        resp << "Allow: GET\r\n";
-    resp << "Content-Type: text/html; charset=UTF-8\r\n";
-    resp << "Content-Length: " << msg.size() << "\r\n";
-    resp << "Connection: close\r\n\r\n";
-    resp << msg;
-
-    return resp.str();
-}
-
 unsigned long parseContentLengthOrZero(const std::string &value)
 {
     std::string cl = value;
@@ -78,19 +32,16 @@ unsigned long parseContentLengthOrZero(const std::string &value)
 
 } // namespace
 
-const std::string HttpResponse::createPostResponse(const HttpRequest &request, const ServerConfig &config) const
+const std::string HttpResponse::createPostResponse(const HttpRequest &request, const ServerConfig &config)
 {
     std::string uri = http_response_helpers::stripQuery(request.getUri());
 
-    size_t bestLen = 0;
-    const LocationConfig *best = matchBestLocation(config, uri, bestLen);
 
-    if (!best)
-        return make405(request, std::vector<std::string>(),
-            "<html><body><h1>405 Method Not Allowed</h1><p>No matching location</p></body></html>");
+    // Server-level methods may allow POST where no location takes it
+    if (!route)
+        return createErrorResponse(request, HTTP_NOT_FOUND);
 
-    if (!isMethodAllowed(best->allowed_methods, "POST"))
-        return make405(request, best->allowed_methods, "");
+    const LocationConfig *best = &config.locations[route->location_index];
 
     const std::map<std::string, std::string> &hdrs = request.getHeaders();
     std::map<std::string, std::string>::const_iterator it = hdrs.find("Content-Length");
@@ -126,7 +77,7 @@ const std::string HttpResponse::createPostResponse(const HttpRequest &request, c
         return resp.str();
     }
 
-    if (bodyRef.size() < contentLength)
+    if (bodyRef.size() < contentLength && !request.isBodyStreamed())
     {
         const std::string msg = "<html><body><h1>400 Bad Request</h1><p>Incomplete body</p></body></html>";
         std::ostringstream resp;
@@ -138,22 +89,9 @@ const std::string HttpResponse::createPostResponse(const HttpRequest &request, c
         return resp.str();
     }
 
-    std::string baseDir;
-    if (!best->upload_dir.empty())
-        baseDir = best->upload_dir;
-    else if (!best->path.empty())
-        baseDir = best->path;
-    else if (best->location == "/")
-        baseDir = request.getRoot();
-    else
-    {
-        std::string loc = best->location;
-        if (!loc.empty() && loc[0] == '/')
-            loc.erase(0, 1);
-        baseDir = request.getRoot() + "/" + loc;
-    }
+    const std::string &baseDir = route->write_dir;
 
-    std::string suffix = uri.substr(bestLen);
+    std::string suffix = uri.substr(route->prefix_len);
     if (!suffix.empty() && suffix[0] == '/')
         suffix.erase(0, 1);
 
@@ -174,7 +112,8 @@ const std::string HttpResponse::createPostResponse(const HttpRequest &request, c
         targetPath += "/";
     targetPath += suffix;
 
-    if (http_response_helpers::isFastCgiRequest(best, targetPath))
+    if (http_response_helpers::isFastCgiRequest(best, targetPath)
+        || http_response_helpers::isCgiRequest(best, targetPath))
     {
         struct stat st;
         if (stat(targetPath.c_str(), &st) != 0)
@@ -182,8 +121,12 @@ const std::string HttpResponse::createPostResponse(const HttpRequest &request, c
         if (access(targetPath.c_str(), R_OK) != 0)
             return createErrorResponse(request, HTTP_FORBIDDEN);
 
-        FastCgiClient fcgi(request, config, *best, targetPath);
-        return fcgi.execute();
+        // The reply arrives through the event loop; the head is produced by the stream
+        if (best->fastcgi_pass.empty())
+            stream = new CgiProcess(request, config, *best, targetPath);
+        else
+            stream = new FastCgiClient(request, config, *best, targetPath);
+        return "";
     }
 
     const int wfd = open(targetPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
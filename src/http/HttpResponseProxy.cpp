@@ -0,0 +1,53 @@
+#include "HttpResponse.hpp"
+
+#include "ProxyClient.hpp"
+
+#include <sstream>
+
+namespace {
+
+std::string make413(const HttpRequest &request)
+{
+    const std::string msg = "<html><body><h1>413 Payload Too Large</h1></body></html>";
+
+    std::ostringstream resp;
+    resp << request.getHttpVersion() << " 413 Payload Too Large\r\n";
+    resp << "Content-Type: text/html; charset=UTF-8\r\n";
+    resp << "Content-Length: " << msg.size() << "\r\n";
+    resp << "Connection: close\r\n\r\n";
+    resp << msg;
+
+    return resp.str();
+}
+
+// Declared Content-Length, 0 when absent or malformed
+unsigned long contentLength(const HttpRequest &request)
+{
+    const std::map<std::string, std::string> &hdrs = request.getHeaders();
+    std::map<std::string, std::string>::const_iterator it = hdrs.find("Content-Length");
+    if (it == hdrs.end())
+        it = hdrs.find("content-length");
+    if (it == hdrs.end())
+        return 0;
+
+    unsigned long out = 0;
+    std::istringstream iss(it->second);
+    iss >> out;
+    return iss.fail() ? 0 : out;
+}
+
+} // namespace
+
+// proxy_pass: any method the location allows goes upstream as is, HEAD
+// along with GET; createResponse already refused the others
+std::string HttpResponse::createProxyResponse(const HttpRequest &request, const ServerConfig &config)
+{
+    // Refused before the upstream sees a byte of it
+    if (config.client_max_body_size > 0
+        && (contentLength(request) > config.client_max_body_size
+            || request.getBody().size() > config.client_max_body_size))
+        return make413(request);
+
+    stream = new ProxyClient(request, config.locations[route->location_index]);
+    return "";
+}
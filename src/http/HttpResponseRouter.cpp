@@ -1,17 +1,18 @@
 #include "HttpResponse.hpp"
 
+#include "HttpResponseHelpers.hpp"
+#include "macros.hpp"
+
 #include <sstream>
 
-// Define missing function: 405 for unknown/unsupported methods
-const std::string HttpResponse::createUnknowResponse(const HttpRequest &request, const ServerConfig &config) const
+// allowHeader is the "Allow: ...\r\n" line built at config load
+std::string HttpResponse::createMethodNotAllowed(const HttpRequest &request, const std::string &allowHeader) const
 {
-    (void)config;
-
     const std::string body = "<html><body><h1>405 Method Not Allowed</h1></body></html>";
 
     std::ostringstream resp;
     resp << request.getHttpVersion() << " 405 Method Not Allowed\r\n";
-    resp << "Allow: GET, POST, DELETE\r\n";
+    resp << allowHeader;
     resp << "Content-Type: text/html; charset=UTF-8\r\n";
     resp << "Content-Length: " << body.size() << "\r\n";
     resp << "Connection: close\r\n\r\n";
@@ -20,18 +21,68 @@ const std::string HttpResponse::createUnknowResponse(const HttpRequest &request,
     return resp.str();
 }
 
+bool HttpResponse::streamsRequestBody(const HttpRequest &request, const ServerConfig &config)
+{
+    const std::string uri = http_response_helpers::stripQuery(request.getUri());
+    const LocationRoute *route = config.router.match(uri);
+    if (!route)
+        return false;
+    // proxy_pass forwards the body of any method it lets through
+    if (route->handler == ROUTE_PROXY)
+        return (route->methods & LocationRouter::methodBit(request.getMethod())) != 0;
+    if (request.getMethod() != "POST" || !(route->methods & METHOD_POST))
+        return false;
+    const LocationConfig *loc = &config.locations[route->location_index];
+    if (route->handler == ROUTE_FASTCGI)
+        return http_response_helpers::isFastCgiRequest(loc, uri);
+    if (route->handler == ROUTE_CGI)
+        return http_response_helpers::isCgiRequest(loc, uri);
+    return false;
+}
+
 // Entry point: routes to method-specific handler
-std::string HttpResponse::createResponse(const HttpRequest &request, const ServerConfig &config)
+std::string HttpResponse::createResponse(const HttpRequest &request, const ServerConfig &config,
+        ResponseStream *&stream)
 {
     HttpResponse response;
     const std::string &method = request.getMethod();
+    std::string head;
+
+    response.server = &config;
+    response.route = config.router.match(http_response_helpers::stripQuery(request.getUri()));
+
+    if (response.route && response.route->internal)
+        return response.createErrorResponse(request, HTTP_NOT_FOUND);
+
+    // "return" locations answer before any method handling or filesystem work
+    if (response.route && response.route->handler == ROUTE_RETURN)
+        return response.route->return_plan.render(request.getHttpVersion(), request.getUri());
+
+    // Methods are checked here for every handler: the location's, or the
+    // server's outside any location
+    const bool proxied = response.route && response.route->handler == ROUTE_PROXY;
+    unsigned int allowed = response.route ? response.route->methods : config.router.defaultMethods();
+    unsigned int bit = LocationRouter::methodBit(method);
+    // proxy_pass forwards any method as is, HEAD along with GET; the other
+    // handlers only know GET, POST and DELETE
+    if (proxied && bit == METHOD_HEAD && (allowed & METHOD_GET))
+        bit = METHOD_GET;
+    if (!proxied)
+        allowed &= METHOD_GET | METHOD_POST | METHOD_DELETE;
+    if (!(allowed & bit))
+        return response.createMethodNotAllowed(request,
+            response.route ? response.route->allow_header : config.router.defaultAllowHeader());
 
-    if (method == "GET")
-        return response.createGetResponse(request, config);
-    if (method == "POST")
-        return response.createPostResponse(request, config);
-    if (method == "DELETE")
-        return response.createDeleteResponse(request, config);
+    if (proxied)
+        head = response.createProxyResponse(request, config);
+    else if (method == "GET")
+        head = response.createGetResponse(request, config);
+    else if (method == "POST")
+        head = response.createPostResponse(request, config);
+    else
+        head = response.createDeleteResponse(request, config);
 
-    return response.createUnknowResponse(request, config);
+    stream = response.stream;
+    response.stream = NULL;
+    return head;
 }
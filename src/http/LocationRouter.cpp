@@ -0,0 +1,293 @@
+#include "LocationRouter.hpp"
+
+#include "Config.hpp"
+#include "HttpResponse.hpp"
+#include "HttpResponseHelpers.hpp"
+
+namespace {
+
+std::string locationDir(const LocationConfig &loc, const std::string &root)
+{
+    if (loc.location == "/")
+        return root;
+
+    std::string rel = loc.location;
+    if (!rel.empty() && rel[0] == '/')
+        rel.erase(0, 1);
+    return root + "/" + rel;
+}
+
+const std::string kRequestUriVar = "$request_uri";
+
+std::vector<std::string> splitOnRequestUri(const std::string &text)
+{
+    std::vector<std::string> parts;
+    std::string::size_type start = 0;
+    std::string::size_type pos;
+
+    while ((pos = text.find(kRequestUriVar, start)) != std::string::npos)
+    {
+        parts.push_back(text.substr(start, pos - start));
+        start = pos + kRequestUriVar.size();
+    }
+    parts.push_back(text.substr(start));
+    return parts;
+}
+
+void appendJoined(std::string &out, const std::vector<std::string> &parts, const std::string &glue)
+{
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        if (i)
+            out += glue;
+        out += parts[i];
+    }
+}
+
+bool isRedirectCode(int code)
+{
+    return code == 301 || code == 302 || code == 303 || code == 307 || code == 308;
+}
+
+struct ByteLess
+{
+    bool operator()(const std::pair<unsigned char, size_t> &a, unsigned char c) const
+    {
+        return a.first < c;
+    }
+};
+
+} // namespace
+
+void ReturnPlan::build(int code, const std::string &target)
+{
+    std::ostringstream status;
+    status << " " << code << " " << HttpResponse::getReasonPhraseFromCode(code) << "\r\n";
+
+    head.clear();
+    body.clear();
+    body_static_len = 0;
+
+    if (isRedirectCode(code))
+    {
+        head = splitOnRequestUri(status.str() + "Location: " + target
+            + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        return;
+    }
+
+    std::vector<std::string> text = splitOnRequestUri(target);
+    if (text.size() == 1)
+    {
+        std::ostringstream resp;
+        resp << status.str();
+        if (!target.empty())
+            resp << "Content-Type: text/plain\r\n";
+        resp << "Content-Length: " << target.size() << "\r\n";
+        resp << "Connection: close\r\n\r\n" << target;
+        head.push_back(resp.str());
+        return;
+    }
+
+    // Length depends on the URI: keep the head open at "Content-Length: "
+    head.push_back(status.str() + "Content-Type: text/plain\r\nContent-Length: ");
+    body = text;
+    for (size_t i = 0; i < body.size(); ++i)
+        body_static_len += body[i].size();
+}
+
+std::string ReturnPlan::render(const std::string &version, const std::string &request_uri) const
+{
+    std::string out = version;
+
+    appendJoined(out, head, request_uri);
+    if (body.empty())
+        return out;
+
+    std::ostringstream len;
+    len << body_static_len + (body.size() - 1) * request_uri.size();
+    out += len.str();
+    out += "\r\nConnection: close\r\n\r\n";
+    appendJoined(out, body, request_uri);
+    return out;
+}
+
+LocationRouter::LocationRouter()
+    : nodes(1)
+    , routes()
+    , default_methods(0)
+    , default_allow()
+{
+    nodes[0].route = -1;
+}
+
+unsigned int LocationRouter::methodBit(const std::string &method)
+{
+    if (method == "GET")
+        return METHOD_GET;
+    if (method == "POST")
+        return METHOD_POST;
+    if (method == "DELETE")
+        return METHOD_DELETE;
+    if (method == "HEAD")
+        return METHOD_HEAD;
+    if (method == "PUT")
+        return METHOD_PUT;
+    return METHOD_OTHER;
+}
+
+unsigned int LocationRouter::methodMask(const std::vector<std::string> &methods)
+{
+    unsigned int mask = 0;
+
+    for (size_t i = 0; i < methods.size(); ++i)
+        mask |= methodBit(methods[i]);
+    return mask;
+}
+
+void LocationRouter::compile(const std::vector<LocationConfig> &locations, const std::string &root,
+                             const std::vector<std::string> &server_methods)
+{
+    nodes.assign(1, Node());
+    nodes[0].route = -1;
+    routes.clear();
+    routes.reserve(locations.size());
+
+    // Without server-level methods a URI outside every location may be
+    // fetched or deleted under the root, not posted to
+    std::vector<std::string> fallback;
+    fallback.push_back("GET");
+    fallback.push_back("DELETE");
+    const std::vector<std::string> &defaults = server_methods.empty() ? fallback : server_methods;
+    default_methods = methodMask(defaults);
+    default_allow = http_response_helpers::buildAllowHeader(defaults);
+
+    for (size_t i = 0; i < locations.size(); ++i)
+    {
+        const LocationConfig &loc = locations[i];
+        if (loc.location.empty())
+            continue;
+
+        LocationRoute route;
+        route.location_index = i;
+        route.prefix_len = loc.location.size();
+        route.read_dir = !loc.path.empty() ? loc.path
+            : (!loc.upload_dir.empty() ? loc.upload_dir : locationDir(loc, root));
+        route.write_dir = !loc.upload_dir.empty() ? loc.upload_dir
+            : (!loc.path.empty() ? loc.path : locationDir(loc, root));
+        route.methods = methodMask(loc.allowed_methods);
+        route.allow_header = loc.allowed_methods.empty() ? ""
+            : http_response_helpers::buildAllowHeader(loc.allowed_methods);
+        route.handler = ROUTE_STATIC;
+        route.internal = loc.internal;
+        if (!loc.proxy_pass.empty())
+            route.handler = ROUTE_PROXY;
+        else if (!loc.fastcgi_pass.empty())
+            route.handler = ROUTE_FASTCGI;
+        else if (!loc.cgi_path.empty())
+            route.handler = ROUTE_CGI;
+        if (loc.has_return)
+        {
+            route.handler = ROUTE_RETURN;
+            route.return_plan.build(loc.return_code, loc.return_target);
+        }
+
+        routes.push_back(route);
+        insert(loc.location, static_cast<int>(routes.size() - 1));
+    }
+}
+
+int LocationRouter::findChild(const Node &node, unsigned char c) const
+{
+    std::vector<std::pair<unsigned char, size_t> >::const_iterator it =
+        std::lower_bound(node.children.begin(), node.children.end(), c, ByteLess());
+
+    if (it == node.children.end() || it->first != c)
+        return -1;
+    return static_cast<int>(it->second);
+}
+
+void LocationRouter::addChild(size_t parent, unsigned char c, size_t child)
+{
+    std::vector<std::pair<unsigned char, size_t> > &kids = nodes[parent].children;
+    std::vector<std::pair<unsigned char, size_t> >::iterator it =
+        std::lower_bound(kids.begin(), kids.end(), c, ByteLess());
+
+    if (it != kids.end() && it->first == c)
+        it->second = child;
+    else
+        kids.insert(it, std::make_pair(c, child));
+}
+
+void LocationRouter::insert(const std::string &key, int route)
+{
+    size_t cur = 0;
+    size_t pos = 0;
+
+    while (pos < key.size())
+    {
+        const unsigned char c = static_cast<unsigned char>(key[pos]);
+        const int idx = findChild(nodes[cur], c);
+
+        if (idx < 0)
+        {
+            Node leaf;
+            leaf.label = key.substr(pos);
+            leaf.route = route;
+            nodes.push_back(leaf);
+            addChild(cur, c, nodes.size() - 1);
+            return;
+        }
+
+        const size_t child = static_cast<size_t>(idx);
+        const std::string &label = nodes[child].label;
+        size_t common = 0;
+        while (common < label.size() && pos + common < key.size()
+            && label[common] == key[pos + common])
+            ++common;
+
+        if (common < label.size())
+        {
+            // Split the edge: cur -> mid(label[0,common)) -> child(label[common..])
+            Node mid;
+            mid.label = label.substr(0, common);
+            mid.route = -1;
+            const unsigned char rest = static_cast<unsigned char>(label[common]);
+            nodes[child].label.erase(0, common);
+            nodes.push_back(mid);
+            const size_t midIdx = nodes.size() - 1;
+            addChild(midIdx, rest, child);
+            addChild(cur, c, midIdx);
+            cur = midIdx;
+        }
+        else
+            cur = child;
+        pos += common;
+    }
+
+    // Duplicate locations keep the first declaration, like the old linear scan
+    if (nodes[cur].route < 0)
+        nodes[cur].route = route;
+}
+
+const LocationRoute *LocationRouter::match(const std::string &uri) const
+{
+    const LocationRoute *best = NULL;
+    size_t cur = 0;
+    size_t pos = 0;
+
+    while (pos < uri.size())
+    {
+        const int idx = findChild(nodes[cur], static_cast<unsigned char>(uri[pos]));
+        if (idx < 0)
+            break;
+
+        const Node &child = nodes[static_cast<size_t>(idx)];
+        if (uri.compare(pos, child.label.size(), child.label) != 0)
+            break;
+        pos += child.label.size();
+        cur = static_cast<size_t>(idx);
+        if (child.route >= 0)
+            best = &routes[static_cast<size_t>(child.route)];
+    }
+    return best;
+}
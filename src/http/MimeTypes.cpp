@@ -0,0 +1,176 @@
+#include "MimeTypes.hpp"
+
+#include <cctype>
+
+namespace {
+
+struct DefaultType
+{
+    const char *ext;
+    const char *type;
+};
+
+const DefaultType kDefaults[] = {
+    {"html", "text/html; charset=UTF-8"},
+    {"htm", "text/html; charset=UTF-8"},
+    {"shtml", "text/html; charset=UTF-8"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"xml", "application/xml"},
+    {"txt", "text/plain"},
+    {"csv", "text/csv"},
+    {"md", "text/markdown"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"ico", "image/x-icon"},
+    {"bmp", "image/bmp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogv", "video/ogg"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"m4a", "audio/mp4"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tar", "application/x-tar"}
+};
+
+const size_t kInitialSlots = 128u;
+
+} // namespace
+
+MimeTypes::MimeTypes()
+    : slots(kInitialSlots)
+    , types()
+    , count(0)
+{
+    for (size_t i = 0; i < sizeof(kDefaults) / sizeof(kDefaults[0]); ++i)
+        set(kDefaults[i].ext, kDefaults[i].type);
+}
+
+const std::string &MimeTypes::defaultType()
+{
+    static const std::string fallback = "application/octet-stream";
+    return fallback;
+}
+
+// FNV-1a over the lowercased bytes
+unsigned long MimeTypes::hash(const char *s, size_t len)
+{
+    unsigned long h = 2166136261UL;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(s[i])));
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+bool MimeTypes::sameExt(const std::string &key, const char *s, size_t len)
+{
+    if (key.size() != len)
+        return false;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (key[i] != std::tolower(static_cast<unsigned char>(s[i])))
+            return false;
+    }
+    return true;
+}
+
+size_t MimeTypes::internType(const std::string &type)
+{
+    for (size_t i = 0; i < types.size(); ++i)
+    {
+        if (types[i] == type)
+            return i;
+    }
+    types.push_back(type);
+    return types.size() - 1;
+}
+
+void MimeTypes::grow()
+{
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.resize(old.size() * 2);
+    count = 0;
+
+    const size_t mask = slots.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i)
+    {
+        if (old[i].ext.empty())
+            continue;
+        size_t pos = hash(old[i].ext.data(), old[i].ext.size()) & mask;
+        while (!slots[pos].ext.empty())
+            pos = (pos + 1) & mask;
+        slots[pos] = old[i];
+        ++count;
+    }
+}
+
+void MimeTypes::set(const std::string &extension, const std::string &type)
+{
+    std::string ext = extension;
+    if (!ext.empty() && ext[0] == '.')
+        ext.erase(0, 1);
+    if (ext.empty() || type.empty())
+        return;
+    for (size_t i = 0; i < ext.size(); ++i)
+        ext[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(ext[i])));
+
+    // keep the load factor under 1/2 so probe chains stay short
+    if ((count + 1) * 2 > slots.size())
+        grow();
+
+    const size_t mask = slots.size() - 1;
+    size_t pos = hash(ext.data(), ext.size()) & mask;
+    while (!slots[pos].ext.empty() && slots[pos].ext != ext)
+        pos = (pos + 1) & mask;
+    if (slots[pos].ext.empty())
+        ++count;
+    slots[pos].ext = ext;
+    slots[pos].type = internType(type);
+}
+
+const std::string &MimeTypes::lookup(const std::string &path) const
+{
+    const std::string::size_type dot = path.rfind('.');
+    if (dot == std::string::npos || dot + 1 >= path.size())
+        return defaultType();
+
+    const std::string::size_type slash = path.rfind('/');
+    if (slash != std::string::npos && slash > dot)
+        return defaultType();
+
+    const char *ext = path.data() + dot + 1;
+    const size_t len = path.size() - dot - 1;
+    const size_t mask = slots.size() - 1;
+    size_t pos = hash(ext, len) & mask;
+
+    while (!slots[pos].ext.empty())
+    {
+        if (sameExt(slots[pos].ext, ext, len))
+            return types[slots[pos].type];
+        pos = (pos + 1) & mask;
+    }
+    return defaultType();
+}
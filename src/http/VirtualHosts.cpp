@@ -0,0 +1,211 @@
+#include "VirtualHosts.hpp"
+#include "Config.hpp"
+
+#include <cctype>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+const size_t kInitialSlots = 64;
+
+std::string lowercase(std::string s)
+{
+    for (size_t i = 0; i < s.size(); ++i)
+        s[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(s[i])));
+    return s;
+}
+
+std::string portText(int port)
+{
+    std::ostringstream oss;
+    oss << port;
+    return oss.str();
+}
+
+} // namespace
+
+VirtualHosts::VirtualHosts(const std::vector<ServerConfig> &servers)
+    : all(&servers)
+    , slots(kInitialSlots)
+    , count(0)
+    , defaults()
+    , ignored()
+{
+    std::map<int, bool> explicit_default;
+    for (size_t i = 0; i < servers.size(); ++i)
+    {
+        const ServerConfig &server = servers[i];
+        if (server.default_server)
+        {
+            if (explicit_default[server.port])
+                throw std::runtime_error("a duplicate default server for port " + portText(server.port));
+            explicit_default[server.port] = true;
+            defaults[server.port] = i;
+        }
+        else if (!defaults.count(server.port))
+            defaults[server.port] = i;
+        for (size_t n = 0; n < server.server_names.size(); ++n)
+            addName(server.port, server.server_names[n], i);
+    }
+}
+
+// FNV-1a over the port and the lowercased name
+unsigned long VirtualHosts::hash(int port, const char *s, size_t len)
+{
+    unsigned long h = 2166136261UL;
+
+    h = (h ^ static_cast<unsigned long>(port & 0xff)) * 16777619UL;
+    h = (h ^ static_cast<unsigned long>((port >> 8) & 0xff)) * 16777619UL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(s[i])));
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+bool VirtualHosts::sameName(const std::string &key, const char *s, size_t len)
+{
+    if (key.size() != len)
+        return false;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (key[i] != std::tolower(static_cast<unsigned char>(s[i])))
+            return false;
+    }
+    return true;
+}
+
+void VirtualHosts::grow()
+{
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.resize(old.size() * 2);
+    count = 0;
+
+    const size_t mask = slots.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i)
+    {
+        if (old[i].port == 0)
+            continue;
+        size_t pos = hash(old[i].port, old[i].name.data(), old[i].name.size()) & mask;
+        while (slots[pos].port != 0)
+            pos = (pos + 1) & mask;
+        slots[pos] = old[i];
+        ++count;
+    }
+}
+
+const VirtualHosts::Slot *VirtualHosts::find(int port, const char *s, size_t len) const
+{
+    const size_t mask = slots.size() - 1;
+    size_t pos = hash(port, s, len) & mask;
+
+    while (slots[pos].port != 0)
+    {
+        if (slots[pos].port == port && sameName(slots[pos].name, s, len))
+            return &slots[pos];
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+// The first block to claim a name on a port keeps it
+void VirtualHosts::insert(int port, const std::string &name, size_t server)
+{
+    if (find(port, name.data(), name.size()))
+    {
+        ignored.push_back("\"" + name + "\" on port " + portText(port));
+        return;
+    }
+    // keep the load factor under 1/2 so probe chains stay short
+    if ((count + 1) * 2 > slots.size())
+        grow();
+
+    const size_t mask = slots.size() - 1;
+    size_t pos = hash(port, name.data(), name.size()) & mask;
+    while (slots[pos].port != 0)
+        pos = (pos + 1) & mask;
+    slots[pos].port = port;
+    slots[pos].name = name;
+    slots[pos].server = server;
+    ++count;
+}
+
+void VirtualHosts::addName(int port, const std::string &server_name, size_t server)
+{
+    std::string name = lowercase(server_name);
+    while (!name.empty() && name[name.size() - 1] == '.')
+        name.erase(name.size() - 1);
+    // "_" and "" are the usual catch-all placeholders
+    if (name.empty() || name == "_")
+        return;
+
+    const std::string::size_type star = name.find('*');
+    if (star == std::string::npos)
+    {
+        insert(port, name[0] == '.' ? name.substr(1) : name, server);
+        // ".example.com" is example.com and all its subdomains
+        if (name[0] == '.' && name.size() > 1)
+            insert(port, name, server);
+    }
+    else if (star == 0 && name.size() > 2 && name[1] == '.' && name.find('*', 1) == std::string::npos)
+        insert(port, name.substr(1), server); // "*.example.com" -> ".example.com"
+    else if (star == name.size() - 1 && name.size() > 2 && name[star - 1] == '.')
+        insert(port, name.substr(0, star), server); // "www.example.*" -> "www.example."
+    else
+        throw std::runtime_error("invalid server_name \"" + server_name
+                                 + "\": wildcards are only allowed as \"*.name\" or \"name.*\"");
+}
+
+const ServerConfig &VirtualHosts::defaultServer(int port) const
+{
+    std::map<int, size_t>::const_iterator it = defaults.find(port);
+    return (*all)[it == defaults.end() ? 0 : it->second];
+}
+
+const ServerConfig &VirtualHosts::resolve(int port, const std::string &host) const
+{
+    const char *s = host.data();
+    size_t len = host.size();
+
+    // "name:port" and the absolute form "name."
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (s[i] == ':')
+        {
+            len = i;
+            break;
+        }
+    }
+    while (len > 0 && s[len - 1] == '.')
+        --len;
+    if (len == 0)
+        return defaultServer(port);
+
+    const Slot *slot = find(port, s, len);
+    if (slot)
+        return (*all)[slot->server];
+    // Longest "*.example.com" first: the leftmost dot leaves the longest suffix
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (s[i] == '.' && (slot = find(port, s + i, len - i)) != NULL)
+            return (*all)[slot->server];
+    }
+    // Then the longest "www.example.*"
+    for (size_t i = len; i > 1; --i)
+    {
+        if (s[i - 1] == '.' && (slot = find(port, s, i)) != NULL)
+            return (*all)[slot->server];
+    }
+    return defaultServer(port);
+}
+
+std::vector<int> VirtualHosts::ports() const
+{
+    std::vector<int> result;
+    for (std::map<int, size_t>::const_iterator it = defaults.begin(); it != defaults.end(); ++it)
+        result.push_back(it->first);
+    return result;
+}
@@ -2,6 +2,8 @@
 #include "Config.hpp"
 #include "ProcessManager.hpp"
 #include "FastCgiBackend.hpp"
+#include "FastCgiCache.hpp"
+#include "VirtualHosts.hpp"
 
 static std::vector<ServerConfig>	loadConfigs(const std::string &path)
 {
@@ -13,25 +15,71 @@ static std::vector<ServerConfig>	loadConfigs(const std::string &path)
 
 	if (parsed.empty())
 		throw std::runtime_error("Config did not produce any server entries");
+	// Server names are checked here, before any worker depends on them
+	VirtualHosts	check(parsed);
+	for (size_t i = 0; i < check.conflicts().size(); ++i)
+		std::cerr << "Warning: conflicting server name " << check.conflicts()[i] << ", ignored" << std::endl;
 	cfg.printDebug(std::cout);
 	return std::vector<ServerConfig>(parsed.begin(), parsed.end());
 }
 
-static void	launchServers(ProcessManager &pm,
+// False when a worker could not be started; the others keep running
+static bool	launchServers(ProcessManager &pm,
 							const std::vector<ServerConfig> &configs)
 {
-	std::vector<ServerConfig>::const_iterator	it;
-	pid_t										pid;
+	const int	workers = configs.front().worker_processes;
+	pid_t		pid;
 
-	std::cout << "Launching " << configs.size() << " server instance(s)."
-		<< std::endl;
-	for (it = configs.begin(); it != configs.end(); ++it)
+	std::cout << "Launching " << configs.size() << " server(s) in " << workers
+		<< " worker process(es)." << std::endl;
+	for (int i = 0; i < workers; ++i)
 	{
-		pid = pm.spawnServerProcess(*it);
-		pm.addProcess(pid, it->port, it->server_name);
-		std::cout << "Spawned server PID " << pid << " on port "
-			<< it->port << " (" << it->server_name << ")" << std::endl;
+		pid = pm.spawnWorker(configs, i);
+		if (pid < 0)
+			return (false);
+		std::ostringstream	name;
+		name << "worker " << i;
+		pm.addProcess(pid, name.str());
+		std::cout << "Spawned worker PID " << pid << std::endl;
 	}
+	return (true);
+}
+
+// SIGHUP: a config that does not load, or servers that do not all start,
+// leave the running servers alone. FastCGI backends keep running as started; new cache zones are added.
+static void	reloadServers(ProcessManager &pm, const std::string &path)
+{
+	std::vector<ServerConfig>	configs;
+	bool						started;
+
+	std::cout << "Reloading " << path << std::endl;
+	try
+	{
+		configs = loadConfigs(path);
+		FastCgiCache::createZones(configs.front().cache_zones);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "Reload failed, keeping the current servers: " << e.what() << std::endl;
+		return ;
+	}
+	pm.beginGeneration();
+	try
+	{
+		started = launchServers(pm, configs);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		started = false;
+	}
+	if (!started)
+	{
+		std::cerr << "Reload failed, keeping the current servers" << std::endl;
+		pm.abandonGeneration();
+		return ;
+	}
+	pm.retireOldServers();
 }
 
 int	main(int ac, char *av[], char **env)
@@ -48,18 +96,42 @@ int	main(int ac, char *av[], char **env)
 	try
 	{
 		pm.installSignalHandlers();
+		pm.resolveExecutable(av[0]);
+		pm.adoptListeners();
 
 		std::vector<ServerConfig>	configs = loadConfigs(av[1]);
 
+		// Mapped here so every server process inherits the same arenas
+		FastCgiCache::createZones(configs.front().cache_zones);
 		fcgi.ensureBackendsRunning(configs, env);
+		pm.setSupervisor(&fcgi);
 		launchServers(pm, configs);
-		pm.monitorChildren();
+		// Inherited sockets the config no longer uses
+		pm.retireOldServers();
+		for (;;)
+		{
+			pm.monitorChildren();
+			if (ProcessManager::g_stopRequested)
+				break;
+			if (ProcessManager::g_reloadRequested)
+			{
+				ProcessManager::g_reloadRequested = 0;
+				reloadServers(pm, av[1]);
+			}
+			else if (ProcessManager::g_upgradeRequested)
+			{
+				ProcessManager::g_upgradeRequested = 0;
+				pm.upgradeBinary(av);
+			}
+			else
+				break;
+		}
 	}
 	catch (const std::exception &e)
 	{
 		if (pm.hasChildren())
 		{
-			pm.terminateAll();
+			pm.terminateAll(SIGINT);
 			int	status = 0;
 			while (waitpid(-1, &status, WNOHANG) > 0);
 		}
@@ -6,10 +6,16 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 #include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <csignal>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sstream>
 
 const int TEST_PORT = 8080;
@@ -52,29 +58,98 @@ std::string send_http_request(const std::string &request)
         return "__SEND_FAIL__";
     }
 
+    // Every request says "Connection: close": a chunked body may come in
+    // several segments after the head, so read until the server closes
     std::string response;
     char buffer[4096];
     ssize_t n;
-    while ((n = recv(sock, buffer, sizeof(buffer) - 1, 0)) > 0)
+    while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+        response.append(buffer, n);
+
+    close(sock);
+    return response;
+}
+
+// Sends request in pieces, gap_ms apart, and reads the reply until the
+// server closes
+std::string send_in_pieces(const std::vector<std::string> &pieces, int gap_ms)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return "__SOCKET_FAIL__";
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TEST_PORT);
+    inet_pton(AF_INET, TEST_HOST.c_str(), &addr.sin_addr);
+    if (connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
     {
-        buffer[n] = '\0';
-        response.append(buffer);
-        // Check if we got the full response
-        if (response.find("\r\n\r\n") != std::string::npos)
-        {
-            // For chunked or simple responses, break after reasonable data
-            if (response.find("Content-Length:") != std::string::npos ||
-                response.find("Connection: close") != std::string::npos)
-            {
-                break;
-            }
-        }
+        close(sock);
+        return "__CONNECT_FAIL__";
+    }
+
+    for (size_t i = 0; i < pieces.size(); ++i)
+    {
+        if (i)
+            usleep(gap_ms * 1000);
+        // A server that answered early (413) may have closed already
+        if (send(sock, pieces[i].data(), pieces[i].size(), MSG_NOSIGNAL) < 0)
+            break;
     }
 
+    std::string response;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+        response.append(buffer, n);
     close(sock);
     return response;
 }
 
+std::string get(const std::string &uri)
+{
+    std::vector<std::string> request(1,
+        "GET " + uri + " HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Connection: close\r\n"
+        "\r\n");
+    return send_in_pieces(request, 0);
+}
+
+std::string header_value(const std::string &response, const std::string &name)
+{
+    const std::string::size_type pos = response.find("\r\n" + name + ": ");
+    if (pos == std::string::npos)
+        return "";
+    const std::string::size_type start = pos + name.size() + 4;
+    return response.substr(start, response.find("\r\n", start) - start);
+}
+
+std::string body_of(const std::string &response)
+{
+    const std::string::size_type pos = response.find("\r\n\r\n");
+    if (pos == std::string::npos)
+        return "";
+    if (header_value(response.substr(0, pos + 2), "Transfer-Encoding") != "chunked")
+        return response.substr(pos + 4);
+
+    std::string body;
+    std::string::size_type at = pos + 4;
+    for (;;)
+    {
+        const std::string::size_type eol = response.find("\r\n", at);
+        if (eol == std::string::npos)
+            break;
+        const size_t size = std::strtoul(response.substr(at, eol - at).c_str(), NULL, 16);
+        if (size == 0)
+            break;
+        body += response.substr(eol + 2, size);
+        at = eol + 2 + size + 2;
+    }
+    return body;
+}
+
 bool contains(const std::string &haystack, const std::string &needle)
 {
     return haystack.find(needle) != std::string::npos;
@@ -268,6 +343,173 @@ void test_fastcgi_not_found()
                 "Should return 404 for missing script");
 }
 
+void test_streamed_post(const std::string &prefix, const std::string &kind)
+{
+    const size_t size = 300000;
+    std::ostringstream head;
+    head << "POST " << prefix << "/test_echo.py HTTP/1.1\r\n"
+         << "Host: localhost\r\n"
+         << "Content-Type: text/plain\r\n"
+         << "Content-Length: " << size << "\r\n"
+         << "Connection: close\r\n"
+         << "\r\n";
+
+    // The body trickles in after the headers: it is streamed to the script
+    std::vector<std::string> pieces;
+    pieces.push_back(head.str());
+    pieces.push_back(std::string(size / 3, 'a'));
+    pieces.push_back(std::string(size / 3, 'b'));
+    pieces.push_back(std::string(size - 2 * (size / 3), 'c'));
+    std::string response = send_in_pieces(pieces, 200);
+
+    test_result(kind + " streamed POST: Returns 200 OK",
+                contains(response, "HTTP/1.1 200"),
+                "Status line not found");
+    test_result(kind + " streamed POST: Whole body received",
+                contains(response, "Length: 300000 bytes"),
+                "Script did not get every body byte");
+
+    pieces.clear();
+    pieces.push_back(
+        "POST " + prefix + "/test_echo.py HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 11000000\r\n"
+        "Connection: close\r\n"
+        "\r\n");
+    pieces.push_back(std::string(4096, 'x'));
+    response = send_in_pieces(pieces, 100);
+
+    test_result(kind + " streamed POST: 413 over client_max_body_size",
+                contains(response, "413"),
+                "Oversized body was not refused");
+}
+
+void test_fastcgi_cache()
+{
+    std::ostringstream oss;
+    oss << "/cached/test_cache.py?ttl=1&swr=30&run=" << std::time(NULL) << getpid();
+    const std::string uri = oss.str();
+
+    const std::string first = get(uri);
+    const std::string second = get(uri);
+    test_result("FastCGI Cache: Fresh hit",
+                header_value(second, "X-Cache") == "HIT" && body_of(second) == body_of(first),
+                "Second request was not served from the cache");
+
+    sleep(2);
+    const std::string stale = get(uri);
+    test_result("FastCGI Cache: Stale reply served while refreshing",
+                header_value(stale, "X-Cache") == "UPDATING" && body_of(stale) == body_of(first),
+                "Stale entry not served within stale-while-revalidate");
+
+    // The refreshed entry is only fresh for a second itself
+    usleep(500000);
+    const std::string refreshed = get(uri);
+    test_result("FastCGI Cache: Background refresh stored",
+                !header_value(refreshed, "X-Cache").empty() && body_of(refreshed) != body_of(first),
+                "Entry was not refreshed");
+}
+
+// Minimal FastCGI responder: answers every request with "breaker-ok"
+void run_responder(int listen_fd)
+{
+    for (;;)
+    {
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn < 0)
+            continue;
+        std::string in;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = recv(conn, buffer, sizeof(buffer), 0)) > 0)
+        {
+            in.append(buffer, n);
+            while (in.size() >= 8)
+            {
+                const unsigned char *h = reinterpret_cast<const unsigned char *>(in.data());
+                const size_t length = (h[4] << 8) | h[5];
+                const size_t total = 8 + length + h[6];
+                if (in.size() < total)
+                    break;
+                const unsigned char type = h[1];
+                const unsigned char id_hi = h[2];
+                const unsigned char id_lo = h[3];
+                in.erase(0, total);
+                std::string out;
+                if (type == 9)
+                {
+                    // GET_VALUES: nothing to announce
+                    const char result[8] = {1, 10, 0, 0, 0, 0, 0, 0};
+                    out.assign(result, 8);
+                }
+                else if (type == 5 && length == 0)
+                {
+                    const std::string reply = "Content-Type: text/plain\r\n\r\nbreaker-ok";
+                    const char stdout_head[8] = {1, 6, static_cast<char>(id_hi), static_cast<char>(id_lo),
+                                                 0, static_cast<char>(reply.size()), 0, 0};
+                    const char stdout_end[8] = {1, 6, static_cast<char>(id_hi), static_cast<char>(id_lo), 0, 0, 0, 0};
+                    const char end[16] = {1, 3, static_cast<char>(id_hi), static_cast<char>(id_lo), 0, 8, 0, 0,
+                                          0, 0, 0, 0, 0, 0, 0, 0};
+                    out.append(stdout_head, 8);
+                    out += reply;
+                    out.append(stdout_end, 8);
+                    out.append(end, 16);
+                }
+                if (!out.empty())
+                    send(conn, out.data(), out.size(), MSG_NOSIGNAL);
+            }
+        }
+        close(conn);
+    }
+}
+
+void test_circuit_breaker()
+{
+    std::string response = get("/flaky/test_get.py");
+    test_result("FastCGI Breaker: Dead server fails",
+                contains(response, "502") || contains(response, "504"),
+                "Expected a gateway error");
+
+    response = get("/flaky/test_get.py");
+    test_result("FastCGI Breaker: Opens after max_fails",
+                contains(response, "503"),
+                "Open breaker should fail fast with 503");
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(9001);
+    inet_pton(AF_INET, "127.0.0.2", &addr.sin_addr);
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd, 8) < 0)
+    {
+        close(listen_fd);
+        test_result("FastCGI Breaker: Closes once the server is back", false, "Cannot listen on 127.0.0.2:9001");
+        return;
+    }
+    pid_t responder = fork();
+    if (responder == 0)
+    {
+        run_responder(listen_fd);
+        _exit(0);
+    }
+    close(listen_fd);
+
+    // Past fail_timeout one trial request is let through
+    sleep(3);
+    response = get("/flaky/test_get.py");
+    const std::string again = get("/flaky/test_get.py");
+    test_result("FastCGI Breaker: Closes once the server is back",
+                contains(response, "breaker-ok") && contains(again, "breaker-ok"),
+                "Trial request did not close the breaker");
+
+    kill(responder, SIGTERM);
+    waitpid(responder, NULL, 0);
+}
+
 int main()
 {
     std::cout << "\n==================================" << std::endl;
@@ -303,6 +545,16 @@ int main()
     
     test_fastcgi_not_found();
     std::cout << std::endl;
+
+    test_streamed_post("/cgi-bin", "FastCGI");
+    test_streamed_post("/cgi", "CGI");
+    std::cout << std::endl;
+
+    test_fastcgi_cache();
+    std::cout << std::endl;
+
+    test_circuit_breaker();
+    std::cout << std::endl;
     
     std::cout << "==================================" << std::endl;
     std::cout << "Test Results:" << std::endl;
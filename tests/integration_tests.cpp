@@ -1,5 +1,7 @@
 // integration_tests.cpp
-// Unified test suite: basic HTTP, multi-client concurrency, stress, 404, invalid method
+// Unified test suite: basic HTTP, multi-client concurrency, stress, 404, invalid method,
+// location routing and return, proxy_pass, virtual hosts and graceful shutdown
+// Run through run_tests.sh, which serves config/integration_test.conf
 // Build separately from server (server uses -std=c++98). Tests use C++11.
 
 #include <iostream>
@@ -11,6 +13,7 @@
 #include <chrono>
 #include <cstring>
 #include <cstdlib>
+#include <csignal>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -21,6 +24,7 @@ static const int TEST_PORT = 8080;
 static const char *TEST_HOST = "127.0.0.1";
 static const int CONNECT_RETRY_MS = 50;
 static const int CONNECT_TIMEOUT_MS = 4000;
+static const int BACKEND_PORT = 8082; // proxy_pass target in integration_test.conf
 
 std::mutex g_out_mutex;
 
@@ -167,6 +171,136 @@ StressStats stress_test(int threads_count, int iterations_per_thread)
     return stats;
 }
 
+std::string get_with_host(const std::string &path, const std::string &host)
+{
+    return send_http_request("GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n\r\n");
+}
+
+bool has(const std::string &resp, const std::string &needle)
+{
+    return resp.find(needle) != std::string::npos;
+}
+
+// Headers only, so a body echoing the request head cannot match
+std::string head_of(const std::string &resp)
+{
+    return resp.substr(0, resp.find("\r\n\r\n") + 2);
+}
+
+bool location_routing_test()
+{
+    std::string api = get_with_host("/docs/api/v1", "localhost");
+    std::string docs = get_with_host("/docs/x", "localhost");
+    std::string old = get_with_host("/old/page", "localhost");
+    bool ok = has(api, "HTTP/1.1 200") && has(api, "api /docs/api/v1");
+    ok = ok && has(docs, "HTTP/1.1 200") && has(docs, "\r\n\r\ndocs");
+    ok = ok && has(old, "HTTP/1.1 301") && has(old, "Location: /new/old/page\r\n");
+    return ok;
+}
+
+bool virtual_hosts_test()
+{
+    bool ok = has(get_with_host("/", "exact.test"), "vhost exact");
+    ok = ok && has(get_with_host("/", "EXACT.test:8080"), "vhost exact");
+    ok = ok && has(get_with_host("/", "a.b.wild.test"), "vhost wildcard-prefix");
+    ok = ok && has(get_with_host("/", "www.suffix.org"), "vhost wildcard-suffix");
+    ok = ok && has(get_with_host("/", "nobody.test"), "vhost default");
+    ok = ok && has(get_with_host("/", "localhost"), "<html");
+    return ok;
+}
+
+// Stands in for an upstream: echoes the request head it got back as the
+// body, with hop-by-hop headers of its own; /slow answers after a second
+void proxy_backend(int listen_fd)
+{
+    while (true)
+    {
+        int c = accept(listen_fd, NULL, NULL);
+        if (c < 0) continue;
+        std::string req;
+        char buf[4096];
+        while (req.find("\r\n\r\n") == std::string::npos)
+        {
+            ssize_t r = recv(c, buf, sizeof(buf), 0);
+            if (r <= 0) break;
+            req.append(buf, r);
+        }
+        std::string body = req;
+        if (req.compare(0, 10, "GET /slow ") == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            body = "drained";
+        }
+        std::string resp = "HTTP/1.1 200 OK\r\n"
+            "Connection: close, X-Hop-Resp\r\n"
+            "X-Hop-Resp: secret\r\n"
+            "Keep-Alive: timeout=5\r\n"
+            "X-End: kept\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        send(c, resp.data(), resp.size(), MSG_NOSIGNAL);
+        close(c);
+    }
+}
+
+bool start_proxy_backend()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr; std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BACKEND_PORT);
+    addr.sin_addr.s_addr = inet_addr(TEST_HOST);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+    {
+        close(fd); return false;
+    }
+    std::thread(proxy_backend, fd).detach();
+    return true;
+}
+
+bool proxy_hop_by_hop_test()
+{
+    std::string req = "GET /proxy/echo HTTP/1.1\r\nHost: localhost\r\n"
+        "Connection: close, X-Hop-Req\r\n"
+        "X-Hop-Req: secret\r\n"
+        "Keep-Alive: 300\r\n"
+        "X-End-Req: kept\r\n\r\n";
+    std::string resp = send_http_request(req);
+    std::string head = head_of(resp);
+    // What the backend saw, echoed as the body
+    std::string seen = resp.substr(head.size());
+    bool ok = has(head, "HTTP/1.1 200") && has(seen, "GET /echo ");
+    ok = ok && has(seen, "X-End-Req: kept") && !has(seen, "X-Hop-Req") && !has(seen, "Keep-Alive");
+    ok = ok && has(head, "X-End: kept") && !has(head, "X-Hop-Resp") && !has(head, "Keep-Alive");
+    return ok;
+}
+
+// SIGQUIT to the master: the in-flight request still completes, then the
+// server stops accepting
+bool graceful_shutdown_test(pid_t server)
+{
+    std::string resp;
+    std::thread slow([&resp]() { resp = get_with_host("/proxy/slow", "localhost"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    kill(server, SIGQUIT);
+    slow.join();
+    bool ok = has(resp, "HTTP/1.1 200") && has(resp, "drained");
+
+    int elapsed = 0;
+    while (ok && elapsed < CONNECT_TIMEOUT_MS)
+    {
+        int s = connect_to_server();
+        if (s < 0) return true;
+        close(s);
+        std::this_thread::sleep_for(std::chrono::milliseconds(CONNECT_RETRY_MS));
+        elapsed += CONNECT_RETRY_MS;
+    }
+    return false;
+}
+
 bool wait_for_server_ready()
 {
     int elapsed = 0;
@@ -219,7 +353,31 @@ int main()
     std::cout << "[TEST] Stress: total=" << s.total << " ok=" << s.ok << " failed=" << s.failed
               << " time=" << s.seconds << "s RPS=" << (s.total / (s.seconds>0? s.seconds:1)) << std::endl;
 
-    bool overall = basic && nf && invalid && multi && (s.failed == 0);
+    // 4. Location routing: longest prefix, return with $request_uri
+    bool routing = location_routing_test();
+    std::cout << "[TEST] Location routing and return: " << (routing ? "PASS" : "FAIL") << std::endl;
+
+    // 5. proxy_pass drops hop-by-hop headers both ways
+    bool proxy = start_proxy_backend() && proxy_hop_by_hop_test();
+    std::cout << "[TEST] Proxy hop-by-hop headers: " << (proxy ? "PASS" : "FAIL") << std::endl;
+
+    // 6. Virtual hosts: exact, *.name, name.*, default_server
+    bool vhosts = virtual_hosts_test();
+    std::cout << "[TEST] Virtual hosts: " << (vhosts ? "PASS" : "FAIL") << std::endl;
+
+    // 7. Graceful shutdown, last since it stops the server
+    bool drain = true;
+    const char *server_pid = std::getenv("WEBSERV_PID");
+    if (server_pid)
+    {
+        drain = proxy && graceful_shutdown_test(std::atoi(server_pid));
+        std::cout << "[TEST] SIGQUIT drain: " << (drain ? "PASS" : "FAIL") << std::endl;
+    }
+    else
+        std::cout << "[TEST] SIGQUIT drain: SKIP (WEBSERV_PID not set)" << std::endl;
+
+    bool overall = basic && nf && invalid && multi && (s.failed == 0)
+        && routing && proxy && vhosts && drain;
     std::cout << "[TEST] Overall: " << (overall ? "PASS" : "FAIL") << std::endl;
     return overall ? 0 : 1;
 }